@@ -0,0 +1,230 @@
+/*
+ * t-aes.c - testing and benchmarking AES-128 for keystore
+ * Copyright (C) 2026 agent <agent@local>
+ *
+ * Run following commands in the src directory.
+
+  gcc -Wall -O2 -c aes128.c
+  gcc -Wall -O2 -I../polarssl/include -c ../polarssl/library/aes.c
+  gcc -Wall -O2 -I. -I../polarssl/include -c ../misc/t-aes.c
+  gcc -o t-aes t-aes.o aes128.o aes.o
+  ./t-aes
+
+ * It checks the test vectors of FIPS-197 and SP 800-38A (CFB128),
+ * compares the result with PolarSSL's implementation for random
+ * keys and lengths, and then shows the throughput of CFB for the
+ * payload of RSA-4096 private key (kdi_len(512) = 528 bytes).
+ *
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "aes128.h"
+#include "polarssl/aes.h"
+
+#define KDI_LEN_4K (512+16)
+
+static void
+hex_to_bin (const char *hex, uint8_t *bin, unsigned int len)
+{
+  unsigned int i;
+
+  for (i = 0; i < len; i++)
+    {
+      unsigned int x;
+
+      sscanf (hex + i * 2, "%02x", &x);
+      bin[i] = x;
+    }
+}
+
+static int
+check_fips197 (void)
+{
+  uint8_t key[16], pt[16], ct[16], out[16];
+  aes128_context ctx;
+
+  hex_to_bin ("000102030405060708090a0b0c0d0e0f", key, 16);
+  hex_to_bin ("00112233445566778899aabbccddeeff", pt, 16);
+  hex_to_bin ("69c4e0d86a7b0430d8cdb78070b4c55a", ct, 16);
+
+  aes128_setkey (&ctx, key);
+  aes128_encrypt (&ctx, pt, out);
+  if (memcmp (out, ct, 16))
+    return 1;
+  aes128_decrypt (&ctx, ct, out);
+  return memcmp (out, pt, 16) != 0;
+}
+
+static int
+check_cfb128 (void)
+{
+  uint8_t key[16], iv[16], pt[64], ct[64], buf[64];
+  aes128_context ctx;
+
+  hex_to_bin ("2b7e151628aed2a6abf7158809cf4f3c", key, 16);
+  hex_to_bin ("000102030405060708090a0b0c0d0e0f", iv, 16);
+  hex_to_bin ("6bc1bee22e409f96e93d7e117393172a"
+	      "ae2d8a571e03ac9c9eb76fac45af8e51"
+	      "30c81c46a35ce411e5fbc1191a0a52ef"
+	      "f69f2445df4f9b17ad2b417be66c3710", pt, 64);
+  hex_to_bin ("3b3fd92eb72dad20333449f8e83cfb4a"
+	      "c8a64537a0b3a93fcde3cdad9f1ce58b"
+	      "26751f67a3cbb140b1808cf187a4f4df"
+	      "c04b05357c5d1c0eeac4c66f9ff7f2e6", ct, 64);
+
+  aes128_setkey (&ctx, key);
+  memcpy (buf, pt, 64);
+  aes128_cfb_encrypt (&ctx, iv, buf, 64);
+  if (memcmp (buf, ct, 64))
+    return 1;
+  aes128_cfb_decrypt (&ctx, iv, buf, 64);
+  return memcmp (buf, pt, 64) != 0;
+}
+
+/* Compare with PolarSSL, for random keys and lengths.  */
+static int
+check_polarssl (unsigned int count)
+{
+  static uint8_t data[KDI_LEN_4K + 64], buf0[KDI_LEN_4K + 64],
+    buf1[KDI_LEN_4K + 64];
+  uint8_t key[16], iv[16], iv0[16];
+  aes128_context ctx;
+  aes_context aes;
+  unsigned int i, j, len;
+  size_t iv_offset;
+
+  for (i = 0; i < count; i++)
+    {
+      for (j = 0; j < 16; j++)
+	{
+	  key[j] = rand ();
+	  iv[j] = rand ();
+	}
+      len = rand () % sizeof data;
+      for (j = 0; j < len; j++)
+	data[j] = rand ();
+
+      aes128_setkey (&ctx, key);
+      aes_setkey_enc (&aes, key, 128);
+
+      memcpy (buf0, data, len);
+      aes128_cfb_encrypt (&ctx, iv, buf0, len);
+      memcpy (buf1, data, len);
+      memcpy (iv0, iv, 16);
+      iv_offset = 0;
+      aes_crypt_cfb128 (&aes, AES_ENCRYPT, len, &iv_offset, iv0, buf1, buf1);
+      if (memcmp (buf0, buf1, len))
+	return 1;
+
+      aes128_cfb_decrypt (&ctx, iv, buf0, len);
+      if (memcmp (buf0, data, len))
+	return 1;
+
+      aes128_encrypt (&ctx, data, buf0);
+      aes_crypt_ecb (&aes, AES_ENCRYPT, data, buf1);
+      if (memcmp (buf0, buf1, 16))
+	return 1;
+
+      aes_setkey_dec (&aes, key, 128);
+      aes128_decrypt (&ctx, data, buf0);
+      aes_crypt_ecb (&aes, AES_DECRYPT, data, buf1);
+      if (memcmp (buf0, buf1, 16))
+	return 1;
+    }
+
+  return 0;
+}
+
+static double
+elapsed (clock_t start)
+{
+  return (double)(clock () - start) / CLOCKS_PER_SEC;
+}
+
+static void
+bench (unsigned int count)
+{
+  static uint8_t buf[KDI_LEN_4K];
+  uint8_t key[16], iv[16], iv0[16];
+  aes128_context ctx;
+  aes_context aes;
+  unsigned int i;
+  size_t iv_offset;
+  clock_t start;
+  double mib = (double)KDI_LEN_4K * count / (1024 * 1024);
+
+  memset (key, 0x11, 16);
+  memset (iv, 0x22, 16);
+  memset (buf, 0x5a, sizeof buf);
+
+  start = clock ();
+  for (i = 0; i < count; i++)
+    {
+      aes128_setkey (&ctx, key);
+      aes128_cfb_encrypt (&ctx, iv, buf, KDI_LEN_4K);
+    }
+  printf ("aes128 CFB encrypt:   %.2f MiB/s\n", mib / elapsed (start));
+
+  start = clock ();
+  for (i = 0; i < count; i++)
+    {
+      aes128_setkey (&ctx, key);
+      aes128_cfb_decrypt (&ctx, iv, buf, KDI_LEN_4K);
+    }
+  printf ("aes128 CFB decrypt:   %.2f MiB/s\n", mib / elapsed (start));
+
+  start = clock ();
+  for (i = 0; i < count; i++)
+    {
+      aes_setkey_enc (&aes, key, 128);
+      memcpy (iv0, iv, 16);
+      iv_offset = 0;
+      aes_crypt_cfb128 (&aes, AES_ENCRYPT, KDI_LEN_4K, &iv_offset, iv0,
+			buf, buf);
+    }
+  printf ("polarssl CFB encrypt: %.2f MiB/s\n", mib / elapsed (start));
+
+  start = clock ();
+  for (i = 0; i < count; i++)
+    {
+      aes_setkey_enc (&aes, key, 128);
+      memcpy (iv0, iv, 16);
+      iv_offset = 0;
+      aes_crypt_cfb128 (&aes, AES_DECRYPT, KDI_LEN_4K, &iv_offset, iv0,
+			buf, buf);
+    }
+  printf ("polarssl CFB decrypt: %.2f MiB/s\n", mib / elapsed (start));
+}
+
+int
+main (int argc, char *argv[])
+{
+  (void)argc;
+  (void)argv;
+
+  if (check_fips197 ())
+    {
+      puts ("FAIL: FIPS-197");
+      exit (1);
+    }
+
+  if (check_cfb128 ())
+    {
+      puts ("FAIL: SP 800-38A CFB128");
+      exit (1);
+    }
+
+  if (check_polarssl (1000))
+    {
+      puts ("FAIL: comparison with PolarSSL");
+      exit (1);
+    }
+
+  bench (20000);
+  return 0;
+}
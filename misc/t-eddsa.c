@@ -6,15 +6,17 @@
  * Run following commands.  The file t-ed25519.inp is available in GNU
  * libgcrypt source code under 'tests' directory.
 
-  gcc -Wall -c ecc-edwards.c
-  gcc -Wall -c -DBN256_NO_RANDOM -DBN256_C_IMPLEMENTATION bn.c
-  gcc -Wall -c mod.c
-  gcc -Wall -c -DBN256_C_IMPLEMENTATION mod25638.c
-  gcc -Wall -c sha512.c
-  gcc -Wall -c t-eddsa.c
+  gcc -Wall -O2 -c ecc-edwards.c
+  gcc -Wall -O2 -c -DBN256_NO_RANDOM -DBN256_C_IMPLEMENTATION bn.c
+  gcc -Wall -O2 -c mod.c
+  gcc -Wall -O2 -c -DBN256_C_IMPLEMENTATION mod25638.c
+  gcc -Wall -O2 -c sha512.c
+  gcc -Wall -O2 -c t-eddsa.c
   gcc -o t-eddsa t-eddsa.o ecc-edwards.o bn.o mod.o mod25638.o sha512.o
   ./t-eddsa < ./t-ed25519.inp
 
+ * Before the EdDSA tests, it checks SHA-512 with known answers and
+ * shows its throughput.
  *
  */
 
@@ -23,6 +25,7 @@
 #include <string.h>
 #include <stdlib.h>
 #include <ctype.h>
+#include <time.h>
 
 #include "bn.h"
 #include "affine.h"
@@ -336,6 +339,117 @@ read_testcase (void)
 }
 
 
+/* Test vectors of FIPS 180-2.  */
+static const struct {
+  const char *msg;
+  unsigned int repeat;
+  const char *digest;
+} sha512_tv[] = {
+  { "abc", 1,
+    "ddaf35a193617abacc417349ae20413112e6fa4e89a97ea20a9eeee64b55d39a"
+    "2192992a274fc1a836ba3c23a3feebbd454d4423643ce80e2a9ac94fa54ca49f" },
+  { "abcdefghbcdefghicdefghijdefghijkefghijklfghijklmghijklmn"
+    "hijklmnoijklmnopjklmnopqklmnopqrlmnopqrsmnopqrstnopqrstu", 1,
+    "8e959b75dae313da8cf4f72814fc143f8f7779c6eb9f7fa17299aeadb6889018"
+    "501d289e4900f7e4331b99dec4b5433ac7d329eeb6dd26545e96e55b874be909" },
+  { "a", 1000000,
+    "e718483d0ce769644e2e42c7bc15b4638e1f98b13b2044285632a803afa973eb"
+    "de0ff244877ea60a4cb0432ce577c31beb009c5c2c49aa2e4eadb217ad8cc09b" },
+};
+
+/*
+ * SHA-512 of the concatenation of SHA-512 digests of messages
+ * 0x00 0x01 ... (LEN-1) for LEN = 0..255, so that all the cases of
+ * padding (every length modulo 128, twice) are covered.
+ */
+static const char *sha512_lengths_digest =
+  "0fe99045ff4ab9eb0834458270a0c6be83e51b3809269f330644f2c6e121387d"
+  "f829cb79eb62e9c7bee68c3a314f198c77cf7c9d4185fc5290180a9008d8a8ed";
+
+static int
+test_sha512 (void)
+{
+  static unsigned char buf[1000];
+  unsigned char output[64];
+  unsigned char digest[64];
+  unsigned char expected[64];
+  sha512_context ctx, ctx_all;
+  const char *l;
+  unsigned int i, j, k;
+  clock_t start, end;
+  int all_good = 1;
+
+  for (i = 0; i < sizeof sha512_tv / sizeof sha512_tv[0]; i++)
+    {
+      size_t len = strlen (sha512_tv[i].msg);
+
+      l = sha512_tv[i].digest;
+
+      for (j = 0; j < 64; j++)
+	expected[j] = read_hex_8bit (&l);
+
+      sha512_start (&ctx);
+      if (sha512_tv[i].repeat == 1)
+	sha512_update (&ctx, (const unsigned char *)sha512_tv[i].msg, len);
+      else
+	{
+	  memset (buf, sha512_tv[i].msg[0], sizeof buf);
+	  for (k = 0; k < sha512_tv[i].repeat; k += sizeof buf)
+	    sha512_update (&ctx, buf, sizeof buf);
+	}
+      sha512_finish (&ctx, output);
+
+      if (memcmp (output, expected, 64) != 0)
+	{
+	  printf ("ERR SHA512: %d\n", i);
+	  all_good = 0;
+	}
+    }
+
+  for (i = 0; i < 256; i++)
+    buf[i] = i;
+  sha512_start (&ctx_all);
+  for (i = 0; i < 256; i++)
+    {
+      sha512 (buf, i, output);
+
+      /* Same message by byte-wise updates.  */
+      sha512_start (&ctx);
+      for (k = 0; k < i; k++)
+	sha512_update (&ctx, &buf[k], 1);
+      sha512_finish (&ctx, digest);
+
+      if (memcmp (output, digest, 64) != 0)
+	{
+	  printf ("ERR SHA512 update: length %d\n", i);
+	  all_good = 0;
+	}
+      sha512_update (&ctx_all, output, 64);
+    }
+  sha512_finish (&ctx_all, output);
+
+  l = sha512_lengths_digest;
+  for (j = 0; j < 64; j++)
+    expected[j] = read_hex_8bit (&l);
+  if (memcmp (output, expected, 64) != 0)
+    {
+      printf ("ERR SHA512: lengths 0..255\n");
+      all_good = 0;
+    }
+
+  memset (buf, 0x5a, sizeof buf);
+  start = clock ();
+  for (k = 0; k < 10000; k++)
+    sha512 (buf, sizeof buf, output);
+  end = clock ();
+  printf ("SHA512: %.2f MiB/s\n",
+	  (double)sizeof buf * 10000 / ((double)(end - start) / CLOCKS_PER_SEC)
+	  / (1024 * 1024));
+
+  return all_good;
+}
+
+
 int
 main (int argc, char *argv[])
 {
@@ -356,6 +470,9 @@ main (int argc, char *argv[])
   R = (bn256 *)out;
   S = (bn256 *)(out+32);
 
+  if (!test_sha512 ())
+    all_good = 0;
+
   while (1)
     {
       r = read_testcase ();
@@ -0,0 +1,133 @@
+/*
+ * t-sha256.c - testing and benchmarking SHA-256
+ * Copyright (C) 2026 agent <agent@local>
+ *
+ * Run following command in the misc directory.
+
+  make bench-sha256
+
+ * It checks the test vectors of FIPS 180-2, with input at different
+ * alignment and split at different lengths, and then shows the
+ * throughput for aligned and unaligned input.
+ *
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "sha256.h"
+
+struct test_vector {
+  const char *msg;
+  unsigned int repeat;
+  const char *digest;
+};
+
+static const struct test_vector tv[] = {
+  { "abc", 1,
+    "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad" },
+  { "", 1,
+    "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855" },
+  { "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq", 1,
+    "248d6a61d20638b8e5c026930c3e6039a33ce45964ff2167f6ecedd419db06c1" },
+  { "a", 1000000,
+    "cdc76e5c9914fb9281a1c7e284d73e67f1809a48a497200e046d39ccc7112cd0" },
+};
+
+static void
+hex_to_bin (const char *hex, unsigned char *bin)
+{
+  int i;
+
+  for (i = 0; i < 32; i++)
+    {
+      unsigned int x;
+
+      sscanf (hex + i * 2, "%02x", &x);
+      bin[i] = x;
+    }
+}
+
+/* Hash the message, feeding it by CHUNK bytes from OFFSET in a buffer.  */
+static int
+check (const struct test_vector *t, int offset, unsigned int chunk)
+{
+  static uint32_t buf[256];
+  unsigned char *p = (unsigned char *)buf + offset;
+  unsigned int msg_len = strlen (t->msg);
+  unsigned int total = msg_len * t->repeat;
+  unsigned int i, n;
+  unsigned char expected[32];
+  unsigned char output[36];
+  sha256_context ctx;
+
+  hex_to_bin (t->digest, expected);
+
+  sha256_start (&ctx);
+  for (i = 0; i < total; i += n)
+    {
+      unsigned int j;
+
+      n = total - i;
+      if (n > chunk)
+	n = chunk;
+      for (j = 0; j < n; j++)
+	p[j] = t->msg[(i + j) % msg_len];
+      sha256_update (&ctx, p, n);
+    }
+  sha256_finish (&ctx, output + (offset & 3));
+
+  return memcmp (output + (offset & 3), expected, 32);
+}
+
+static double
+bench (int offset, unsigned int len, unsigned int count)
+{
+  static uint32_t buf[1024];
+  unsigned char *p = (unsigned char *)buf + offset;
+  unsigned char output[32];
+  clock_t start, end;
+  unsigned int i;
+
+  memset (p, 0x5a, len);
+  start = clock ();
+  for (i = 0; i < count; i++)
+    sha256 (p, len, output);
+  end = clock ();
+
+  return (double)len * count / ((double)(end - start) / CLOCKS_PER_SEC)
+    / (1024 * 1024);
+}
+
+int
+main (int argc, char *argv[])
+{
+  static const unsigned int chunks[] = { 1, 3, 55, 63, 64, 65, 128, 1000 };
+  unsigned int i, j;
+  int offset;
+  int fail = 0;
+
+  (void)argc;
+  (void)argv;
+
+  for (i = 0; i < sizeof tv / sizeof tv[0]; i++)
+    for (offset = 0; offset < 4; offset++)
+      for (j = 0; j < sizeof chunks / sizeof chunks[0]; j++)
+	if (check (&tv[i], offset, chunks[j]))
+	  {
+	    printf ("FAIL: vector %u, offset %d, chunk %u\n",
+		    i, offset, chunks[j]);
+	    fail = 1;
+	  }
+
+  if (fail)
+    exit (1);
+
+  printf ("aligned:   %.2f MiB/s\n", bench (0, 4096, 20000));
+  printf ("unaligned: %.2f MiB/s\n", bench (1, 4096, 20000));
+  printf ("s2k-like:  %.2f MiB/s\n", bench (0, 64, 1000000));
+  return 0;
+}
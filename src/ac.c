@@ -58,13 +58,28 @@ ac_reset_other (void)
   auth_status &= ~AC_OTHER_AUTHORIZED;
 }
 
-int
-verify_user_0 (uint8_t access, const uint8_t *pw, int buf_len, int pw_len_known,
-	       const uint8_t *ks_pw1, int save_ks)
+/* Compare verifiers in constant time.  */
+static int
+ks_verifier_match (const uint8_t *ks, const uint8_t *keystring)
+{
+  uint8_t verifier[KS_VERIFIER_SIZE];
+  uint8_t d = 0;
+  int i;
+
+  ks_verifier (keystring, verifier);
+  for (i = 0; i < KS_VERIFIER_SIZE; i++)
+    d |= verifier[i] ^ KS_GET_VERIFIER (ks)[i];
+  memset (verifier, 0, KS_VERIFIER_SIZE);
+  return d == 0;
+}
+
+static int
+verify_user_00 (uint8_t access, const uint8_t *pw, int buf_len,
+		int pw_len_known, const uint8_t *ks_pw1, int save_ks,
+		uint8_t *keystring)
 {
   int pw_len;
   int r;
-  uint8_t keystring[KEYSTRING_MD_SIZE];
   const uint8_t *salt;
   int salt_len;
 
@@ -98,7 +113,27 @@ verify_user_0 (uint8_t access, const uint8_t *pw, int buf_len, int pw_len_known,
   if (save_ks)
     memcpy (keystring_md_pw3, keystring, KEYSTRING_MD_SIZE);
 
-  if (access == AC_PSO_CDS_AUTHORIZED)
+  if (ks_pw1 == NULL
+      || gpg_do_simple_len (NR_DO_KEYSTRING_PW1) == KS_VERIFIER_DO_SIZE)
+    {
+      /*
+       * Passphrase is checked without private keys.  Decryption of
+       * the keys is deferred to its first use.
+       */
+      if (ks_pw1 != NULL && !ks_verifier_match (ks_pw1, keystring))
+	goto failure;
+
+      if (access == AC_PSO_CDS_AUTHORIZED)
+	gpg_do_defer_prvkey (GPG_KEY_FOR_SIGNING, BY_USER, keystring);
+      else
+	{
+	  gpg_do_defer_prvkey (GPG_KEY_FOR_DECRYPTION, BY_USER, keystring);
+	  gpg_do_defer_prvkey (GPG_KEY_FOR_AUTHENTICATION, BY_USER,
+			       keystring);
+	}
+      r = 1;
+    }
+  else if (access == AC_PSO_CDS_AUTHORIZED)
     r = gpg_do_load_prvkey (GPG_KEY_FOR_SIGNING, BY_USER, keystring);
   else
     {
@@ -134,19 +169,51 @@ verify_user_0 (uint8_t access, const uint8_t *pw, int buf_len, int pw_len_known,
   return pw_len;
 }
 
+int
+verify_user_0 (uint8_t access, const uint8_t *pw, int buf_len, int pw_len_known,
+	       const uint8_t *ks_pw1, int save_ks)
+{
+  uint8_t keystring[KEYSTRING_MD_SIZE];
+  int r;
+
+  r = verify_user_00 (access, pw, buf_len, pw_len_known, ks_pw1, save_ks,
+		      keystring);
+  memset (keystring, 0, KEYSTRING_MD_SIZE);
+  return r;
+}
+
+/*
+ * Verify PW1 for VERIFY command.  When keystring DO has no verifier
+ * (written by older version), add it now, so that next time private
+ * keys don't need to be decrypted.
+ */
+static int
+verify_user (uint8_t access, const uint8_t *pw, int pw_len)
+{
+  const uint8_t *ks_pw1 = gpg_do_read_simple (NR_DO_KEYSTRING_PW1);
+  uint8_t keystring[KEYSTRING_MD_SIZE];
+  int r;
+
+  r = verify_user_00 (access, pw, pw_len, pw_len, ks_pw1, 0, keystring);
+  if (r > 0 && ks_pw1 != NULL
+      && gpg_do_simple_len (NR_DO_KEYSTRING_PW1) != KS_VERIFIER_DO_SIZE)
+    gpg_do_write_keystring (NR_DO_KEYSTRING_PW1, ks_pw1, keystring);
+  memset (keystring, 0, KEYSTRING_MD_SIZE);
+  return r;
+}
+
 /*
  * Verify for "Perform Security Operation : Compute Digital Signature"
  */
 int
 verify_pso_cds (const uint8_t *pw, int pw_len)
 {
-  const uint8_t *ks_pw1 = gpg_do_read_simple (NR_DO_KEYSTRING_PW1);
   int r;
 
   DEBUG_INFO ("verify_pso_cds\r\n");
   DEBUG_BYTE (pw_len);
 
-  r = verify_user_0 (AC_PSO_CDS_AUTHORIZED, pw, pw_len, pw_len, ks_pw1, 0);
+  r = verify_user (AC_PSO_CDS_AUTHORIZED, pw, pw_len);
   if (r > 0)
     auth_status |= AC_PSO_CDS_AUTHORIZED;
   return r;
@@ -155,13 +222,12 @@ verify_pso_cds (const uint8_t *pw, int pw_len)
 int
 verify_other (const uint8_t *pw, int pw_len)
 {
-  const uint8_t *ks_pw1 = gpg_do_read_simple (NR_DO_KEYSTRING_PW1);
   int r;
 
   DEBUG_INFO ("verify_other\r\n");
   DEBUG_BYTE (pw_len);
 
-  r = verify_user_0 (AC_OTHER_AUTHORIZED, pw, pw_len, pw_len, ks_pw1, 0);
+  r = verify_user (AC_OTHER_AUTHORIZED, pw, pw_len);
   if (r > 0)
     auth_status |= AC_OTHER_AUTHORIZED;
   return r;
@@ -189,6 +255,13 @@ verify_admin_00 (const uint8_t *pw, int buf_len, int pw_len_known,
   if (save_ks)
     memcpy (keystring_md_pw3, keystring, KEYSTRING_MD_SIZE);
 
+  if (gpg_do_simple_len (NR_DO_KEYSTRING_PW3) == KS_VERIFIER_DO_SIZE)
+    {
+      if (!ks_verifier_match (ks, keystring))
+	return -1;
+      return pw_len;
+    }
+
   r = gpg_do_load_prvkey (GPG_KEY_FOR_SIGNING, BY_ADMIN, keystring);
 
   if (r < 0)
@@ -277,6 +350,13 @@ verify_admin (const uint8_t *pw, int pw_len)
   if (r <= 0)
     return r;
 
+  /* Add verifier to keystring DO written by older version.  */
+  if (pw3_keystring != NULL && admin_authorized == BY_ADMIN
+      && (pw3_keystring[0] & PW_LEN_KEYSTRING_BIT) == 0
+      && gpg_do_simple_len (NR_DO_KEYSTRING_PW3) != KS_VERIFIER_DO_SIZE)
+    gpg_do_write_keystring (NR_DO_KEYSTRING_PW3, pw3_keystring,
+			    keystring_md_pw3);
+
   auth_status |= AC_ADMIN_AUTHORIZED;
   return 1;
 }
@@ -299,3 +379,53 @@ ac_fini (void)
   auth_status = AC_NONE_AUTHORIZED;
   admin_authorized = 0;
 }
+
+/*
+ * Save authentication state into CTX, and clear it (for a switch to
+ * another identity).  Private keys are not kept decrypted, but the
+ * keystrings to decrypt them on next use.  When a key has been
+ * decrypted without keeping its keystring, its authorization is not
+ * saved.
+ */
+void
+ac_save (struct ac_context *ctx)
+{
+  int i;
+
+  ctx->auth_status = auth_status;
+  ctx->admin_authorized = admin_authorized;
+  memcpy (ctx->keystring_md_pw3, keystring_md_pw3, KEYSTRING_MD_SIZE);
+  for (i = 0; i < 3; i++)
+    {
+      ctx->prvkey_who[i] = gpg_do_get_prvkey_keystring (i,
+						ctx->prvkey_key_string[i]);
+      if (ctx->prvkey_who[i] == 0 && gpg_do_has_prvkey (i))
+	{
+	  if (i == GPG_KEY_FOR_SIGNING)
+	    ctx->auth_status &= ~AC_PSO_CDS_AUTHORIZED;
+	  else
+	    ctx->auth_status &= ~AC_OTHER_AUTHORIZED;
+	}
+    }
+
+  ac_fini ();
+}
+
+/*
+ * Restore authentication state from CTX, and clear CTX.
+ */
+void
+ac_restore (struct ac_context *ctx)
+{
+  int i;
+
+  ac_fini ();
+  auth_status = ctx->auth_status;
+  admin_authorized = ctx->admin_authorized;
+  memcpy (keystring_md_pw3, ctx->keystring_md_pw3, KEYSTRING_MD_SIZE);
+  for (i = 0; i < 3; i++)
+    if (ctx->prvkey_who[i])
+      gpg_do_defer_prvkey (i, ctx->prvkey_who[i], ctx->prvkey_key_string[i]);
+
+  memset (ctx, 0, sizeof (struct ac_context));
+}
@@ -0,0 +1,631 @@
+/*
+ * aes128.c -- Constant-time AES-128 for keystore
+ *
+ * Copyright (C) 2026 agent <agent@local>
+ *
+ * This file is a part of Gnuk, a GnuPG USB Token implementation.
+ *
+ * Gnuk is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Gnuk is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * This is bitsliced implementation with no table lookup, so that its
+ * timing doesn't depend on the key or data.  Two blocks are processed
+ * at once, with eight 32-bit words, where a word holds a bit of each
+ * byte in two blocks.
+ *
+ * The S-box circuit is the one by Joan Boyar and René Peralta.  The
+ * data layout, ShiftRows and MixColumns follow "aes_ct" of BearSSL,
+ * written by Thomas Pornin, distributed under the following terms:
+ *
+ *   Copyright (c) 2016 Thomas Pornin <pornin@bolet.org>
+ *
+ *   Permission is hereby granted, free of charge, to any person
+ *   obtaining a copy of this software and associated documentation
+ *   files (the "Software"), to deal in the Software without
+ *   restriction, including without limitation the rights to use,
+ *   copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *   copies of the Software, and to permit persons to whom the
+ *   Software is furnished to do so, subject to the following
+ *   conditions:
+ *
+ *   The above copyright notice and this permission notice shall be
+ *   included in all copies or substantial portions of the Software.
+ *
+ *   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ *   EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ *   OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ *   NONINFRINGEMENT.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include "aes128.h"
+
+#define AES128_ROUNDS 10
+
+static void
+sbox (uint32_t *q)
+{
+  uint32_t x0, x1, x2, x3, x4, x5, x6, x7;
+  uint32_t y1, y2, y3, y4, y5, y6, y7, y8, y9;
+  uint32_t y10, y11, y12, y13, y14, y15, y16, y17, y18, y19;
+  uint32_t y20, y21;
+  uint32_t z0, z1, z2, z3, z4, z5, z6, z7, z8, z9;
+  uint32_t z10, z11, z12, z13, z14, z15, z16, z17;
+  uint32_t t0, t1, t2, t3, t4, t5, t6, t7, t8, t9;
+  uint32_t t10, t11, t12, t13, t14, t15, t16, t17, t18, t19;
+  uint32_t t20, t21, t22, t23, t24, t25, t26, t27, t28, t29;
+  uint32_t t30, t31, t32, t33, t34, t35, t36, t37, t38, t39;
+  uint32_t t40, t41, t42, t43, t44, t45, t46, t47, t48, t49;
+  uint32_t t50, t51, t52, t53, t54, t55, t56, t57, t58, t59;
+  uint32_t t60, t61, t62, t63, t64, t65, t66, t67;
+  uint32_t s0, s1, s2, s3, s4, s5, s6, s7;
+
+  x0 = q[7];
+  x1 = q[6];
+  x2 = q[5];
+  x3 = q[4];
+  x4 = q[3];
+  x5 = q[2];
+  x6 = q[1];
+  x7 = q[0];
+
+  /* Top linear transformation.  */
+  y14 = x3 ^ x5;
+  y13 = x0 ^ x6;
+  y9 = x0 ^ x3;
+  y8 = x0 ^ x5;
+  t0 = x1 ^ x2;
+  y1 = t0 ^ x7;
+  y4 = y1 ^ x3;
+  y12 = y13 ^ y14;
+  y2 = y1 ^ x0;
+  y5 = y1 ^ x6;
+  y3 = y5 ^ y8;
+  t1 = x4 ^ y12;
+  y15 = t1 ^ x5;
+  y20 = t1 ^ x1;
+  y6 = y15 ^ x7;
+  y10 = y15 ^ t0;
+  y11 = y20 ^ y9;
+  y7 = x7 ^ y11;
+  y17 = y10 ^ y11;
+  y19 = y10 ^ y8;
+  y16 = t0 ^ y11;
+  y21 = y13 ^ y16;
+  y18 = x0 ^ y16;
+
+  /* Non-linear section.  */
+  t2 = y12 & y15;
+  t3 = y3 & y6;
+  t4 = t3 ^ t2;
+  t5 = y4 & x7;
+  t6 = t5 ^ t2;
+  t7 = y13 & y16;
+  t8 = y5 & y1;
+  t9 = t8 ^ t7;
+  t10 = y2 & y7;
+  t11 = t10 ^ t7;
+  t12 = y9 & y11;
+  t13 = y14 & y17;
+  t14 = t13 ^ t12;
+  t15 = y8 & y10;
+  t16 = t15 ^ t12;
+  t17 = t4 ^ t14;
+  t18 = t6 ^ t16;
+  t19 = t9 ^ t14;
+  t20 = t11 ^ t16;
+  t21 = t17 ^ y20;
+  t22 = t18 ^ y19;
+  t23 = t19 ^ y21;
+  t24 = t20 ^ y18;
+
+  t25 = t21 ^ t22;
+  t26 = t21 & t23;
+  t27 = t24 ^ t26;
+  t28 = t25 & t27;
+  t29 = t28 ^ t22;
+  t30 = t23 ^ t24;
+  t31 = t22 ^ t26;
+  t32 = t31 & t30;
+  t33 = t32 ^ t24;
+  t34 = t23 ^ t33;
+  t35 = t27 ^ t33;
+  t36 = t24 & t35;
+  t37 = t36 ^ t34;
+  t38 = t27 ^ t36;
+  t39 = t29 & t38;
+  t40 = t25 ^ t39;
+
+  t41 = t40 ^ t37;
+  t42 = t29 ^ t33;
+  t43 = t29 ^ t40;
+  t44 = t33 ^ t37;
+  t45 = t42 ^ t41;
+  z0 = t44 & y15;
+  z1 = t37 & y6;
+  z2 = t33 & x7;
+  z3 = t43 & y16;
+  z4 = t40 & y1;
+  z5 = t29 & y7;
+  z6 = t42 & y11;
+  z7 = t45 & y17;
+  z8 = t41 & y10;
+  z9 = t44 & y12;
+  z10 = t37 & y3;
+  z11 = t33 & y4;
+  z12 = t43 & y13;
+  z13 = t40 & y5;
+  z14 = t29 & y2;
+  z15 = t42 & y9;
+  z16 = t45 & y14;
+  z17 = t41 & y8;
+
+  /* Bottom linear transformation.  */
+  t46 = z15 ^ z16;
+  t47 = z10 ^ z11;
+  t48 = z5 ^ z13;
+  t49 = z9 ^ z10;
+  t50 = z2 ^ z12;
+  t51 = z2 ^ z5;
+  t52 = z7 ^ z8;
+  t53 = z0 ^ z3;
+  t54 = z6 ^ z7;
+  t55 = z16 ^ z17;
+  t56 = z12 ^ t48;
+  t57 = t50 ^ t53;
+  t58 = z4 ^ t46;
+  t59 = z3 ^ t54;
+  t60 = t46 ^ t57;
+  t61 = z14 ^ t57;
+  t62 = t52 ^ t58;
+  t63 = t49 ^ t58;
+  t64 = z4 ^ t59;
+  t65 = t61 ^ t62;
+  t66 = z1 ^ t63;
+  s0 = t59 ^ t63;
+  s6 = t56 ^ ~t62;
+  s7 = t48 ^ ~t60;
+  t67 = t64 ^ t65;
+  s3 = t53 ^ t66;
+  s4 = t51 ^ t66;
+  s5 = t47 ^ t65;
+  s1 = t64 ^ ~s3;
+  s2 = t55 ^ ~t67;
+
+  q[7] = s0;
+  q[6] = s1;
+  q[5] = s2;
+  q[4] = s3;
+  q[3] = s4;
+  q[2] = s5;
+  q[1] = s6;
+  q[0] = s7;
+}
+
+/*
+ * The inverse of the linear part of the affine transform of S-box,
+ * with the constant 0x63.
+ */
+static void
+inv_affine (uint32_t *q)
+{
+  uint32_t q0, q1, q2, q3, q4, q5, q6, q7;
+
+  q0 = ~q[0];
+  q1 = ~q[1];
+  q2 = q[2];
+  q3 = q[3];
+  q4 = q[4];
+  q5 = ~q[5];
+  q6 = ~q[6];
+  q7 = q[7];
+  q[7] = q1 ^ q4 ^ q6;
+  q[6] = q0 ^ q3 ^ q5;
+  q[5] = q7 ^ q2 ^ q4;
+  q[4] = q6 ^ q1 ^ q3;
+  q[3] = q5 ^ q0 ^ q2;
+  q[2] = q4 ^ q7 ^ q1;
+  q[1] = q3 ^ q6 ^ q0;
+  q[0] = q2 ^ q5 ^ q7;
+}
+
+/*
+ * S(x) = A(I(x)) ^ 0x63, where I is inversion in GF(2^8) and A is
+ * linear.  Since I is an involution, the inverse S-box is:
+ *   iS(x) = B(S(B(x ^ 0x63)) ^ 0x63), where B is the inverse of A.
+ */
+static void
+inv_sbox (uint32_t *q)
+{
+  inv_affine (q);
+  sbox (q);
+  inv_affine (q);
+}
+
+#define swap_n(cl,ch,s,x,y) do {                        \
+    uint32_t a_ = (x), b_ = (y);                        \
+    (x) = (a_ & (uint32_t)(cl)) | ((b_ & (uint32_t)(cl)) << (s)); \
+    (y) = ((a_ & (uint32_t)(ch)) >> (s)) | (b_ & (uint32_t)(ch)); \
+  } while (0)
+
+#define swap2(x,y) swap_n (0x55555555, 0xaaaaaaaa, 1, x, y)
+#define swap4(x,y) swap_n (0x33333333, 0xcccccccc, 2, x, y)
+#define swap8(x,y) swap_n (0x0f0f0f0f, 0xf0f0f0f0, 4, x, y)
+
+/* Convert between normal and bitsliced representation (involution).  */
+static void
+ortho (uint32_t *q)
+{
+  swap2 (q[0], q[1]);
+  swap2 (q[2], q[3]);
+  swap2 (q[4], q[5]);
+  swap2 (q[6], q[7]);
+
+  swap4 (q[0], q[2]);
+  swap4 (q[1], q[3]);
+  swap4 (q[4], q[6]);
+  swap4 (q[5], q[7]);
+
+  swap8 (q[0], q[4]);
+  swap8 (q[1], q[5]);
+  swap8 (q[2], q[6]);
+  swap8 (q[3], q[7]);
+}
+
+static void
+add_round_key (uint32_t *q, const uint32_t *rk)
+{
+  q[0] ^= rk[0];
+  q[1] ^= rk[1];
+  q[2] ^= rk[2];
+  q[3] ^= rk[3];
+  q[4] ^= rk[4];
+  q[5] ^= rk[5];
+  q[6] ^= rk[6];
+  q[7] ^= rk[7];
+}
+
+static void
+shift_rows (uint32_t *q)
+{
+  int i;
+
+  for (i = 0; i < 8; i++)
+    {
+      uint32_t x = q[i];
+
+      q[i] = (x & 0x000000ff)
+	| ((x & 0x0000fc00) >> 2) | ((x & 0x00000300) << 6)
+	| ((x & 0x00f00000) >> 4) | ((x & 0x000f0000) << 4)
+	| ((x & 0xc0000000) >> 6) | ((x & 0x3f000000) << 2);
+    }
+}
+
+static void
+inv_shift_rows (uint32_t *q)
+{
+  int i;
+
+  for (i = 0; i < 8; i++)
+    {
+      uint32_t x = q[i];
+
+      q[i] = (x & 0x000000ff)
+	| ((x & 0x00003f00) << 2) | ((x & 0x0000c000) >> 6)
+	| ((x & 0x000f0000) << 4) | ((x & 0x00f00000) >> 4)
+	| ((x & 0x03000000) << 6) | ((x & 0xfc000000) >> 2);
+    }
+}
+
+#define rotr8(x)   (((x) >> 8) | ((x) << 24))
+#define rotr16(x)  (((x) >> 16) | ((x) << 16))
+
+static void
+mix_columns (uint32_t *q)
+{
+  uint32_t q0, q1, q2, q3, q4, q5, q6, q7;
+  uint32_t r0, r1, r2, r3, r4, r5, r6, r7;
+
+  q0 = q[0]; q1 = q[1]; q2 = q[2]; q3 = q[3];
+  q4 = q[4]; q5 = q[5]; q6 = q[6]; q7 = q[7];
+  r0 = rotr8 (q0); r1 = rotr8 (q1); r2 = rotr8 (q2); r3 = rotr8 (q3);
+  r4 = rotr8 (q4); r5 = rotr8 (q5); r6 = rotr8 (q6); r7 = rotr8 (q7);
+
+  q[0] = q7 ^ r7 ^ r0 ^ rotr16 (q0 ^ r0);
+  q[1] = q0 ^ r0 ^ q7 ^ r7 ^ r1 ^ rotr16 (q1 ^ r1);
+  q[2] = q1 ^ r1 ^ r2 ^ rotr16 (q2 ^ r2);
+  q[3] = q2 ^ r2 ^ q7 ^ r7 ^ r3 ^ rotr16 (q3 ^ r3);
+  q[4] = q3 ^ r3 ^ q7 ^ r7 ^ r4 ^ rotr16 (q4 ^ r4);
+  q[5] = q4 ^ r4 ^ r5 ^ rotr16 (q5 ^ r5);
+  q[6] = q5 ^ r5 ^ r6 ^ rotr16 (q6 ^ r6);
+  q[7] = q6 ^ r6 ^ r7 ^ rotr16 (q7 ^ r7);
+}
+
+static void
+inv_mix_columns (uint32_t *q)
+{
+  uint32_t q0, q1, q2, q3, q4, q5, q6, q7;
+  uint32_t r0, r1, r2, r3, r4, r5, r6, r7;
+
+  q0 = q[0]; q1 = q[1]; q2 = q[2]; q3 = q[3];
+  q4 = q[4]; q5 = q[5]; q6 = q[6]; q7 = q[7];
+  r0 = rotr8 (q0); r1 = rotr8 (q1); r2 = rotr8 (q2); r3 = rotr8 (q3);
+  r4 = rotr8 (q4); r5 = rotr8 (q5); r6 = rotr8 (q6); r7 = rotr8 (q7);
+
+  q[0] = q5 ^ q6 ^ q7 ^ r0 ^ r5 ^ r7 ^ rotr16 (q0 ^ q5 ^ q6 ^ r0 ^ r5);
+  q[1] = q0 ^ q5 ^ r0 ^ r1 ^ r5 ^ r6 ^ r7
+    ^ rotr16 (q1 ^ q5 ^ q7 ^ r1 ^ r5 ^ r6);
+  q[2] = q0 ^ q1 ^ q6 ^ r1 ^ r2 ^ r6 ^ r7
+    ^ rotr16 (q0 ^ q2 ^ q6 ^ r2 ^ r6 ^ r7);
+  q[3] = q0 ^ q1 ^ q2 ^ q5 ^ q6 ^ r0 ^ r2 ^ r3 ^ r5
+    ^ rotr16 (q0 ^ q1 ^ q3 ^ q5 ^ q6 ^ q7 ^ r0 ^ r3 ^ r5 ^ r7);
+  q[4] = q1 ^ q2 ^ q3 ^ q5 ^ r1 ^ r3 ^ r4 ^ r5 ^ r6 ^ r7
+    ^ rotr16 (q1 ^ q2 ^ q4 ^ q5 ^ q7 ^ r1 ^ r4 ^ r5 ^ r6);
+  q[5] = q2 ^ q3 ^ q4 ^ q6 ^ r2 ^ r4 ^ r5 ^ r6 ^ r7
+    ^ rotr16 (q2 ^ q3 ^ q5 ^ q6 ^ r2 ^ r5 ^ r6 ^ r7);
+  q[6] = q3 ^ q4 ^ q5 ^ q7 ^ r3 ^ r5 ^ r6 ^ r7
+    ^ rotr16 (q3 ^ q4 ^ q6 ^ q7 ^ r3 ^ r6 ^ r7);
+  q[7] = q4 ^ q5 ^ q6 ^ r4 ^ r6 ^ r7
+    ^ rotr16 (q4 ^ q5 ^ q7 ^ r4 ^ r7);
+}
+
+static void
+encrypt_bitsliced (const aes128_context *ctx, uint32_t *q)
+{
+  int i;
+
+  add_round_key (q, ctx->rk);
+  for (i = 1; i < AES128_ROUNDS; i++)
+    {
+      sbox (q);
+      shift_rows (q);
+      mix_columns (q);
+      add_round_key (q, ctx->rk + i * 8);
+    }
+  sbox (q);
+  shift_rows (q);
+  add_round_key (q, ctx->rk + AES128_ROUNDS * 8);
+}
+
+static void
+decrypt_bitsliced (const aes128_context *ctx, uint32_t *q)
+{
+  int i;
+
+  add_round_key (q, ctx->rk + AES128_ROUNDS * 8);
+  for (i = AES128_ROUNDS - 1; i > 0; i--)
+    {
+      inv_shift_rows (q);
+      inv_sbox (q);
+      add_round_key (q, ctx->rk + i * 8);
+      inv_mix_columns (q);
+    }
+  inv_shift_rows (q);
+  inv_sbox (q);
+  add_round_key (q, ctx->rk);
+}
+
+static uint32_t
+get_le32 (const uint8_t *p)
+{
+  uint32_t v;
+
+  memcpy (&v, p, 4);		/* Just for little endian architecture.  */
+  return v;
+}
+
+static void
+put_le32 (uint8_t *p, uint32_t v)
+{
+  memcpy (p, &v, 4);
+}
+
+/* Load two blocks (B1 may be NULL) into bitsliced representation.  */
+static void
+load_blocks (uint32_t *q, const uint8_t *b0, const uint8_t *b1)
+{
+  int i;
+
+  for (i = 0; i < 4; i++)
+    {
+      q[i * 2] = get_le32 (b0 + i * 4);
+      q[i * 2 + 1] = b1 ? get_le32 (b1 + i * 4) : 0;
+    }
+  ortho (q);
+}
+
+static void
+store_blocks (uint32_t *q, uint8_t *b0, uint8_t *b1)
+{
+  int i;
+
+  ortho (q);
+  for (i = 0; i < 4; i++)
+    {
+      put_le32 (b0 + i * 4, q[i * 2]);
+      if (b1)
+	put_le32 (b1 + i * 4, q[i * 2 + 1]);
+    }
+}
+
+static uint32_t
+sub_word (uint32_t x)
+{
+  uint32_t q[8];
+
+  memset (q, 0, sizeof q);
+  q[0] = x;
+  ortho (q);
+  sbox (q);
+  ortho (q);
+  return q[0];
+}
+
+static const uint8_t rcon[AES128_ROUNDS] = {
+  0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, 0x80, 0x1b, 0x36
+};
+
+void
+aes128_setkey (aes128_context *ctx, const uint8_t *key)
+{
+  uint32_t w[4 * (AES128_ROUNDS + 1)];
+  uint32_t tmp;
+  int i;
+
+  for (i = 0; i < 4; i++)
+    w[i] = get_le32 (key + i * 4);
+
+  tmp = w[3];
+  for (i = 4; i < 4 * (AES128_ROUNDS + 1); i++)
+    {
+      if ((i & 3) == 0)
+	tmp = sub_word (rotr8 (tmp)) ^ rcon[i / 4 - 1];
+      tmp ^= w[i - 4];
+      w[i] = tmp;
+    }
+
+  /* Round keys in bitsliced representation, same for two blocks.  */
+  for (i = 0; i < AES128_ROUNDS + 1; i++)
+    {
+      uint32_t *q = ctx->rk + i * 8;
+
+      q[0] = q[1] = w[i * 4];
+      q[2] = q[3] = w[i * 4 + 1];
+      q[4] = q[5] = w[i * 4 + 2];
+      q[6] = q[7] = w[i * 4 + 3];
+      ortho (q);
+    }
+
+  memset (w, 0, sizeof w);
+  tmp = 0;
+}
+
+void
+aes128_encrypt (const aes128_context *ctx, const uint8_t *in, uint8_t *out)
+{
+  uint32_t q[8];
+
+  load_blocks (q, in, NULL);
+  encrypt_bitsliced (ctx, q);
+  store_blocks (q, out, NULL);
+  memset (q, 0, sizeof q);
+}
+
+void
+aes128_decrypt (const aes128_context *ctx, const uint8_t *in, uint8_t *out)
+{
+  uint32_t q[8];
+
+  load_blocks (q, in, NULL);
+  decrypt_bitsliced (ctx, q);
+  store_blocks (q, out, NULL);
+  memset (q, 0, sizeof q);
+}
+
+/* XOR LEN bytes of KS into DATA, word-wise for whole blocks.  */
+static void
+xor_block (uint8_t *data, const uint8_t *ks, unsigned int len)
+{
+  unsigned int i;
+
+  if (len == AES128_BLOCK_SIZE)
+    for (i = 0; i < AES128_BLOCK_SIZE; i += 4)
+      put_le32 (data + i, get_le32 (data + i) ^ get_le32 (ks + i));
+  else
+    for (i = 0; i < len; i++)
+      data[i] ^= ks[i];
+}
+
+/*
+ * CFB-128 encryption in place.  Since a block depends on the cipher
+ * text of previous block, it's one block at a time.
+ */
+void
+aes128_cfb_encrypt (const aes128_context *ctx, const uint8_t *iv,
+		    uint8_t *data, unsigned int len)
+{
+  uint8_t ks[AES128_BLOCK_SIZE];
+  const uint8_t *prev = iv;
+  uint32_t q[8];
+
+  while (len)
+    {
+      unsigned int n = len < AES128_BLOCK_SIZE ? len : AES128_BLOCK_SIZE;
+
+      load_blocks (q, prev, NULL);
+      encrypt_bitsliced (ctx, q);
+      store_blocks (q, ks, NULL);
+      xor_block (data, ks, n);
+      prev = data;
+      data += n;
+      len -= n;
+    }
+
+  memset (q, 0, sizeof q);
+  memset (ks, 0, sizeof ks);
+}
+
+/*
+ * CFB-128 decryption in place.  Key stream of a block only depends on
+ * the cipher text of previous block, so, two blocks are computed at
+ * once.  Blocks are processed from the end, so that cipher text is
+ * still available when it's needed.
+ */
+void
+aes128_cfb_decrypt (const aes128_context *ctx, const uint8_t *iv,
+		    uint8_t *data, unsigned int len)
+{
+  uint8_t ks[AES128_BLOCK_SIZE * 2];
+  uint32_t q[8];
+  unsigned int nblocks = (len + AES128_BLOCK_SIZE - 1) / AES128_BLOCK_SIZE;
+  unsigned int i;
+
+  i = nblocks;
+  while (i)
+    {
+      uint8_t *b1 = data + (i - 1) * AES128_BLOCK_SIZE;
+      unsigned int n1 = len - (i - 1) * AES128_BLOCK_SIZE;
+      const uint8_t *c1 = (i >= 2) ? b1 - AES128_BLOCK_SIZE : iv;
+
+      if (n1 > AES128_BLOCK_SIZE)
+	n1 = AES128_BLOCK_SIZE;
+
+      if (i >= 2)
+	{
+	  uint8_t *b0 = b1 - AES128_BLOCK_SIZE;
+	  const uint8_t *c0 = (i >= 3) ? b0 - AES128_BLOCK_SIZE : iv;
+
+	  load_blocks (q, c0, c1);
+	  encrypt_bitsliced (ctx, q);
+	  store_blocks (q, ks, ks + AES128_BLOCK_SIZE);
+	  xor_block (b1, ks + AES128_BLOCK_SIZE, n1);
+	  xor_block (b0, ks, AES128_BLOCK_SIZE);
+	  i -= 2;
+	}
+      else
+	{
+	  load_blocks (q, c1, NULL);
+	  encrypt_bitsliced (ctx, q);
+	  store_blocks (q, ks, NULL);
+	  xor_block (b1, ks, n1);
+	  i--;
+	}
+    }
+
+  memset (q, 0, sizeof q);
+  memset (ks, 0, sizeof ks);
+}
@@ -0,0 +1,16 @@
+#define AES128_BLOCK_SIZE 16
+
+typedef struct
+{
+  uint32_t rk[88];		/* Bitsliced round keys.  */
+} aes128_context;
+
+void aes128_setkey (aes128_context *ctx, const uint8_t *key);
+void aes128_encrypt (const aes128_context *ctx, const uint8_t *in,
+		     uint8_t *out);
+void aes128_decrypt (const aes128_context *ctx, const uint8_t *in,
+		     uint8_t *out);
+void aes128_cfb_encrypt (const aes128_context *ctx, const uint8_t *iv,
+			 uint8_t *data, unsigned int len);
+void aes128_cfb_decrypt (const aes128_context *ctx, const uint8_t *iv,
+			 uint8_t *data, unsigned int len);
@@ -34,9 +34,29 @@
 #include "polarssl/config.h"
 #include "polarssl/rsa.h"
 
+extern void neug_flush (void);
+
 static rsa_context rsa_ctx;
 static struct chx_cleanup clp;
 
+/*
+ * Blinding values (Vi = Vf^(-E) mod N, and Vf) for the private key
+ * used last.  They are seeded from NeuG at a private key operation by
+ * another key (or the first one after the key is loaded), and updated
+ * by squaring after each use.  Only one pair is kept, to save RAM
+ * (1KiB for RSA-4096) for the MPI heap.
+ *
+ * Those are kept in big endian bytes of the modulus length, and read
+ * into RSA_CTX only while an operation is running, so that no MPI
+ * stays allocated between operations.
+ */
+static struct {
+  uint8_t valid;
+  uint8_t key;			/* Index of the key in KD */
+  uint8_t vi[MAX_PRVKEY_LEN];
+  uint8_t vf[MAX_PRVKEY_LEN];
+} blinding;
+
 static void
 rsa_cleanup (void *arg)
 {
@@ -44,6 +64,52 @@ rsa_cleanup (void *arg)
   rsa_free (&rsa_ctx);
 }
 
+void
+rsa_blinding_reset (enum kind_of_key kk)
+{
+  if (blinding.key == kk)
+    memset (&blinding, 0, sizeof blinding);
+}
+
+/*
+ * Read the blinding values of the key into RSA_CTX.  When there are
+ * none, RSA_CTX is left without them, and those are seeded by the
+ * operation.  The values are invalidated until rsa_blinding_put, so
+ * that a pair is never used twice when the operation is canceled.
+ */
+static int
+rsa_blinding_get (const struct key_data *k, int len)
+{
+  int i = k - kd;
+  int ret = 0;
+
+  if (!blinding.valid || blinding.key != i)
+    neug_flush ();
+  else
+    {
+      MPI_CHK( mpi_read_binary (&rsa_ctx.Vi, blinding.vi, len) );
+      MPI_CHK( mpi_read_binary (&rsa_ctx.Vf, blinding.vf, len) );
+    }
+  blinding.valid = 0;
+
+ cleanup:
+  return ret;
+}
+
+/*
+ * Write back the updated blinding values of the key from RSA_CTX.
+ */
+static void
+rsa_blinding_put (const struct key_data *k, int len)
+{
+  int i = k - kd;
+
+  blinding.key = i;
+  blinding.valid
+    = (mpi_write_binary (&rsa_ctx.Vi, blinding.vi, len) == 0
+       && mpi_write_binary (&rsa_ctx.Vf, blinding.vf, len) == 0);
+}
+
 
 int
 rsa_sign (const uint8_t *raw_message, uint8_t *output, int msg_len,
@@ -52,6 +118,7 @@ rsa_sign (const uint8_t *raw_message, uint8_t *output, int msg_len,
   mpi P1, Q1, H;
   int ret = 0;
   unsigned char temp[pubkey_len];
+  uint8_t index = 0;
 
   rsa_init (&rsa_ctx, RSA_PKCS_V15, 0);
 
@@ -62,9 +129,7 @@ rsa_sign (const uint8_t *raw_message, uint8_t *output, int msg_len,
   MPI_CHK( mpi_read_binary (&rsa_ctx.P, &kd->data[0], pubkey_len / 2) );
   MPI_CHK( mpi_read_binary (&rsa_ctx.Q, &kd->data[pubkey_len / 2],
 			    pubkey_len / 2) );
-#if 0
-  MPI_CHK( mpi_mul_mpi (&rsa_ctx.N, &rsa_ctx.P, &rsa_ctx.Q) );
-#endif
+  MPI_CHK( mpi_read_binary (&rsa_ctx.N, kd->pubkey, pubkey_len) );
   MPI_CHK( mpi_sub_int (&P1, &rsa_ctx.P, 1) );
   MPI_CHK( mpi_sub_int (&Q1, &rsa_ctx.Q, 1) );
   MPI_CHK( mpi_mul_mpi (&H, &P1, &Q1) );
@@ -72,6 +137,7 @@ rsa_sign (const uint8_t *raw_message, uint8_t *output, int msg_len,
   MPI_CHK( mpi_mod_mpi (&rsa_ctx.DP, &rsa_ctx.D, &P1) );
   MPI_CHK( mpi_mod_mpi (&rsa_ctx.DQ, &rsa_ctx.D, &Q1) );
   MPI_CHK( mpi_inv_mod (&rsa_ctx.QP, &rsa_ctx.Q, &rsa_ctx.P) );
+  MPI_CHK( rsa_blinding_get (kd, pubkey_len) );
  cleanup:
   mpi_free (&P1);  mpi_free (&Q1);  mpi_free (&H);
   if (ret == 0)
@@ -84,12 +150,14 @@ rsa_sign (const uint8_t *raw_message, uint8_t *output, int msg_len,
       clp.arg = NULL;
       chopstx_cleanup_push (&clp);
       cs = chopstx_setcancelstate (0); /* Allow cancellation.  */
-      ret = rsa_rsassa_pkcs1_v15_sign (&rsa_ctx, NULL, NULL,
+      ret = rsa_rsassa_pkcs1_v15_sign (&rsa_ctx, random_gen, &index,
 				       RSA_PRIVATE, SIG_RSA_RAW,
 				       msg_len, raw_message, temp);
       memcpy (output, temp, pubkey_len);
       chopstx_setcancelstate (cs);
       chopstx_cleanup_pop (0);
+      if (ret == 0)
+	rsa_blinding_put (kd, pubkey_len);
     }
 
   rsa_free (&rsa_ctx);
@@ -136,6 +204,7 @@ rsa_decrypt (const uint8_t *input, uint8_t *output, int msg_len,
 {
   mpi P1, Q1, H;
   int ret;
+  uint8_t index = 0;
 #ifdef GNU_LINUX_EMULATION
   size_t output_len;
 #endif
@@ -152,9 +221,7 @@ rsa_decrypt (const uint8_t *input, uint8_t *output, int msg_len,
   MPI_CHK( mpi_lset (&rsa_ctx.E, 0x10001) );
   MPI_CHK( mpi_read_binary (&rsa_ctx.P, &kd->data[0], msg_len / 2) );
   MPI_CHK( mpi_read_binary (&rsa_ctx.Q, &kd->data[msg_len / 2], msg_len / 2) );
-#if 0
-  MPI_CHK( mpi_mul_mpi (&rsa_ctx.N, &rsa_ctx.P, &rsa_ctx.Q) );
-#endif
+  MPI_CHK( mpi_read_binary (&rsa_ctx.N, kd->pubkey, msg_len) );
   MPI_CHK( mpi_sub_int (&P1, &rsa_ctx.P, 1) );
   MPI_CHK( mpi_sub_int (&Q1, &rsa_ctx.Q, 1) );
   MPI_CHK( mpi_mul_mpi (&H, &P1, &Q1) );
@@ -162,6 +229,7 @@ rsa_decrypt (const uint8_t *input, uint8_t *output, int msg_len,
   MPI_CHK( mpi_mod_mpi (&rsa_ctx.DP, &rsa_ctx.D, &P1) );
   MPI_CHK( mpi_mod_mpi (&rsa_ctx.DQ, &rsa_ctx.D, &Q1) );
   MPI_CHK( mpi_inv_mod (&rsa_ctx.QP, &rsa_ctx.Q, &rsa_ctx.P) );
+  MPI_CHK( rsa_blinding_get (kd, msg_len) );
  cleanup:
   mpi_free (&P1);  mpi_free (&Q1);  mpi_free (&H);
   if (ret == 0)
@@ -175,17 +243,19 @@ rsa_decrypt (const uint8_t *input, uint8_t *output, int msg_len,
       chopstx_cleanup_push (&clp);
       cs = chopstx_setcancelstate (0); /* Allow cancellation.  */
 #ifdef GNU_LINUX_EMULATION
-      ret = rsa_rsaes_pkcs1_v15_decrypt (&rsa_ctx, NULL, NULL,
+      ret = rsa_rsaes_pkcs1_v15_decrypt (&rsa_ctx, random_gen, &index,
 					 RSA_PRIVATE, &output_len, input,
 					 output, MAX_RES_APDU_DATA_SIZE);
       *output_len_p = (unsigned int)output_len;
 #else
-      ret = rsa_rsaes_pkcs1_v15_decrypt (&rsa_ctx, NULL, NULL,
+      ret = rsa_rsaes_pkcs1_v15_decrypt (&rsa_ctx, random_gen, &index,
 					 RSA_PRIVATE, output_len_p, input,
 					 output, MAX_RES_APDU_DATA_SIZE);
 #endif
       chopstx_setcancelstate (cs);
       chopstx_cleanup_pop (0);
+      if (ret == 0)
+	rsa_blinding_put (kd, msg_len);
     }
 
   rsa_free (&rsa_ctx);
@@ -247,7 +317,6 @@ rsa_genkey (int pubkey_len, uint8_t *pubkey, uint8_t *p_q)
 
   extern int prng_seed (int (*f_rng)(void *, unsigned char *, size_t),
 			void *p_rng);
-  extern void neug_flush (void);
 
   neug_flush ();
   prng_seed (random_gen, &index);
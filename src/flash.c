@@ -38,6 +38,32 @@
 #include "sys.h"
 #include "gnuk.h"
 
+#ifdef PROFILE_SUPPORT
+struct flash_prof flash_prof;
+#endif
+
+/*
+ * Program a halfword / erase a page, counting the event for profiling.
+ * All writes to flash memory in this file go through these.
+ */
+static int
+flash_prof_program (uintptr_t addr, uint16_t hw)
+{
+#ifdef PROFILE_SUPPORT
+  flash_prof.program++;
+#endif
+  return flash_program_halfword (addr, hw);
+}
+
+static void
+flash_prof_erase (uintptr_t addr)
+{
+#ifdef PROFILE_SUPPORT
+  flash_prof.erase++;
+#endif
+  flash_erase_page (addr);
+}
+
 /*
  * Flash memory map
  *
@@ -57,19 +83,44 @@
  *         Three flash pages for keystore
  *         a page contains a key data of:
  *              For RSA-2048: 512-byte (p, q and N)
+ *              For RSA-3072: 768-byte (p, q and N)
  *              For RSA-4096: 1024-byte (p, q and N)
  *              For ECDSA/ECDH and EdDSA, there are padding after public key
  * _data_pool
- *	   <two pages>
+ *	   <FLASH_DATA_POOL_PAGES pages>
+ * _counter_pool
+ *	   <one page> for digital signature counter (at the end)
  */
 
 #define FLASH_DATA_POOL_HEADER_SIZE	2
-#define FLASH_DATA_POOL_SIZE		(flash_page_size*2)
+#define FLASH_DATA_POOL_SIZE		(flash_page_size*FLASH_DATA_POOL_PAGES)
 
 static uint16_t flash_page_size;
-static const uint8_t *data_pool;
+static const uint8_t *data_pool;	/* The page to append */
+static uint8_t data_pool_first;		/* Index of the first page of log */
+static uint8_t data_pool_num;		/* Number of pages of log */
 static uint8_t *last_p;
 
+/*
+ * Key pages released, but not erased yet: bit for each kind of key.
+ * It's erased in idle time, or at allocation.  It's also recorded in
+ * data pool (see gpg_data_set_key_page_dirty), to be erased after
+ * power loss.
+ */
+static uint8_t key_page_dirty;
+
+/*
+ * Batch of writes, see flash_do_batch_begin.  Releases in a batch are
+ * deferred.  In a batch of key import or PIN change, a private key DO
+ * may be written twice for each key, and keystring DOs (PW1, RC and
+ * PW3) are written once.
+ */
+static uint8_t *batch_p;
+static uint8_t batch_failed;
+#define FLASH_DO_BATCH_RELEASE_MAX (3 * 2 + 3)
+static const uint8_t *batch_release[FLASH_DO_BATCH_RELEASE_MAX];
+static int batch_release_num;
+
 /* The first halfword is generation for the data page (little endian) */
 const uint8_t flash_data[4] __attribute__ ((section (".gnuk_data"))) = {
   0x00, 0x00, 0xff, 0xff
@@ -85,8 +136,12 @@ const uint8_t flash_data2[4] __attribute__ ((section (".gnuk_data2"))) = {
 #ifdef GNU_LINUX_EMULATION
 extern uint8_t *flash_addr_key_storage_start;
 extern uint8_t *flash_addr_data_storage_start;
+extern uint8_t *flash_addr_counter_start;
 #define FLASH_ADDR_KEY_STORAGE_START  flash_addr_key_storage_start
 #define FLASH_ADDR_DATA_STORAGE_START flash_addr_data_storage_start
+#define FLASH_ADDR_COUNTER_START      flash_addr_counter_start
+/* The flash image has storage for identity 0 only.  */
+#define FLASH_IDENTITY_MAX 0
 #else
 /* Linker sets these symbols */
 extern uint8_t _keystore_pool;
@@ -95,6 +150,9 @@ extern uint8_t _keystore_pool1;
 extern uint8_t _data_pool1;
 extern uint8_t _keystore_pool2;
 extern uint8_t _data_pool2;
+extern uint8_t _counter_pool;
+extern uint8_t _counter_pool1;
+extern uint8_t _counter_pool2;
 extern uint8_t _identsel; /* identity selection page */
 extern uint8_t ch_certificate_start;
 extern uint8_t ch_certificate_start1;
@@ -104,16 +162,23 @@ static uint8_t *_ch_cert_map[]={(&ch_certificate_start),(&ch_certificate_start1)
 
 static uint8_t *_keystore_map[]={(&_keystore_pool),(&_keystore_pool1),(&_keystore_pool2)};
 static uint8_t *_data_map[]={(&_data_pool),(&_data_pool1),(&_data_pool2)};
-uint8_t _selected_identity=0;
+static uint8_t *_counter_map[]={(&_counter_pool),(&_counter_pool1),(&_counter_pool2)};
 
 #define FLASH_ADDR_KEY_STORAGE_START  (_keystore_map[_selected_identity])
 #define FLASH_ADDR_DATA_STORAGE_START (_data_map[_selected_identity])
+#define FLASH_ADDR_COUNTER_START (_counter_map[_selected_identity])
 #define FLASH_ADDR_CHCERT_START (_ch_cert_map[_selected_identity])
+#define FLASH_IDENTITY_MAX 2
 #endif
 
+uint8_t _selected_identity=0; /* identity in use */
+static uint8_t default_identity=0; /* identity in selection page */
+
+#if defined(CERTDO_SUPPORT)
 uint8_t* flash_get_ch_cert_start(){
     return FLASH_ADDR_CHCERT_START;
 }
+#endif
 
 static int key_available_at (const uint8_t *k, int key_size)
 {
@@ -177,6 +242,15 @@ static int key_available_at (const uint8_t *k, int key_size)
  * Now, of course, instead of 6 bytes we have 1024 - meaning we need to erase even less often. This is great!
  * On other stm32 parts (other than the F1 series) the flash controller allows clearing arbitrary bits. This would let us reduce erases even further.
  */
+#ifdef GNU_LINUX_EMULATION
+/* No identity selection page in the flash image, it's always identity 0.  */
+void flash_read_selected_identity(){
+}
+
+static void flash_write_selected_identity(uint8_t id){
+    (void)id;
+}
+#else
 void flash_read_selected_identity(){
     for(uint16_t byte=0;byte<1024;byte+=2){
         uint8_t b=((&_identsel)[byte]&0x3);
@@ -185,11 +259,12 @@ void flash_read_selected_identity(){
         }else{
             if(b==3){ b=0; }
             _selected_identity=b;
+            default_identity=b;
             return;
         }
     }
     /* default identity is zero - if we reached here and found only zeroes the flash page is in an invalid state and we should erase it */
-    flash_erase_page ((uintptr_t)(&_identsel));
+    flash_prof_erase ((uintptr_t)(&_identsel));
 }
 
 
@@ -197,7 +272,7 @@ static void flash_write_selected_identity(uint8_t id){
     if(id>2){
         return;
     }
-    if(id==_selected_identity){
+    if(id==default_identity){
         return;
     }
     for(uint16_t byte=0;byte<1024;byte+=2){
@@ -205,20 +280,20 @@ static void flash_write_selected_identity(uint8_t id){
         if(b==0x00){
             continue; /* skip all all-zero byte pairs */
         }else{
-            if(_selected_identity==0){
-                flash_program_halfword ((uintptr_t)((&_identsel)+byte),id);
+            if(default_identity==0){
+                flash_prof_program ((uintptr_t)((&_identsel)+byte),id);
                 return;
             }else{
                 if(byte==1022){
-                    flash_erase_page ((uintptr_t)(&_identsel));
+                    flash_prof_erase ((uintptr_t)(&_identsel));
                     if(id>0){
-                        flash_program_halfword ((uintptr_t)((&_identsel)),id);
+                        flash_prof_program ((uintptr_t)((&_identsel)),id);
                     }
                     return;
                 }else{
-                    flash_program_halfword ((uintptr_t)((&_identsel)+byte),0);
+                    flash_prof_program ((uintptr_t)((&_identsel)+byte),0);
                     if(id>0){
-                        flash_program_halfword ((uintptr_t)((&_identsel)+byte+2),id);
+                        flash_prof_program ((uintptr_t)((&_identsel)+byte+2),id);
                     }
                     return;
                 }
@@ -226,26 +301,68 @@ static void flash_write_selected_identity(uint8_t id){
         }
     }
 }
+#endif
 
-void flash_set_identity(uint8_t id){
-    if(id>2){
-        return;
+/* Switch to identity ID, without reset: the caller is responsible to
+ * initialize the card again (see gpg_switch_identity).
+ * Return 0 on switch, -1 when ID is invalid or it's the current one. */
+int flash_set_identity(uint8_t id){
+    if(id>FLASH_IDENTITY_MAX){
+        return -1;
     }
-    if(id==_selected_identity){
-        return;
+    if(id==default_identity){
+        return -1;
     }
     flash_write_selected_identity(id);
-    nvic_system_reset();
+    default_identity=id;
+    _selected_identity=id;
+    return 0;
 }
 
+/* Use the storage of identity ID, only in RAM (for CCID slot).
+ * The caller is responsible to initialize the card again. */
+void flash_select_identity(uint8_t id){
+    if(id>FLASH_IDENTITY_MAX){
+        return;
+    }
+    _selected_identity=id;
+}
+
+/* CCID slot 0 is for the identity selected in the identity selection
+ * page, slot 1 and 2 are for the others. */
+uint8_t flash_slot_identity(uint8_t slot){
+    return (default_identity+slot)%(FLASH_IDENTITY_MAX+1);
+}
+
+
+static uint8_t *
+flash_data_pool_page (int i)
+{
+  return FLASH_ADDR_DATA_STORAGE_START
+    + flash_page_size * (i % FLASH_DATA_POOL_PAGES);
+}
+
+static uint16_t
+flash_data_pool_generation (int i)
+{
+  return *(const uint16_t *)flash_data_pool_page (i);
+}
+
+/* Return 1 if generation A is newer than B.  Generation wraps at 0xffff.  */
+static int
+generation_newer (uint16_t a, uint16_t b)
+{
+  uint16_t d = a >= b ? a - b : a + 0xffff - b;
+
+  return d != 0 && d < 0x8000;
+}
 
 #define CHIP_ID_REG      ((uint32_t *)0xe0042000)
 void
 flash_do_storage_init (const uint8_t **p_do_start, const uint8_t **p_do_end)
 {
-  uint16_t gen0, gen1;
-  uint16_t *gen0_p = (uint16_t *)FLASH_ADDR_DATA_STORAGE_START;
-  uint16_t *gen1_p;
+  uint16_t gen, newest = 0xffff;
+  int i;
 
   flash_page_size = 1024;
 #if !defined (GNU_LINUX_EMULATION)
@@ -253,32 +370,97 @@ flash_do_storage_init (const uint8_t **p_do_start, const uint8_t **p_do_end)
     flash_page_size = 2048;
 #endif
 
-  gen1_p = (uint16_t *)(FLASH_ADDR_DATA_STORAGE_START + flash_page_size);
   data_pool = FLASH_ADDR_DATA_STORAGE_START;
+  data_pool_first = 0;
+  data_pool_num = 1;
 
-  /* Check data pool generation and choose the page */
-  gen0 = *gen0_p;
-  gen1 = *gen1_p;
+  /* Check data pool generation of each page and choose the newest.  */
+  for (i = 0; i < FLASH_DATA_POOL_PAGES; i++)
+    {
+      gen = flash_data_pool_generation (i);
+      if (gen == 0xffff)	/* Erased page.  */
+	continue;
+      if (newest == 0xffff || generation_newer (gen, newest))
+	newest = gen;
+    }
 
-  if (gen0 == 0xffff && gen1 == 0xffff)
+  if (newest == 0xffff)
     {
       /* It's terminated.  */
       *p_do_start = *p_do_end = NULL;
       return;
     }
 
-  if (gen0 == 0xffff)
-    /* Use another page if a page is erased.  */
-    data_pool = FLASH_ADDR_DATA_STORAGE_START + flash_page_size;
-  else if (gen1 == 0xffff)
-    /* Or use different page if another page is erased.  */
-    data_pool = FLASH_ADDR_DATA_STORAGE_START;
-  else if ((gen0 == 0xfffe && gen1 == 0) || gen1 > gen0)
-    /* When both pages have valid header, use newer page.   */
-    data_pool = FLASH_ADDR_DATA_STORAGE_START + flash_page_size;
+  /*
+   * Pages of the newest generation are the log, which are
+   * consecutive in the ring of pages.  Find the first one.
+   */
+  for (i = 0; i < FLASH_DATA_POOL_PAGES; i++)
+    if (flash_data_pool_generation (i) == newest
+	&& flash_data_pool_generation (i + FLASH_DATA_POOL_PAGES - 1) != newest)
+      break;
+  if (i == FLASH_DATA_POOL_PAGES)
+    i = 0;			/* Should not happen.  */
+
+  data_pool_first = i;
+  data_pool_num = 1;
+  while (data_pool_num < FLASH_DATA_POOL_PAGES
+	 && flash_data_pool_generation (i + data_pool_num) == newest)
+    data_pool_num++;
+  data_pool = flash_data_pool_page (i + data_pool_num - 1);
+
+  *p_do_start = flash_data_pool_page (i) + FLASH_DATA_POOL_HEADER_SIZE;
+  *p_do_end = flash_data_pool_page (i) + flash_page_size;
+}
+
+/*
+ * For scanning data pool: Return the number of pages of the log.
+ */
+int
+flash_do_pages (void)
+{
+  return data_pool_num;
+}
+
+/*
+ * Return the start of records in I-th page of the log, storing the
+ * end of the page to P_DO_END.
+ */
+const uint8_t *
+flash_do_page (int i, const uint8_t **p_do_end)
+{
+  const uint8_t *page = flash_data_pool_page (data_pool_first + i);
+
+  *p_do_end = page + flash_page_size;
+  return page + FLASH_DATA_POOL_HEADER_SIZE;
+}
+
+/*
+ * Offset of a record in the log, and its reverse, for checkpoint.
+ * Offset is counted from the first page of the log.
+ */
+uint16_t
+flash_do_offset (const uint8_t *p)
+{
+  const uint8_t *first = flash_data_pool_page (data_pool_first);
+
+  if (p < first)
+    return p + FLASH_DATA_POOL_SIZE - first;
+  else
+    return p - first;
+}
+
+const uint8_t *
+flash_do_at (uint16_t offset)
+{
+  const uint8_t *p = flash_data_pool_page (data_pool_first) + offset;
 
-  *p_do_start = data_pool + FLASH_DATA_POOL_HEADER_SIZE;
-  *p_do_end = data_pool + flash_page_size;
+  if ((offset & 1) || offset >= flash_page_size * data_pool_num)
+    return NULL;
+
+  if (p >= FLASH_ADDR_DATA_STORAGE_START + FLASH_DATA_POOL_SIZE)
+    p -= FLASH_DATA_POOL_SIZE;
+  return p;
 }
 
 static uint8_t *flash_key_getpage (enum kind_of_key kk);
@@ -292,19 +474,26 @@ flash_terminate (void)
   const uint8_t *p;
 
   p = gpg_get_firmware_update_key (0);
-  flash_erase_page ((uintptr_t)p);
+  flash_prof_erase ((uintptr_t)p);
 #endif
   for (i = 0; i < 3; i++)
-    flash_erase_page ((uintptr_t)flash_key_getpage (i));
-  flash_erase_page ((uintptr_t)FLASH_ADDR_DATA_STORAGE_START);
-  flash_erase_page ((uintptr_t)(FLASH_ADDR_DATA_STORAGE_START + flash_page_size));
+    flash_prof_erase ((uintptr_t)flash_key_getpage (i));
+  key_page_dirty = 0;
+  for (i = 0; i < FLASH_DATA_POOL_PAGES; i++)
+    flash_prof_erase ((uintptr_t)flash_data_pool_page (i));
   data_pool = FLASH_ADDR_DATA_STORAGE_START;
+  data_pool_first = 0;
+  data_pool_num = 1;
   last_p = FLASH_ADDR_DATA_STORAGE_START + FLASH_DATA_POOL_HEADER_SIZE;
+  batch_p = NULL;
+  batch_failed = 0;
+  batch_release_num = 0;
+  flash_counter_clear ();
 #if defined(CERTDO_SUPPORT)
-  flash_erase_page ((uintptr_t)FLASH_ADDR_CHCERT_START);
+  flash_prof_erase ((uintptr_t)FLASH_ADDR_CHCERT_START);
   if(_selected_identity!=2){
   if (FLASH_CH_CERTIFICATE_SIZE > flash_page_size)
-    flash_erase_page ((uintptr_t)(FLASH_ADDR_CHCERT_START + flash_page_size));
+    flash_prof_erase ((uintptr_t)(FLASH_ADDR_CHCERT_START + flash_page_size));
   }
 #endif
 }
@@ -312,10 +501,17 @@ flash_terminate (void)
 void
 flash_activate (void)
 {
-  flash_program_halfword ((uintptr_t)FLASH_ADDR_DATA_STORAGE_START, 0);
+  flash_prof_program ((uintptr_t)FLASH_ADDR_DATA_STORAGE_START, 0);
 }
 
 
+/*
+ * The slot of a key in its page is recorded in the private key DO, so
+ * that we don't need to scan the page.  Scanning is done only when
+ * it's not recorded (DO by older version), or it doesn't match.
+ *
+ * Key pages to be erased are known by the record in data pool, too.
+ */
 void
 flash_key_storage_init (void)
 {
@@ -323,24 +519,43 @@ flash_key_storage_init (void)
   int i;
 
   /* For each key, find its address.  */
+  key_page_dirty = gpg_data_key_page_dirty ();
   p = FLASH_ADDR_KEY_STORAGE_START;
   for (i = 0; i < 3; i++)
     {
       const uint8_t *k;
       int key_size = gpg_get_algo_attr_key_size (i, GPG_KEY_STORAGE);
+      int prv_len = gpg_get_algo_attr_key_size (i, GPG_KEY_PRIVATE);
+      int slot;
 
       kd[i].pubkey = NULL;
-      for (k = p; k < p + flash_page_size; k += key_size)
-	if (key_available_at (k, key_size))
-	  {
-	    int prv_len = gpg_get_algo_attr_key_size (i, GPG_KEY_PRIVATE);
+      if (!gpg_do_has_prvkey (i))
+	{
+	  p += flash_page_size;
+	  continue;
+	}
 
-	    kd[i].pubkey = k + prv_len;
-	    break;
-	  }
+      /*
+       * The page may be recorded dirty before release of the private
+       * key DO, when power was lost before the release.
+       */
+      key_page_dirty &= ~(1 << i);
+      if ((slot = gpg_do_get_prvkey_slot (i)) >= 0
+	  && (slot + 1) * key_size <= flash_page_size
+	  && key_available_at (p + slot * key_size, key_size))
+	kd[i].pubkey = p + slot * key_size + prv_len;
+      else
+	for (k = p; k + key_size <= p + flash_page_size; k += key_size)
+	  if (key_available_at (k, key_size))
+	    {
+	      kd[i].pubkey = k + prv_len;
+	      break;
+	    }
 
       p += flash_page_size;
     }
+
+  gpg_data_set_key_page_dirty (key_page_dirty);
 }
 
 /*
@@ -373,34 +588,63 @@ flash_set_data_pool_last (const uint8_t *p)
 }
 
 /*
- * We use two pages
+ * We use FLASH_DATA_POOL_PAGES pages as a ring.
+ *
+ * The log consists of consecutive pages with same generation in the
+ * header.  When the last page is full, the log continues to the next
+ * page, up to FLASH_DATA_POOL_PAGES - 1 pages.  When it's full, all
+ * live data is copied to the remaining page with newer generation,
+ * and it is the log, then.  With two pages, it is the same as
+ * copying between two pages back and forth.
+ *
+ * Pages of older generation are not erased at once, but by
+ * flash_data_pool_idle.  It's safe, because the pages of newer
+ * generation is used by flash_do_storage_init.  A page is erased
+ * before use, if it's not erased yet (or, it has partial copy by
+ * power loss).
  */
+static uint8_t *
+flash_data_pool_next (void)
+{
+  uint8_t *p = flash_data_pool_page (data_pool_first + data_pool_num);
+
+  if (flash_check_blank (p, flash_page_size) == 0)
+    flash_prof_erase ((uintptr_t)p);
+
+  return p;
+}
+
+static void
+flash_data_pool_extend (void)
+{
+  uint8_t *dst = flash_data_pool_next ();
+  uint16_t generation = *(const uint16_t *)data_pool;
+
+  flash_prof_program ((uintptr_t)dst, generation);
+  data_pool = dst;
+  data_pool_num++;
+  last_p = dst + FLASH_DATA_POOL_HEADER_SIZE;
+  gpg_data_checkpoint ();
+}
+
 static int
 flash_copying_gc (void)
 {
-  uint8_t *src, *dst;
-  uint16_t generation;
+  uint8_t *dst = flash_data_pool_next ();
+  uint16_t generation = *(const uint16_t *)data_pool;
 
-  if (data_pool == FLASH_ADDR_DATA_STORAGE_START)
-    {
-      src = FLASH_ADDR_DATA_STORAGE_START;
-      dst = FLASH_ADDR_DATA_STORAGE_START + flash_page_size;
-    }
-  else
-    {
-      src = FLASH_ADDR_DATA_STORAGE_START + flash_page_size;
-      dst = FLASH_ADDR_DATA_STORAGE_START;
-    }
-
-  generation = *(uint16_t *)src;
+#ifdef PROFILE_SUPPORT
+  flash_prof.gc++;
+#endif
   data_pool = dst;
+  data_pool_first = (data_pool_first + data_pool_num) % FLASH_DATA_POOL_PAGES;
+  data_pool_num = 1;
   gpg_data_copy (data_pool + FLASH_DATA_POOL_HEADER_SIZE);
   if (generation == 0xfffe)
     generation = 0;
   else
     generation++;
-  flash_program_halfword ((uintptr_t)dst, generation);
-  flash_erase_page ((uintptr_t)src);
+  flash_prof_program ((uintptr_t)dst, generation);
   return 0;
 }
 
@@ -410,6 +654,112 @@ is_data_pool_full (size_t size)
   return last_p + size > data_pool + flash_page_size;
 }
 
+/*
+ * When free space is less than this and compaction will get at least
+ * this, compaction is done in idle time.
+ */
+#define FLASH_DATA_POOL_GC_MARGIN (flash_page_size / 4)
+
+/*
+ * Called by the OpenPGP thread when no command is processed.  It does
+ * one step of work at a time: erase of a released key page, erase of
+ * a page which is not in the log, or compaction of the data pool which
+ * is getting full.  By this, key import or key generation, and a
+ * command which writes data (like PSO:CDS with the signature counter)
+ * usually doesn't need to wait for erase or flash_copying_gc.
+ *
+ * Return 1 when work has been done, 0 when there is nothing to do.
+ */
+int
+flash_data_pool_idle (void)
+{
+  int i;
+  int used, free, live;
+
+  if (last_p == NULL)
+    return 0;
+
+  for (i = 0; i < 3; i++)
+    if ((key_page_dirty & (1 << i)))
+      {
+	flash_prof_erase ((uintptr_t)flash_key_getpage (i));
+	key_page_dirty &= ~(1 << i);
+	gpg_data_set_key_page_dirty (key_page_dirty);
+	return 1;
+      }
+
+  for (i = data_pool_num; i < FLASH_DATA_POOL_PAGES; i++)
+    {
+      uint8_t *p = flash_data_pool_page (data_pool_first + i);
+
+      if (flash_check_blank (p, flash_page_size) == 0)
+	{
+	  flash_prof_erase ((uintptr_t)p);
+	  return 1;
+	}
+    }
+
+  free = data_pool + flash_page_size - last_p
+    + (FLASH_DATA_POOL_PAGES - 1 - data_pool_num)
+    * (flash_page_size - FLASH_DATA_POOL_HEADER_SIZE);
+  if (free >= FLASH_DATA_POOL_GC_MARGIN)
+    return 0;
+
+  used = (data_pool_num - 1) * (flash_page_size - FLASH_DATA_POOL_HEADER_SIZE)
+    + (last_p - data_pool - FLASH_DATA_POOL_HEADER_SIZE);
+  live = gpg_data_size ();
+  if (used - live < FLASH_DATA_POOL_GC_MARGIN)
+    return 0;
+
+  flash_copying_gc ();
+  return 1;
+}
+
+/*
+ * Batch of writes to data pool.
+ *
+ * Records written between flash_do_batch_begin and flash_do_batch_commit
+ * are valid only when the batch is committed.  The batch starts with
+ * the header of NR_BATCH (0xfffa), and it is committed by programming
+ * the header to zero (released word).  When power is lost before the
+ * commit, the records are ignored by gpg_data_scan, which writes the
+ * end mark of the batch (0x00fa).  A batch is aborted by writing the
+ * end mark.  Release of DOs in a batch is deferred until the commit,
+ * so that old records remain valid.
+ *
+ * Space for the whole batch (with the end mark) is prepared at the
+ * beginning, so that copying GC runs at most once, before the batch.
+ * A batch never continues to another page: an allocation which
+ * exceeds the space fails, and the batch can only be aborted.
+ */
+static int
+flash_data_pool_prepare (size_t size)
+{
+  if (batch_p)
+    {
+      /* Keep the space for the end mark.  */
+      if (!is_data_pool_full (size + 2))
+	return 0;
+
+      DEBUG_INFO ("batch overflow.\r\n");
+      batch_failed = 1;
+      return -1;
+    }
+
+  if (!is_data_pool_full (size))
+    return 0;
+
+  if (data_pool_num < FLASH_DATA_POOL_PAGES - 1)
+    flash_data_pool_extend ();
+  else if (flash_copying_gc () < 0)
+    fatal (FATAL_FLASH);
+
+  if (/*still*/ is_data_pool_full (size))
+    fatal (FATAL_FLASH);
+
+  return 0;
+}
+
 static uint8_t *
 flash_data_pool_allocate (size_t size)
 {
@@ -417,15 +767,83 @@ flash_data_pool_allocate (size_t size)
 
   size = (size + 1) & ~1;	/* allocation unit is 1-halfword (2-byte) */
 
-  if (is_data_pool_full (size))
-    if (flash_copying_gc () < 0 || /*still*/ is_data_pool_full (size))
-      fatal (FATAL_FLASH);
+  if (flash_data_pool_prepare (size) < 0)
+    return NULL;
 
   p = last_p;
   last_p += size;
   return p;
 }
 
+/*
+ * Begin a batch of writes, which will use SIZE bytes at most.
+ * Return -1 when there is no space for the batch.
+ */
+int
+flash_do_batch_begin (size_t size)
+{
+  /* Header, records, and the end mark.  */
+  size = 2 + ((size + 1) & ~1) + 2;
+
+  if (batch_p != NULL
+      || size > (size_t)flash_page_size - FLASH_DATA_POOL_HEADER_SIZE)
+    return -1;
+
+  flash_data_pool_prepare (size);
+
+  batch_p = flash_data_pool_allocate (2);
+  batch_failed = 0;
+  batch_release_num = 0;
+  flash_prof_program ((uintptr_t)batch_p, NR_BATCH | 0xff00);
+  return 0;
+}
+
+/*
+ * Commit the batch.  When an allocation or a release in the batch
+ * failed, the batch is aborted instead, and return -1.
+ */
+int
+flash_do_batch_commit (void)
+{
+  int i;
+
+  if (batch_p == NULL)
+    return 0;
+
+  if (batch_failed)
+    {
+      flash_do_batch_abort ();
+      return -1;
+    }
+
+  flash_prof_program ((uintptr_t)batch_p, 0);
+  batch_p = NULL;
+
+  for (i = 0; i < batch_release_num; i++)
+    flash_do_release (batch_release[i]);
+  batch_release_num = 0;
+  return 0;
+}
+
+/*
+ * Abort the batch: its records are ignored, and old DOs remain.  The
+ * state in RAM (DO_PTR, etc.) is rebuilt from flash memory.
+ */
+void
+flash_do_batch_abort (void)
+{
+  if (batch_p == NULL)
+    return;
+
+  batch_p = NULL;
+  batch_failed = 0;
+  batch_release_num = 0;
+
+  /* The end mark fits in the space kept at the beginning.  */
+  flash_put_data (NR_BATCH);
+  gpg_data_rescan ();
+}
+
 void
 flash_do_write_internal (const uint8_t *p, int nr, const uint8_t *data, int len)
 {
@@ -435,14 +853,14 @@ flash_do_write_internal (const uint8_t *p, int nr, const uint8_t *data, int len)
 
   addr = (uintptr_t)p;
   hw = nr | (len << 8);
-  if (flash_program_halfword (addr, hw) != 0)
+  if (flash_prof_program (addr, hw) != 0)
     flash_warning ("DO WRITE ERROR");
   addr += 2;
 
   for (i = 0; i < len/2; i++)
     {
       hw = data[i*2] | (data[i*2+1]<<8);
-      if (flash_program_halfword (addr, hw) != 0)
+      if (flash_prof_program (addr, hw) != 0)
 	flash_warning ("DO WRITE ERROR");
       addr += 2;
     }
@@ -450,7 +868,7 @@ flash_do_write_internal (const uint8_t *p, int nr, const uint8_t *data, int len)
   if ((len & 1))
     {
       hw = data[i*2] | 0xff00;
-      if (flash_program_halfword (addr, hw) != 0)
+      if (flash_prof_program (addr, hw) != 0)
 	flash_warning ("DO WRITE ERROR");
     }
 }
@@ -496,24 +914,37 @@ flash_do_release (const uint8_t *do_data)
       || do_data > FLASH_ADDR_DATA_STORAGE_START + FLASH_DATA_POOL_SIZE)
     return;
 
+  if (batch_p)
+    {
+      /* Release it after commit.  Never before, even if no room.  */
+      if (batch_release_num < FLASH_DO_BATCH_RELEASE_MAX)
+	batch_release[batch_release_num++] = do_data;
+      else
+	{
+	  DEBUG_INFO ("batch release overflow.\r\n");
+	  batch_failed = 1;
+	}
+      return;
+    }
+
   addr += 2;
 
   /* Fill zero for content and pad */
   for (i = 0; i < len/2; i ++)
     {
-      if (flash_program_halfword (addr, 0) != 0)
+      if (flash_prof_program (addr, 0) != 0)
 	flash_warning ("fill-zero failure");
       addr += 2;
     }
 
   if ((len & 1))
     {
-      if (flash_program_halfword (addr, 0) != 0)
+      if (flash_prof_program (addr, 0) != 0)
 	flash_warning ("fill-zero pad failure");
     }
 
   /* Fill 0x0000 for "tag_number and length" word */
-  if (flash_program_halfword (addr_tag, 0) != 0)
+  if (flash_prof_program (addr_tag, 0) != 0)
     flash_warning ("fill-zero tag_nr failure");
 }
 
@@ -532,8 +963,19 @@ flash_key_alloc (enum kind_of_key kk)
   int i;
   int key_size = gpg_get_algo_attr_key_size (kk, GPG_KEY_STORAGE);
 
-  /* Seek free space in the page.  */
-  for (k = k0; k < k0 + flash_page_size; k += key_size)
+  if ((key_page_dirty & (1 << kk)))
+    {
+      /* Not erased in idle time yet.  */
+      flash_prof_erase ((uintptr_t)k0);
+      key_page_dirty &= ~(1 << kk);
+      gpg_data_set_key_page_dirty (key_page_dirty);
+    }
+
+  /*
+   * Seek free space in the page.  When KEY_SIZE doesn't divide the
+   * page size (RSA-3072), the remainder at the end is never used.
+   */
+  for (k = k0; k + key_size <= k0 + flash_page_size; k += key_size)
     {
       const uint32_t *p = (const uint32_t *)k;
 
@@ -550,6 +992,14 @@ flash_key_alloc (enum kind_of_key kk)
   return NULL;
 }
 
+int
+flash_key_slot (enum kind_of_key kk, const uint8_t *key_addr)
+{
+  int key_size = gpg_get_algo_attr_key_size (kk, GPG_KEY_STORAGE);
+
+  return (key_addr - flash_key_getpage (kk)) / key_size;
+}
+
 int
 flash_key_write (uint8_t *key_addr,
 		 const uint8_t *key_data, int key_data_len,
@@ -563,7 +1013,7 @@ flash_key_write (uint8_t *key_addr,
   for (i = 0; i < key_data_len/2; i ++)
     {
       hw = key_data[i*2] | (key_data[i*2+1]<<8);
-      if (flash_program_halfword (addr, hw) != 0)
+      if (flash_prof_program (addr, hw) != 0)
 	return -1;
       addr += 2;
     }
@@ -571,7 +1021,7 @@ flash_key_write (uint8_t *key_addr,
   for (i = 0; i < pubkey_len/2; i ++)
     {
       hw = pubkey[i*2] | (pubkey[i*2+1]<<8);
-      if (flash_program_halfword (addr, hw) != 0)
+      if (flash_prof_program (addr, hw) != 0)
 	return -1;
       addr += 2;
     }
@@ -583,9 +1033,10 @@ static int
 flash_check_all_other_keys_released (const uint8_t *key_addr, int key_size)
 {
   uintptr_t start = (uintptr_t)key_addr & ~(flash_page_size - 1);
+  uintptr_t end = start + flash_page_size - (flash_page_size % key_size);
   const uint32_t *p = (const uint32_t *)start;
 
-  while (p < (const uint32_t *)(start + flash_page_size))
+  while (p < (const uint32_t *)end)
     if (p == (const uint32_t *)key_addr)
       p += key_size/4;
     else
@@ -604,14 +1055,32 @@ flash_key_fill_zero_as_released (uint8_t *key_addr, int key_size)
   uintptr_t addr = (uintptr_t)key_addr;
 
   for (i = 0; i < key_size/2; i++)
-    flash_program_halfword (addr + i*2, 0);
+    flash_prof_program (addr + i*2, 0);
 }
 
+/*
+ * When a page of key is released, it is not erased at once, but in
+ * idle time by flash_data_pool_idle.  Key data in the page is useless
+ * after release, as it's encrypted by DEK, which is in the private
+ * key DO released.  It's called before the release of the DO, so that
+ * the record of the dirty page is written first.
+ *
+ * When there is free space after the key in the page, the key is
+ * filled by zero instead, so that next allocation can use the space
+ * without erase.
+ */
 void
 flash_key_release (uint8_t *key_addr, int key_size)
 {
-  if (flash_check_all_other_keys_released (key_addr, key_size))
-    flash_erase_page (((uintptr_t)key_addr & ~(flash_page_size - 1)));
+  int kk = (key_addr - FLASH_ADDR_KEY_STORAGE_START) / flash_page_size;
+  uint8_t *k0 = flash_key_getpage (kk);
+
+  if (flash_check_all_other_keys_released (key_addr, key_size)
+      && key_addr + key_size * 2 > k0 + flash_page_size)
+    {
+      key_page_dirty |= (1 << kk);
+      gpg_data_set_key_page_dirty (key_page_dirty);
+    }
   else
     flash_key_fill_zero_as_released (key_addr, key_size);
 }
@@ -619,21 +1088,25 @@ flash_key_release (uint8_t *key_addr, int key_size)
 void
 flash_key_release_page (enum kind_of_key kk)
 {
-  flash_erase_page ((uintptr_t)flash_key_getpage (kk));
+  if (flash_check_blank (flash_key_getpage (kk), flash_page_size) == 0)
+    {
+      key_page_dirty |= (1 << kk);
+      gpg_data_set_key_page_dirty (key_page_dirty);
+    }
 }
 
 
 void
 flash_clear_halfword (uintptr_t addr)
 {
-  flash_program_halfword (addr, 0);
+  flash_prof_program (addr, 0);
 }
 
 
 void
 flash_put_data_internal (const uint8_t *p, uint16_t hw)
 {
-  flash_program_halfword ((uintptr_t)p, hw);
+  flash_prof_program ((uintptr_t)p, hw);
 }
 
 void
@@ -645,9 +1118,34 @@ flash_put_data (uint16_t hw)
   if (p == NULL)
     {
       DEBUG_INFO ("data allocation failure.\r\n");
+      return;
+    }
+
+  flash_prof_program ((uintptr_t)p, hw);
+}
+
+
+/*
+ * Checkpoint record: tag NR_CHECKPOINT and the number of entries,
+ * followed by entries.  The tag is written first, so that the record
+ * can be skipped by scanning even if it's incomplete by power loss.
+ */
+void
+flash_checkpoint_write (const uint16_t *entry, int num)
+{
+  uint8_t *p;
+  int i;
+
+  p = flash_data_pool_allocate (2 + num * 2);
+  if (p == NULL)
+    {
+      DEBUG_INFO ("checkpoint allocation failure.\r\n");
+      return;
     }
 
-  flash_program_halfword ((uintptr_t)p, hw);
+  flash_prof_program ((uintptr_t)p, NR_CHECKPOINT | (num << 8));
+  for (i = 0; i < num; i++)
+    flash_prof_program ((uintptr_t)(p + 2 + i * 2), entry[i]);
 }
 
 
@@ -659,14 +1157,14 @@ flash_bool_clear (const uint8_t **addr_p)
   if ((p = *addr_p) == NULL)
     return;
 
-  flash_program_halfword ((uintptr_t)p, 0);
+  flash_prof_program ((uintptr_t)p, 0);
   *addr_p = NULL;
 }
 
 void
 flash_bool_write_internal (const uint8_t *p, int nr)
 {
-  flash_program_halfword ((uintptr_t)p, nr);
+  flash_prof_program ((uintptr_t)p, nr);
 }
 
 const uint8_t *
@@ -682,7 +1180,7 @@ flash_bool_write (uint8_t nr)
       return NULL;
     }
 
-  flash_program_halfword ((uintptr_t)p, hw);
+  flash_prof_program ((uintptr_t)p, hw);
   return p;
 }
 
@@ -698,7 +1196,7 @@ flash_enum_write_internal (const uint8_t *p, int nr, uint8_t v)
 {
   uint16_t hw = nr | (v << 8);
 
-  flash_program_halfword ((uintptr_t)p, hw);
+  flash_prof_program ((uintptr_t)p, hw);
 }
 
 const uint8_t *
@@ -714,7 +1212,7 @@ flash_enum_write (uint8_t nr, uint8_t v)
       return NULL;
     }
 
-  flash_program_halfword ((uintptr_t)p, hw);
+  flash_prof_program ((uintptr_t)p, hw);
   return p;
 }
 
@@ -750,14 +1248,14 @@ flash_cnt123_write_internal (const uint8_t *p, int which, int v)
   uint16_t hw;
 
   hw = NR_COUNTER_123 | (which << 8);
-  flash_program_halfword ((uintptr_t)p, hw);
+  flash_prof_program ((uintptr_t)p, hw);
 
   if (v == 1)
     return;
   else if (v == 2)
-    flash_program_halfword ((uintptr_t)p+2, 0xc3c3);
+    flash_prof_program ((uintptr_t)p+2, 0xc3c3);
   else				/* v == 3 */
-    flash_program_halfword ((uintptr_t)p+2, 0);
+    flash_prof_program ((uintptr_t)p+2, 0);
 }
 
 void
@@ -775,7 +1273,7 @@ flash_cnt123_increment (uint8_t which, const uint8_t **addr_p)
 	  return;
 	}
       hw = NR_COUNTER_123 | (which << 8);
-      flash_program_halfword ((uintptr_t)p, hw);
+      flash_prof_program ((uintptr_t)p, hw);
       *addr_p = p + 2;
     }
   else
@@ -790,7 +1288,7 @@ flash_cnt123_increment (uint8_t which, const uint8_t **addr_p)
       else
 	hw = 0;
 
-      flash_program_halfword ((uintptr_t)p, hw);
+      flash_prof_program ((uintptr_t)p, hw);
     }
 }
 
@@ -802,13 +1300,130 @@ flash_cnt123_clear (const uint8_t **addr_p)
   if ((p = *addr_p) == NULL)
     return;
 
-  flash_program_halfword ((uintptr_t)p, 0);
+  flash_prof_program ((uintptr_t)p, 0);
   p -= 2;
-  flash_program_halfword ((uintptr_t)p, 0);
+  flash_prof_program ((uintptr_t)p, 0);
   *addr_p = NULL;
 }
 
 
+/*
+ * Counter page: Unary counter for digital signature counter.
+ *
+ * The value of the counter is the base value recorded in data pool,
+ * plus the number of increments in the counter page.  The first
+ * halfword of the page is a stamp by the base value, so that a page
+ * for an old base value (by power loss after writing new base value
+ * and before erasing the page) can be detected.  Following halfwords
+ * count increments in unary, by the way of 123-counters:
+ *
+ *   0xffff: 0, 0xc3c3: 1, 0x0000: 2
+ *
+ * When the page is full, the caller records new base value to data
+ * pool and clears the page.
+ */
+static uint16_t counter_pos;	/* Index of halfword for next increment */
+
+/*
+ * Return the number of increments in the counter page for STAMP.
+ */
+int
+flash_counter_init (uint16_t stamp)
+{
+  const uint16_t *p = (const uint16_t *)FLASH_ADDR_COUNTER_START;
+  int n = 0;
+
+  counter_pos = 1;
+  if (p[0] != stamp)
+    {
+      /* For old base value, or erased.  */
+      flash_counter_clear ();
+      return 0;
+    }
+
+  while (counter_pos < flash_page_size / 2)
+    if (p[counter_pos] == 0xffff)
+      break;
+    else if (p[counter_pos] == 0x0000)
+      {
+	n += 2;
+	counter_pos++;
+      }
+    else
+      {
+	n++;
+	break;
+      }
+
+  return n;
+}
+
+/*
+ * Increment the counter by one.  Return -1 when the page is full.
+ */
+int
+flash_counter_increment (uint16_t stamp)
+{
+  uint16_t *p = (uint16_t *)FLASH_ADDR_COUNTER_START;
+
+  if (counter_pos >= flash_page_size / 2)
+    return -1;
+
+  if (p[0] == 0xffff && stamp != 0xffff)
+    flash_prof_program ((uintptr_t)p, stamp);
+
+  if (p[counter_pos] == 0xffff)
+    flash_prof_program ((uintptr_t)&p[counter_pos], 0xc3c3);
+  else
+    {
+      flash_prof_program ((uintptr_t)&p[counter_pos], 0);
+      counter_pos++;
+    }
+
+  return 0;
+}
+
+void
+flash_counter_clear (void)
+{
+  uint8_t *p = FLASH_ADDR_COUNTER_START;
+
+  if (flash_check_blank (p, flash_page_size) == 0)
+    flash_prof_erase ((uintptr_t)p);
+  counter_pos = 1;
+}
+
+/*
+ * Save the state of the storage of current identity to CTX, so that
+ * switching back to the identity doesn't need to initialize it again.
+ */
+void
+flash_save (struct flash_context *ctx)
+{
+  ctx->data_pool = data_pool;
+  ctx->last_p = last_p;
+  ctx->counter_pos = counter_pos;
+  ctx->data_pool_first = data_pool_first;
+  ctx->data_pool_num = data_pool_num;
+  ctx->key_page_dirty = key_page_dirty;
+}
+
+/*
+ * Restore the state of the storage from CTX, saved by flash_save for
+ * the identity selected now.
+ */
+void
+flash_restore (const struct flash_context *ctx)
+{
+  data_pool = ctx->data_pool;
+  last_p = ctx->last_p;
+  counter_pos = ctx->counter_pos;
+  data_pool_first = ctx->data_pool_first;
+  data_pool_num = ctx->data_pool_num;
+  key_page_dirty = ctx->key_page_dirty;
+}
+
+
 #if defined(CERTDO_SUPPORT)
 int
 flash_erase_binary (uint8_t file_id)
@@ -818,10 +1433,10 @@ flash_erase_binary (uint8_t file_id)
       const uint8_t *p = FLASH_ADDR_CHCERT_START;
       if (flash_check_blank (p, FLASH_CH_CERTIFICATE_SIZE) == 0)
 	{
-	  flash_erase_page ((uintptr_t)p);
+	  flash_prof_erase ((uintptr_t)p);
       if(_selected_identity!=2){
 	    if (FLASH_CH_CERTIFICATE_SIZE > flash_page_size)
-	      flash_erase_page ((uintptr_t)p + flash_page_size);
+	      flash_prof_erase ((uintptr_t)p + flash_page_size);
       }
 	}
 
@@ -852,7 +1467,7 @@ flash_write_binary (uint8_t file_id, const uint8_t *data,
       p = gpg_get_firmware_update_key (file_id - FILEID_UPDATE_KEY_0);
       if (len == 0 && offset == 0)
 	{ /* This means removal of update key.  */
-	  if (flash_program_halfword ((uintptr_t)p, 0) != 0)
+	  if (flash_prof_program ((uintptr_t)p, 0) != 0)
 	    flash_warning ("DO WRITE ERROR");
 	  return 0;
 	}
@@ -883,7 +1498,7 @@ flash_write_binary (uint8_t file_id, const uint8_t *data,
       for (i = 0; i < len/2; i++)
 	{
 	  hw = data[i*2] | (data[i*2+1]<<8);
-	  if (flash_program_halfword (addr, hw) != 0)
+	  if (flash_prof_program (addr, hw) != 0)
 	    flash_warning ("DO WRITE ERROR");
 	  addr += 2;
 	}
@@ -3,6 +3,8 @@
  */
 struct apdu {
   uint8_t seq;
+  uint8_t slot;			/* CCID slot, for identity */
+  uint8_t algo;			/* Key algorithm used, set by upper layer */
 
   /* command APDU */
   uint8_t *cmd_apdu_head;	/* CLS INS P1 P2 [ internal Lc ] */
@@ -21,7 +23,9 @@ extern struct apdu apdu;
 #define CARD_CHANGE_INSERT 0
 #define CARD_CHANGE_REMOVE 1
 #define CARD_CHANGE_TOGGLE 2
+#define CARD_CHANGE_SWAP   3	/* Card content replaced (identity switch) */
 void ccid_card_change_signal (int how);
+void ccid_set_identity (uint8_t id);
 
 /* CCID thread */
 #define EV_CARD_CHANGE        1
@@ -36,6 +40,11 @@ void ccid_card_change_signal (int how);
 #define EV_CMD_AVAILABLE          4
 #define EV_EXIT                   8
 #define EV_PINPAD_INPUT_DONE     16
+#define EV_SET_IDENTITY          32
+#define EV_SLOT_POWER_OFF        64
+
+void gpg_request_identity (uint8_t id);
+void gpg_request_slot_reset (uint8_t slot);
 
 /* Maximum cmd apdu data is key import 24+4+256+256 (proc_key_import) */
 #define MAX_CMD_APDU_DATA_SIZE (24+4+256+256) /* without header */
@@ -106,6 +115,11 @@ extern uint16_t data_objects_number_of_bytes;
 
 void gpg_data_scan (const uint8_t *start, const uint8_t *end);
 void gpg_data_copy (const uint8_t *p);
+int gpg_data_size (void);
+void gpg_data_checkpoint (void);
+void gpg_data_rescan (void);
+int gpg_data_key_page_dirty (void);
+void gpg_data_set_key_page_dirty (uint8_t dirty);
 void gpg_do_terminate (void);
 void gpg_do_get_data (uint16_t tag, int with_tag);
 void gpg_do_put_data (uint16_t tag, const uint8_t *data, int len);
@@ -120,7 +134,9 @@ const uint8_t *gpg_get_firmware_update_key (uint8_t keyno);
 #define ALGO_SECP256K1  2
 #define ALGO_ED25519    3
 #define ALGO_CURVE25519 4
+#define ALGO_RSA3K      5
 #define ALGO_RSA2K      255
+#define ALGO_NONE       254	/* No key is used */
 
 enum kind_of_key {
   GPG_KEY_FOR_SIGNING = 0,
@@ -138,23 +154,60 @@ int gpg_get_algo_attr (enum kind_of_key kk);
 int gpg_get_algo_attr_key_size (enum kind_of_key kk, enum size_of_key s);
 
 void flash_do_storage_init (const uint8_t **, const uint8_t **);
+int flash_do_pages (void);
+const uint8_t *flash_do_page (int i, const uint8_t **p_do_end);
+uint16_t flash_do_offset (const uint8_t *p);
+const uint8_t *flash_do_at (uint16_t offset);
+void flash_checkpoint_write (const uint16_t *entry, int num);
+int flash_do_batch_begin (size_t size);
+int flash_do_batch_commit (void);
+void flash_do_batch_abort (void);
+/* Size of a DO of LEN bytes in data pool.  */
+#define FLASH_DO_SIZE(len)	(2 + (((len) + 1) & ~1))
 void flash_terminate (void);
 void flash_activate (void);
 void flash_key_storage_init (void);
 void flash_do_release (const uint8_t *);
 const uint8_t *flash_do_write (uint8_t nr, const uint8_t *data, int len);
 uint8_t *flash_key_alloc (enum kind_of_key);
+int flash_key_slot (enum kind_of_key kk, const uint8_t *key_addr);
 void flash_key_release (uint8_t *, int);
 void flash_key_release_page (enum kind_of_key);
 int flash_key_write (uint8_t *key_addr,
 		     const uint8_t *key_data, int key_data_len,
 		     const uint8_t *pubkey, int pubkey_len);
 void flash_set_data_pool_last (const uint8_t *p);
+int flash_data_pool_idle (void);
 void flash_clear_halfword (uintptr_t addr);
 void flash_increment_counter (uint8_t counter_tag_nr);
 void flash_reset_counter (uint8_t counter_tag_nr);
 void flash_read_selected_identity(void);
-void flash_set_identity(uint8_t id);
+int flash_set_identity(uint8_t id);
+void flash_select_identity(uint8_t id);
+uint8_t flash_slot_identity(uint8_t slot);
+
+/* State of the storage of an identity, while another one is in use.  */
+struct flash_context {
+  const uint8_t *data_pool;
+  uint8_t *last_p;
+  uint16_t counter_pos;
+  uint8_t data_pool_first;
+  uint8_t data_pool_num;
+  uint8_t key_page_dirty;
+};
+
+void flash_save (struct flash_context *ctx);
+void flash_restore (const struct flash_context *ctx);
+
+#ifdef PROFILE_SUPPORT
+/* Number of flash memory events, for profiling */
+struct flash_prof {
+  uint32_t gc;
+  uint32_t erase;
+  uint32_t program;
+};
+extern struct flash_prof flash_prof;
+#endif
 
 #define FILEID_SERIAL_NO	0
 #define FILEID_UPDATE_KEY_0	1
@@ -199,6 +252,10 @@ struct prvkey_data {
   uint8_t dek_encrypted_1[DATA_ENCRYPTION_KEY_SIZE]; /* For user */
   uint8_t dek_encrypted_2[DATA_ENCRYPTION_KEY_SIZE]; /* For resetcode */
   uint8_t dek_encrypted_3[DATA_ENCRYPTION_KEY_SIZE]; /* For admin */
+  /*
+   * Index of the slot in key page.  DO by older version doesn't have it.
+   */
+  uint8_t key_slot;
 };
 
 #define BY_USER		1
@@ -227,8 +284,26 @@ void s2k (const unsigned char *salt, size_t slen,
 #define KS_GET_SALT(ks)       (ks + KEYSTRING_PASSLEN_SIZE)
 #define KS_GET_KEYSTRING(ks)  (ks + KS_META_SIZE)
 
+/*
+ * When there are private keys, keystring DO of PW1 and PW3 has
+ * verifier of keystring after salt, so that VERIFY can check the
+ * passphrase without decrypting private keys.  Older DO has no
+ * verifier (its length is KS_META_SIZE).
+ */
+#define KS_VERIFIER_SIZE      16
+#define KS_VERIFIER_DO_SIZE   (KS_META_SIZE + KS_VERIFIER_SIZE)
+#define KS_GET_VERIFIER(ks)   (ks + KS_META_SIZE)
+
+void ks_verifier (const unsigned char *keystring,
+		  unsigned char output[KS_VERIFIER_SIZE]);
+
 void gpg_do_clear_prvkey (enum kind_of_key kk);
+void gpg_do_clear_aes_cache (void);
 int gpg_do_load_prvkey (enum kind_of_key kk, int who, const uint8_t *keystring);
+void gpg_do_defer_prvkey (enum kind_of_key kk, int who,
+			  const uint8_t *keystring);
+int gpg_do_load_deferred_prvkey (enum kind_of_key kk);
+int gpg_do_get_prvkey_keystring (enum kind_of_key kk, uint8_t *key_string);
 int gpg_do_chks_prvkey (enum kind_of_key kk,
 			int who_old, const uint8_t *old_ks,
 			int who_new, const uint8_t *new_ks);
@@ -271,6 +346,7 @@ int rsa_decrypt (const uint8_t *, uint8_t *, int, struct key_data *,
 		 unsigned int *);
 int rsa_verify (const uint8_t *, int, const uint8_t *, const uint8_t *);
 int rsa_genkey (int, uint8_t *, uint8_t *);
+void rsa_blinding_reset (enum kind_of_key kk);
 
 int ecdsa_sign_p256r1 (const uint8_t *hash, uint8_t *output,
 		       const uint8_t *key_data);
@@ -296,7 +372,18 @@ int ecdh_decrypt_curve25519 (const uint8_t *input, uint8_t *output,
 
 const uint8_t *gpg_do_read_simple (uint8_t);
 void gpg_do_write_simple (uint8_t, const uint8_t *, int);
-void gpg_increment_digital_signature_counter (void);
+int gpg_do_simple_len (uint8_t);
+int gpg_do_has_prvkey (enum kind_of_key kk);
+int gpg_do_get_prvkey_slot (enum kind_of_key kk);
+void gpg_do_write_keystring (uint8_t nr, const uint8_t *ks_meta,
+			     const uint8_t *keystring);
+int gpg_get_pw1_lifetime (void);
+void gpg_increment_digital_signature_counter (int n);
+void gpg_do_write_behind (void);
+#ifdef PROFILE_SUPPORT
+int gpg_prof_read (uint8_t *p, int max);
+void gpg_prof_reset (void);
+#endif
 void gpg_do_get_initial_pw_setting (int is_pw3, int *r_len,
 				    const uint8_t **r_p);
 int gpg_do_kdf_check (int len, int how_many);
@@ -311,6 +398,18 @@ void fatal (uint8_t code) __attribute__ ((noreturn));
 extern uint8_t keystring_md_pw3[KEYSTRING_MD_SIZE];
 extern uint8_t admin_authorized;
 
+/* Authentication state of an identity, while another one is in use.  */
+struct ac_context {
+  uint8_t auth_status;
+  uint8_t admin_authorized;
+  uint8_t keystring_md_pw3[KEYSTRING_MD_SIZE];
+  uint8_t prvkey_who[3];
+  uint8_t prvkey_key_string[3][DATA_ENCRYPTION_KEY_SIZE];
+};
+
+void ac_save (struct ac_context *ctx);
+void ac_restore (struct ac_context *ctx);
+
 /*** Flash memory tag values ***/
 /* Data objects */
 /*
@@ -377,6 +476,7 @@ extern uint8_t admin_authorized;
  *   ECC p256k1:     0xf?02
  *   ECC Ed25519:    0xf?03
  *   ECC Curve25519: 0xf?04
+ *   RSA-3072:       0xf?05
  * where <?> == 1 (signature), 2 (decryption) or 3 (authentication)
  */
 #define NR_KEY_ALGO_ATTR_SIG	0xf1
@@ -393,7 +493,27 @@ extern uint8_t admin_authorized;
 #define NR_DO_UIF_DEC		0xf7
 #define NR_DO_UIF_AUT		0xf8
 /*
- * NR_UINT_SOMETHING could be here...  Use 0xf[459abcd]
+ * Representation of key pages released, but not erased yet:
+ *   0xf4<bits>, where <bit> is set for each kind of key.
+ *   No record in flash memory, when none.
+ */
+#define NR_KEY_PAGE_DIRTY	0xf4
+/*
+ * Representation of checkpoint (at the beginning of a page of log):
+ *   0xf9<n> <offset_0> ... <offset_n-1>
+ * where <offset_?> is a halfword of the offset in the log of a live
+ * record in the previous pages.
+ */
+#define NR_CHECKPOINT		0xf9
+/*
+ * Representation of batch (see flash_do_batch_begin):
+ *   0xfffa: start of batch, not committed
+ *   0x00fa: end of batch, which was not committed
+ * Committed batch has no representation (0x0000: released word).
+ */
+#define NR_BATCH		0xfa
+/*
+ * NR_UINT_SOMETHING could be here...  Use 0xf[45bcd]
  */
 /* 123-counters: Recorded in flash memory by 2-halfword (4-byte).  */
 /*
@@ -412,6 +532,26 @@ extern uint8_t admin_authorized;
 
 #define NUM_ALL_PRV_KEYS 3	/* SIG, DEC and AUT */
 
+/* State of data objects of an identity, while another one is in use.  */
+struct do_context {
+  const uint8_t *do_ptr[NR_DO__LAST__];
+  const uint8_t *pw1_lifetime_p;
+  const uint8_t *pw_err_counter_p[3];
+  const uint8_t *pw_err_clear_pending[3];
+  const uint8_t *algo_attr_p[3];
+  const uint8_t *pubkey[NUM_ALL_PRV_KEYS];
+  const uint8_t *key_page_dirty_p;
+  uint32_t digital_signature_counter;
+  uint32_t dsc_base;
+  uint16_t dsc_unary;
+  uint16_t data_objects_number_of_bytes;
+  uint8_t uif_flags;
+  int8_t num_prv_keys;
+};
+
+void gpg_do_save (struct do_context *ctx);
+void gpg_do_restore (const struct do_context *ctx);
+
 #if !defined(OPENPGP_CARD_INITIAL_PW1)
 #define OPENPGP_CARD_INITIAL_PW1 "123456"
 #endif
@@ -429,6 +569,9 @@ const uint8_t *flash_enum_write (uint8_t nr, uint8_t v);
 int flash_cnt123_get_value (const uint8_t *p);
 void flash_cnt123_increment (uint8_t which, const uint8_t **addr_p);
 void flash_cnt123_clear (const uint8_t **addr_p);
+int flash_counter_init (uint16_t stamp);
+int flash_counter_increment (uint16_t stamp);
+void flash_counter_clear (void);
 void flash_put_data (uint16_t hw);
 void flash_warning (const char *msg);
 
@@ -85,6 +85,7 @@ flash_write_any (uintptr_t dst_addr, const uint8_t *src, size_t len)
 #ifdef GNU_LINUX_EMULATION
 uint8_t *flash_addr_key_storage_start;
 uint8_t *flash_addr_data_storage_start;
+uint8_t *flash_addr_counter_start;
 #else
 #define ID_OFFSET (2+SERIALNO_STR_LEN*2)
 static void
@@ -431,6 +432,7 @@ main (int argc, const char *argv[])
   flash_addr = flash_init (flash_image_path);
   flash_addr_key_storage_start = (uint8_t *)flash_addr;
   flash_addr_data_storage_start = (uint8_t *)flash_addr + 4096;
+  flash_addr_counter_start = (uint8_t *)flash_addr + 3072;
 #else
   (void)argc;
   (void)argv;
@@ -33,11 +33,17 @@
 #include "status-code.h"
 #include "random.h"
 #include "polarssl/config.h"
-#include "polarssl/aes.h"
+#include "aes128.h"
 #include "sha512.h"
 #include "sha256.h"
 #include "board.h"
 
+#ifdef GNU_LINUX_EMULATION
+#include <stdlib.h>
+#include <unistd.h>
+#include <chopstx.h>
+#endif
+
 /* Forward declaration */
 #define CLEAN_PAGE_FULL 1
 #define CLEAN_SINGLE    0
@@ -47,6 +53,25 @@ static void gpg_reset_digital_signature_counter (void);
 #define PASSWORD_ERRORS_MAX 3	/* >= errors, it will be locked */
 static const uint8_t *pw_err_counter_p[3];
 
+/*
+ * Write-behind journal of data pool.
+ *
+ * Increment of the digital signature counter (by PSO:CDS) and reset
+ * of PIN error counter (by successful VERIFY, etc.) are not written
+ * to flash memory during the command.  Values in RAM are updated at
+ * once, and flash memory is updated by gpg_do_write_behind, which is
+ * called by the OpenPGP thread after the response is sent and before
+ * next command is processed.  So, the response doesn't wait for
+ * flash programming.
+ *
+ * When power is lost before gpg_do_write_behind, the update is lost:
+ * the digital signature counter misses the last signature, and PIN
+ * error counter keeps the value before the reset.  The latter only
+ * results fewer tries.  Increment of PIN error counter is never
+ * deferred, it is written before the response.
+ */
+static const uint8_t *pw_err_clear_pending[3];
+
 static int
 gpg_pw_get_err_counter (uint8_t which)
 {
@@ -76,9 +101,12 @@ gpg_pw_locked (uint8_t which)
 void
 gpg_pw_reset_err_counter (uint8_t which)
 {
-  flash_cnt123_clear (&pw_err_counter_p[which]);
+  /* Clear the record later by gpg_do_write_behind.  */
   if (pw_err_counter_p[which] != NULL)
-    GPG_MEMORY_FAILURE ();
+    {
+      pw_err_clear_pending[which] = pw_err_counter_p[which];
+      pw_err_counter_p[which] = NULL;
+    }
 }
 
 void
@@ -101,9 +129,9 @@ const uint8_t historical_bytes[] __attribute__ ((aligned (1))) = {
   0x00,
   0x31, 0x84,			/* Full DF name, GET DATA, MF */
   0x73,
-  0x80, 0x01, 0x80,		/* Full DF name */
+  0x80, 0x01, 0xc0,		/* Full DF name */
 				/* 1-byte */
-				/* Command chaining, No extended Lc and Le */
+				/* Command chaining, Extended Lc and Le */
 #ifdef LIFE_CYCLE_MANAGEMENT_SUPPORT
   0x05,
 #else
@@ -133,9 +161,13 @@ static const uint8_t extended_capabilities[] __attribute__ ((aligned (1))) = {
   0x00, 0x00,
 #endif
   /* Max. length of command APDU data */
-  0x00, 0xff,
+  (MAX_CMD_APDU_DATA_SIZE >> 8), (MAX_CMD_APDU_DATA_SIZE & 0xff),
   /* Max. length of response APDU data */
-  0x01, 0x00,
+#ifdef CERTDO_SUPPORT
+  0x08, 0x04,	  /* cardholder certificate (2KiB) with tag and length */
+#else
+  (MAX_RES_APDU_DATA_SIZE >> 8), (MAX_RES_APDU_DATA_SIZE & 0xff),
+#endif
 };
 
 #ifdef ACKBTN_SUPPORT
@@ -160,6 +192,14 @@ static const uint8_t algorithm_attr_rsa2k[] __attribute__ ((aligned (1))) = {
   0x00		      /* 0: Acceptable format is: P and Q */
 };
 
+static const uint8_t algorithm_attr_rsa3k[] __attribute__ ((aligned (1))) = {
+  6,
+  OPENPGP_ALGO_RSA,
+  0x0c, 0x00,	      /* Length modulus (in bit): 3072 */
+  0x00, 0x20,	      /* Length exponent (in bit): 32  */
+  0x00		      /* 0: Acceptable format is: P and Q */
+};
+
 static const uint8_t algorithm_attr_rsa4k[] __attribute__ ((aligned (1))) = {
   6,
   OPENPGP_ALGO_RSA,
@@ -205,7 +245,7 @@ static const uint8_t algorithm_attr_cv25519[] __attribute__ ((aligned (1))) = {
  */
 static const uint8_t *pw1_lifetime_p;
 
-static int
+int
 gpg_get_pw1_lifetime (void)
 {
   if (pw1_lifetime_p == NULL)
@@ -225,6 +265,45 @@ static const uint8_t *algo_attr_sig_p;
 static const uint8_t *algo_attr_dec_p;
 static const uint8_t *algo_attr_aut_p;
 
+/*
+ * Key pages released, but not erased yet (see flash_key_release) are
+ * recorded by NR_KEY_PAGE_DIRTY, so that flash_key_storage_init
+ * doesn't need to scan the pages.
+ */
+static const uint8_t *key_page_dirty_p;
+
+int
+gpg_data_key_page_dirty (void)
+{
+  if (key_page_dirty_p == NULL)
+    return 0;
+  else
+    return key_page_dirty_p[1];
+}
+
+/*
+ * Record DIRTY.  The new record is written before the old one is
+ * released, so that power loss in between never loses the record.
+ */
+void
+gpg_data_set_key_page_dirty (uint8_t dirty)
+{
+  const uint8_t *p = NULL;
+
+  if (dirty == gpg_data_key_page_dirty ())
+    return;
+
+  if (dirty)
+    {
+      p = flash_enum_write (NR_KEY_PAGE_DIRTY, dirty);
+      if (p == NULL)
+	return;
+    }
+
+  flash_enum_clear (&key_page_dirty_p);
+  key_page_dirty_p = p;
+}
+
 static const uint8_t **
 get_algo_attr_pointer (enum kind_of_key kk)
 {
@@ -294,6 +373,8 @@ get_algo_attr_data_object (enum kind_of_key kk)
 
   switch (algo_attr_p[1])
     {
+    case ALGO_RSA3K:
+      return algorithm_attr_rsa3k;
     case ALGO_RSA4K:
       return algorithm_attr_rsa4k;
     case ALGO_NISTP256R1:
@@ -319,6 +400,11 @@ gpg_get_algo_attr_key_size (enum kind_of_key kk, enum size_of_key s)
 
   switch (algo_attr_p[1])
     {
+    case ALGO_RSA3K:
+      if (s == GPG_KEY_STORAGE)
+	return 768;
+      else
+	return 384;
     case ALGO_RSA4K:
       if (s == GPG_KEY_STORAGE)
 	return 1024;
@@ -354,7 +440,14 @@ gpg_get_algo_attr_key_size (enum kind_of_key kk, enum size_of_key s)
 }
 
 
+/*
+ * Digital signature counter is the sum of DSC_BASE recorded in data
+ * pool and DSC_UNARY recorded in the counter page.  The value in RAM
+ * may be larger, when there are increments in the write-behind journal.
+ */
 static uint32_t digital_signature_counter;
+static uint32_t dsc_base;
+static uint16_t dsc_unary;
 
 static const uint8_t *
 gpg_write_digital_signature_counter (const uint8_t *p, uint32_t dsc)
@@ -380,39 +473,85 @@ gpg_write_digital_signature_counter (const uint8_t *p, uint32_t dsc)
 static void
 gpg_reset_digital_signature_counter (void)
 {
-  if (digital_signature_counter != 0)
+  /* Clear the counter page first, not to count old increments.  */
+  flash_counter_clear ();
+  if (dsc_base != 0)
     {
       flash_put_data (NR_COUNTER_DS);
       flash_put_data (NR_COUNTER_DS_LSB);
-      digital_signature_counter = 0;
     }
+  dsc_base = 0;
+  dsc_unary = 0;
+  digital_signature_counter = 0;
 }
 
-void
-gpg_increment_digital_signature_counter (void)
+/*
+ * When the counter page is full, record the value to data pool as new
+ * base, and clear the counter page.
+ */
+static void
+gpg_compact_digital_signature_counter (void)
 {
+  uint32_t dsc = (dsc_base + dsc_unary) & 0x00ffffff;
+  int carry = (dsc >> 10) != (dsc_base >> 10);
   uint16_t hw0, hw1;
-  uint32_t dsc = (digital_signature_counter + 1) & 0x00ffffff;
 
-  if ((dsc & 0x03ff) == 0)
-    { /* carry occurs from l10 to h14 */
-      hw0 = NR_COUNTER_DS | ((dsc & 0xfc0000) >> 18) | ((dsc & 0x03fc00) >> 2);
-      hw1 = NR_COUNTER_DS_LSB;	/* zero */
-      flash_put_data (hw0);
-      flash_put_data (hw1);
-    }
-  else
-    {
-      hw1 = NR_COUNTER_DS_LSB | ((dsc & 0x0300) >> 8) | ((dsc & 0x00ff) << 8);
-      flash_put_data (hw1);
-    }
+  hw0 = NR_COUNTER_DS | ((dsc & 0xfc0000) >> 18) | ((dsc & 0x03fc00) >> 2);
+  hw1 = NR_COUNTER_DS_LSB | ((dsc & 0x0300) >> 8) | ((dsc & 0x00ff) << 8);
 
-  digital_signature_counter = dsc;
+  /* Update before flash_put_data, which may call gpg_data_copy.  */
+  dsc_base = dsc;
+  dsc_unary = 0;
+  if (carry)
+    flash_put_data (hw0);
+  flash_put_data (hw1);
+  flash_counter_clear ();
+}
+
+void
+gpg_increment_digital_signature_counter (int n)
+{
+  /* Written to flash memory later by gpg_do_write_behind.  */
+  digital_signature_counter = (digital_signature_counter + n) & 0x00ffffff;
 
   if (gpg_get_pw1_lifetime () == 0)
     ac_reset_pso_cds ();
 }
 
+/*
+ * Write deferred updates of the write-behind journal to flash memory.
+ * Called by the OpenPGP thread after the response of a command.
+ */
+void
+gpg_do_write_behind (void)
+{
+  int i;
+
+#ifdef GNU_LINUX_EMULATION
+  if ((((dsc_base + dsc_unary) & 0x00ffffff) != digital_signature_counter
+       || pw_err_clear_pending[PW_ERR_PW1] || pw_err_clear_pending[PW_ERR_RC]
+       || pw_err_clear_pending[PW_ERR_PW3])
+      && getenv ("GNUK_EXIT_BEFORE_WRITE_BEHIND"))
+    {
+      /*
+       * For the test of crash semantics: exit as if power were lost
+       * here.  Wait a bit, so that the response goes out before.
+       */
+      chopstx_usec_wait (200*1000);
+      _exit (1);
+    }
+#endif
+
+  while (((dsc_base + dsc_unary) & 0x00ffffff) != digital_signature_counter)
+    if (flash_counter_increment (dsc_base) == 0)
+      dsc_unary++;
+    else
+      gpg_compact_digital_signature_counter ();
+
+  for (i = 0; i < 3; i++)
+    flash_cnt123_clear (&pw_err_clear_pending[i]);
+}
+
 
 #define SIZE_FINGER_PRINT 20
 #define SIZE_KEYGEN_TIME 4	/* RFC4880 */
@@ -468,6 +607,7 @@ static const struct do_table_entry *get_do_entry (uint16_t tag);
 #define GPG_DO_UIF_SIG		0x00d6
 #define GPG_DO_UIF_DEC		0x00d7
 #define GPG_DO_UIF_AUT		0x00d8
+#define GPG_DO_PROFILE		0x00f0	/* Not in OpenPGP card protocol */
 #define GPG_DO_KDF		0x00f9
 #define GPG_DO_ALG_INFO		0x00fa
 #define GPG_DO_KEY_IMPORT	0x3fff
@@ -719,8 +859,9 @@ do_alg_info (uint16_t tag, int with_tag)
   if (with_tag)
     {
       copy_tag (tag);
+      *res_p++ = 0x81;
       len_p = res_p;
-      *res_p++ = 0;	 /* Filled later, assuming length is <= 127 */
+      *res_p++ = 0;	 /* Filled later, assuming length is <= 255 */
     }
 
   for (i = 0; i < 3; i++)
@@ -728,6 +869,7 @@ do_alg_info (uint16_t tag, int with_tag)
       uint16_t tag_algo = GPG_DO_ALG_SIG + i;
 
       copy_do_1 (tag_algo, algorithm_attr_rsa2k, 1);
+      copy_do_1 (tag_algo, algorithm_attr_rsa3k, 1);
       copy_do_1 (tag_algo, algorithm_attr_rsa4k, 1);
       copy_do_1 (tag_algo, algorithm_attr_p256r1, 1);
       copy_do_1 (tag_algo, algorithm_attr_p256k1, 1);
@@ -738,7 +880,7 @@ do_alg_info (uint16_t tag, int with_tag)
     };
 
   if (len_p)
-    *len_p = res_p - len_p - 1; /* Actually, it's 127-byte long.  */
+    *len_p = res_p - len_p - 1; /* Actually, it's 166-byte long.  */
 }
 
 static int
@@ -807,6 +949,8 @@ rw_algorithm_attr (uint16_t tag, int with_tag,
 	{
 	  if (memcmp (data, algorithm_attr_rsa2k+1, 6) == 0)
 	    algo = ALGO_RSA2K;
+	  else if (memcmp (data, algorithm_attr_rsa3k+1, 6) == 0)
+	    algo = ALGO_RSA3K;
 	  else if (memcmp (data, algorithm_attr_rsa4k+1, 6) == 0)
 	    algo = ALGO_RSA4K;
 	  else if ((tag != GPG_DO_ALG_DEC
@@ -927,6 +1071,47 @@ rw_uif (uint16_t tag, int with_tag, const uint8_t *data, int len, int is_write)
 #define OPENPGP_KDF_ITERSALTED_S2K 3
 #define OPENPGP_SHA256             8
 
+#ifdef PROFILE_SUPPORT
+static int
+rw_profile (uint16_t tag, int with_tag, const uint8_t *data, int len,
+	    int is_write)
+{
+  (void)data;
+
+  if (is_write)
+    {
+      /* Writing nothing resets the profile.  */
+      if (len != 0)
+	return 0;		/* Failure */
+
+      gpg_prof_reset ();
+      return 1;			/* Success */
+    }
+  else
+    {
+      uint8_t *len_p = NULL;
+      int n;
+
+      if (with_tag)
+	{
+	  copy_tag (tag);
+	  *res_p++ = 0x82;
+	  len_p = res_p;
+	  res_p += 2;		/* Filled later */
+	}
+
+      n = gpg_prof_read (res_p, res_APDU + MAX_RES_APDU_DATA_SIZE - res_p);
+      res_p += n;
+      if (len_p)
+	{
+	  len_p[0] = n >> 8;
+	  len_p[1] = n & 0xff;
+	}
+      return 1;
+    }
+}
+#endif
+
 static int
 rw_kdf (uint16_t tag, int with_tag, const uint8_t *data, int len, int is_write)
 {
@@ -1148,17 +1333,14 @@ proc_resetting_code (const uint8_t *data, int len)
 static void
 encrypt (const uint8_t *key, const uint8_t *iv, uint8_t *data, int len)
 {
-  aes_context aes;
-  uint8_t iv0[INITIAL_VECTOR_SIZE];
-  size_t iv_offset;
+  aes128_context aes;
 
   DEBUG_INFO ("ENC\r\n");
   DEBUG_BINARY (data, len);
 
-  aes_setkey_enc (&aes, key, 128);
-  memcpy (iv0, iv, INITIAL_VECTOR_SIZE);
-  iv_offset = 0;
-  aes_crypt_cfb128 (&aes, AES_ENCRYPT, len, &iv_offset, iv0, data, data);
+  aes128_setkey (&aes, key);
+  aes128_cfb_encrypt (&aes, iv, data, len);
+  memset (&aes, 0, sizeof aes);
 }
 
 /* For three keys: Signing, Decryption, and Authentication */
@@ -1167,35 +1349,71 @@ struct key_data kd[3];
 static void
 decrypt (const uint8_t *key, const uint8_t *iv, uint8_t *data, int len)
 {
-  aes_context aes;
-  uint8_t iv0[INITIAL_VECTOR_SIZE];
-  size_t iv_offset;
+  aes128_context aes;
 
-  aes_setkey_enc (&aes, key, 128); /* This is setkey_enc, because of CFB.  */
-  memcpy (iv0, iv, INITIAL_VECTOR_SIZE);
-  iv_offset = 0;
-  aes_crypt_cfb128 (&aes, AES_DECRYPT, len, &iv_offset, iv0, data, data);
+  aes128_setkey (&aes, key);
+  aes128_cfb_decrypt (&aes, iv, data, len);
+  memset (&aes, 0, sizeof aes);
 
   DEBUG_INFO ("DEC\r\n");
   DEBUG_BINARY (data, len);
 }
 
+/*
+ * Cache of expanded AES key schedules for keystrings.
+ *
+ * A command may handle DEKs of three keys with the same keystring
+ * (VERIFY, CHANGE REFERENCE DATA, RESET RETRY COUNTER, key import).
+ * With this cache, a keystring is expanded only once in a command
+ * (the schedule is for both directions).  It's wiped by
+ * gpg_do_clear_aes_cache at the end of each command.
+ */
+#define AES_CACHE_ENTRIES 2
+static struct aes_cache_entry {
+  uint8_t in_use;
+  uint8_t key[16];
+  aes128_context aes;
+} aes_cache[AES_CACHE_ENTRIES];
+static uint8_t aes_cache_next;
+
+static const aes128_context *
+aes_cache_get (const uint8_t *key_string)
+{
+  struct aes_cache_entry *e;
+  int i;
+
+  for (i = 0; i < AES_CACHE_ENTRIES; i++)
+    {
+      e = &aes_cache[i];
+      if (e->in_use && memcmp (e->key, key_string, 16) == 0)
+	return &e->aes;
+    }
+
+  e = &aes_cache[aes_cache_next];
+  aes_cache_next = (aes_cache_next + 1) % AES_CACHE_ENTRIES;
+  aes128_setkey (&e->aes, key_string);
+  memcpy (e->key, key_string, 16);
+  e->in_use = 1;
+  return &e->aes;
+}
+
+void
+gpg_do_clear_aes_cache (void)
+{
+  memset (aes_cache, 0, sizeof aes_cache);
+  aes_cache_next = 0;
+}
+
 static void
 encrypt_dek (const uint8_t *key_string, uint8_t *dek)
 {
-  aes_context aes;
-
-  aes_setkey_enc (&aes, key_string, 128);
-  aes_crypt_ecb (&aes, AES_ENCRYPT, dek, dek);
+  aes128_encrypt (aes_cache_get (key_string), dek, dek);
 }
 
 static void
 decrypt_dek (const uint8_t *key_string, uint8_t *dek)
 {
-  aes_context aes;
-
-  aes_setkey_dec (&aes, key_string, 128);
-  aes_crypt_ecb (&aes, AES_DECRYPT, dek, dek);
+  aes128_decrypt (aes_cache_get (key_string), dek, dek);
 }
 
 static uint8_t
@@ -1213,10 +1431,25 @@ get_do_ptr_nr_for_kk (enum kind_of_key kk)
   return NR_DO_PRVKEY_SIG;
 }
 
+/*
+ * Private key to be decrypted on its first use, after VERIFY.
+ * The first half of keystring is enough to decrypt DEK.
+ *
+ * The keystring is kept after decryption, so that the key can be
+ * decrypted again after a switch of identity (see ac_save).
+ */
+static struct {
+  uint8_t who;			/* 0 if none */
+  uint8_t loaded;
+  uint8_t key_string[DATA_ENCRYPTION_KEY_SIZE];
+} prvkey_deferred[3];
+
 void
 gpg_do_clear_prvkey (enum kind_of_key kk)
 {
   memset (kd[kk].data, 0, MAX_PRVKEY_LEN);
+  memset (&prvkey_deferred[kk], 0, sizeof prvkey_deferred[kk]);
+  rsa_blinding_reset (kk);
 }
 
 
@@ -1273,6 +1506,7 @@ gpg_do_load_prvkey (enum kind_of_key kk, int who, const uint8_t *keystring)
   DEBUG_INFO ("Loading private key: ");
   DEBUG_BYTE (kk);
 
+  memset (&prvkey_deferred[kk], 0, sizeof prvkey_deferred[kk]);
   if (do_data == NULL)
     return 0;
 
@@ -1295,12 +1529,94 @@ gpg_do_load_prvkey (enum kind_of_key kk, int who, const uint8_t *keystring)
 
   memcpy (kd[kk].data, kdi.data, prvkey_len);
   DEBUG_BINARY (kd[kk].data, prvkey_len);
+  rsa_blinding_reset (kk);
   return 1;
 }
 
+/*
+ * Instead of loading private key now, remember KEYSTRING so that it
+ * can be loaded by gpg_do_load_deferred_prvkey when it's needed.
+ * This is used when the passphrase has been checked by other means.
+ */
+void
+gpg_do_defer_prvkey (enum kind_of_key kk, int who, const uint8_t *keystring)
+{
+  gpg_do_clear_prvkey (kk);
+  if (do_ptr[get_do_ptr_nr_for_kk (kk)] == NULL)
+    return;
+
+  prvkey_deferred[kk].who = who;
+  memcpy (prvkey_deferred[kk].key_string, keystring,
+	  DATA_ENCRYPTION_KEY_SIZE);
+}
+
+/*
+ * Return  1 on success,
+ *         0 if not deferred (loaded already, or none),
+ *        -1 on error,
+ */
+int
+gpg_do_load_deferred_prvkey (enum kind_of_key kk)
+{
+  uint8_t key_string[DATA_ENCRYPTION_KEY_SIZE];
+  int who = prvkey_deferred[kk].who;
+  int r;
+
+  if (who == 0 || prvkey_deferred[kk].loaded)
+    return 0;
+
+  memcpy (key_string, prvkey_deferred[kk].key_string,
+	  DATA_ENCRYPTION_KEY_SIZE);
+  r = gpg_do_load_prvkey (kk, who, key_string);
+  if (r > 0)
+    {
+      prvkey_deferred[kk].who = who;
+      prvkey_deferred[kk].loaded = 1;
+      memcpy (prvkey_deferred[kk].key_string, key_string,
+	      DATA_ENCRYPTION_KEY_SIZE);
+    }
+  memset (key_string, 0, DATA_ENCRYPTION_KEY_SIZE);
+  return r;
+}
+
+/*
+ * Copy the keystring of private key of KK into KEY_STRING, so that
+ * it can be given to gpg_do_defer_prvkey later.
+ * Return who is authorized, or 0 if none.
+ */
+int
+gpg_do_get_prvkey_keystring (enum kind_of_key kk, uint8_t *key_string)
+{
+  memcpy (key_string, prvkey_deferred[kk].key_string,
+	  DATA_ENCRYPTION_KEY_SIZE);
+  return prvkey_deferred[kk].who;
+}
+
 
 static int8_t num_prv_keys;
 
+int
+gpg_do_has_prvkey (enum kind_of_key kk)
+{
+  return do_ptr[get_do_ptr_nr_for_kk (kk)] != NULL;
+}
+
+/*
+ * Return the slot of the key in key page, or -1 if not recorded.
+ */
+int
+gpg_do_get_prvkey_slot (enum kind_of_key kk)
+{
+  const uint8_t *do_data = do_ptr[get_do_ptr_nr_for_kk (kk)];
+  const struct prvkey_data *pd;
+
+  if (do_data == NULL || do_data[0] < sizeof (struct prvkey_data))
+    return -1;
+
+  pd = (const struct prvkey_data *)&do_data[1];
+  return pd->key_slot;
+}
+
 static void
 gpg_do_delete_prvkey (enum kind_of_key kk, int clean_page_full)
 {
@@ -1317,14 +1633,20 @@ gpg_do_delete_prvkey (enum kind_of_key kk, int clean_page_full)
       return;
     }
 
-  do_ptr[nr] = NULL;
-  flash_do_release (do_data);
+  /*
+   * Release the key first, so that a dirty key page is recorded before
+   * the release of the DO.  The record may move the DO by GC.
+   */
   key_addr = (uint8_t *)kd[kk].pubkey - prvkey_len;
-  kd[kk].pubkey = NULL;
   if (clean_page_full)
     flash_key_release_page (kk);
   else
     flash_key_release (key_addr, key_size);
+  kd[kk].pubkey = NULL;
+
+  do_data = do_ptr[nr];
+  do_ptr[nr] = NULL;
+  flash_do_release (do_data);
 
   if (admin_authorized == BY_ADMIN && kk == GPG_KEY_FOR_SIGNING)
     {			/* Recover admin keystring DO.  */
@@ -1373,7 +1695,13 @@ gpg_do_terminate (void)
   pw_err_counter_p[PW_ERR_PW1] = NULL;
   pw_err_counter_p[PW_ERR_RC] = NULL;
   pw_err_counter_p[PW_ERR_PW3] = NULL;
+  pw_err_clear_pending[PW_ERR_PW1] = NULL;
+  pw_err_clear_pending[PW_ERR_RC] = NULL;
+  pw_err_clear_pending[PW_ERR_PW3] = NULL;
+  dsc_base = 0;
+  dsc_unary = 0;
   algo_attr_sig_p = algo_attr_dec_p = algo_attr_aut_p = NULL;
+  key_page_dirty_p = NULL;
 }
 
 static int
@@ -1399,9 +1727,6 @@ gpg_do_write_prvkey (enum kind_of_key kk, const uint8_t *key_data,
   DEBUG_INFO ("Key import\r\n");
   DEBUG_SHORT (prvkey_len);
 
-  /* Delete it first, if any.  */
-  gpg_do_delete_prvkey (kk, CLEAN_SINGLE);
-
   if (attr == ALGO_NISTP256R1 || attr == ALGO_SECP256K1)
     {
       pubkey_len = prvkey_len * 2;
@@ -1429,10 +1754,23 @@ gpg_do_write_prvkey (enum kind_of_key kk, const uint8_t *key_data,
 	return -1;
     }
 
+  /*
+   * KEY_DATA may be KD[KK].DATA (by keygen), which is cleared when
+   * deleting the last key.  Copy it before deletion.
+   */
+  memcpy (kdi.data, key_data, prvkey_len);
+  memset ((uint8_t *)kdi.data + prvkey_len, 0, MAX_PRVKEY_LEN - prvkey_len);
+
+  /* Delete it first, if any.  */
+  gpg_do_delete_prvkey (kk, CLEAN_SINGLE);
+
   DEBUG_INFO ("Getting keystore address...\r\n");
   key_addr = flash_key_alloc (kk);
   if (key_addr == NULL)
-    return -1;
+    {
+      memset (&kdi, 0, sizeof kdi);
+      return -1;
+    }
 
   kd[kk].pubkey = key_addr + prvkey_len;
 
@@ -1441,9 +1779,6 @@ gpg_do_write_prvkey (enum kind_of_key kk, const uint8_t *key_data,
   DEBUG_INFO ("key_addr: ");
   DEBUG_WORD ((uint32_t)key_addr);
 
-  memcpy (kdi.data, key_data, prvkey_len);
-  memset ((uint8_t *)kdi.data + prvkey_len, 0, MAX_PRVKEY_LEN - prvkey_len);
-
   compute_key_data_checksum (&kdi, prvkey_len, CKDC_CALC);
 
   dek = random_bytes_get (); /* 32-byte random bytes */
@@ -1455,6 +1790,21 @@ gpg_do_write_prvkey (enum kind_of_key kk, const uint8_t *key_data,
   gpg_do_get_initial_pw_setting (0, &pw_len, &initial_pw);
   s2k (NULL, 0, initial_pw, pw_len, ks);
 
+  /*
+   * Following updates of DOs are done as a batch: private key DOs
+   * (two for each other key, and the new one) and PW3 keystring.
+   */
+  if (flash_do_batch_begin (5 * FLASH_DO_SIZE (sizeof (struct prvkey_data))
+			    + FLASH_DO_SIZE (KS_VERIFIER_DO_SIZE)) < 0)
+    {
+      kd[kk].pubkey = NULL;
+      num_prv_keys--;
+      random_bytes_free (dek);
+      memset (pd, 0, sizeof (struct prvkey_data));
+      memset (&kdi, 0, sizeof kdi);
+      return -1;
+    }
+
   /* Handle existing keys and keystring DOs.  */
   gpg_do_write_simple (NR_DO_KEYSTRING_PW1, NULL, 0);
   gpg_do_write_simple (NR_DO_KEYSTRING_RC, NULL, 0);
@@ -1472,6 +1822,8 @@ gpg_do_write_prvkey (enum kind_of_key kk, const uint8_t *key_data,
 		       pubkey, pubkey_len);
   if (r < 0)
     {
+      flash_do_batch_abort ();
+      kd[kk].pubkey = NULL;
       random_bytes_free (dek);
       memset (pd, 0, sizeof (struct prvkey_data));
       return r;
@@ -1480,6 +1832,7 @@ gpg_do_write_prvkey (enum kind_of_key kk, const uint8_t *key_data,
   memcpy (pd->iv, iv, INITIAL_VECTOR_SIZE);
   memcpy (pd->checksum_encrypted, CHECKSUM_ADDR (kdi, prvkey_len),
 	  DATA_ENCRYPTION_KEY_SIZE);
+  pd->key_slot = flash_key_slot (kk, key_addr);
 
   encrypt_dek (ks, pd->dek_encrypted_1);
 
@@ -1496,25 +1849,31 @@ gpg_do_write_prvkey (enum kind_of_key kk, const uint8_t *key_data,
   random_bytes_free (dek);
   memset (pd, 0, sizeof (struct prvkey_data));
   if (p == NULL)
-    return -1;
+    {
+      flash_do_batch_abort ();
+      kd[kk].pubkey = NULL;
+      return -1;
+    }
 
   if (keystring_admin && kk == GPG_KEY_FOR_SIGNING)
     {
       const uint8_t *ks_admin = gpg_do_read_simple (NR_DO_KEYSTRING_PW3);
-      uint8_t ks_info[KS_META_SIZE];
 
       if (ks_admin != NULL && (ks_admin[0] & PW_LEN_KEYSTRING_BIT))
-	{
-	  ks_info[0] = ks_admin[0] & PW_LEN_MASK;
-	  memcpy (KS_GET_SALT (ks_info), KS_GET_SALT (ks_admin), SALT_SIZE);
-	  gpg_do_write_simple (NR_DO_KEYSTRING_PW3, ks_info, KS_META_SIZE);
-	}
+	gpg_do_write_keystring (NR_DO_KEYSTRING_PW3, ks_admin,
+				KS_GET_KEYSTRING (ks_admin));
       else
 	{
 	  DEBUG_INFO ("No admin keystring!\r\n");
 	}
     }
 
+  if (flash_do_batch_commit () < 0)
+    {
+      kd[kk].pubkey = NULL;
+      return -1;
+    }
+
   return 0;
 }
 
@@ -1535,7 +1894,20 @@ gpg_do_chks_prvkey (enum kind_of_key kk,
   if (do_data == NULL)
     return 0;			/* No private key */
 
-  memcpy (pd, &do_data[1], sizeof (struct prvkey_data));
+  if (do_data[0] < sizeof (struct prvkey_data))
+    {
+      /* DO by older version: record the slot now.  */
+      int prvkey_len = gpg_get_algo_attr_key_size (kk, GPG_KEY_PRIVATE);
+
+      memcpy (pd, &do_data[1], do_data[0]);
+      if (kd[kk].pubkey)
+	pd->key_slot = flash_key_slot (kk, kd[kk].pubkey - prvkey_len);
+      else
+	pd->key_slot = 0xff;
+      update_needed = 1;
+    }
+  else
+    memcpy (pd, &do_data[1], sizeof (struct prvkey_data));
 
   dek_p = ((uint8_t *)pd) + INITIAL_VECTOR_SIZE
     + DATA_ENCRYPTION_KEY_SIZE * who_old;
@@ -1672,13 +2044,14 @@ proc_key_import (const uint8_t *data, int len)
 
   if ((len <= 12 && (attr == ALGO_NISTP256R1 || attr == ALGO_SECP256K1
 		     || attr == ALGO_ED25519 || attr == ALGO_CURVE25519))
-      || (len <= 22 && attr == ALGO_RSA2K) || (len <= 24 && attr == ALGO_RSA4K))
+      || (len <= 22 && (attr == ALGO_RSA2K || attr == ALGO_RSA3K))
+      || (len <= 24 && attr == ALGO_RSA4K))
     {					    /* Deletion of the key */
       gpg_do_delete_prvkey (kk, CLEAN_SINGLE);
       return 1;
     }
 
-  if (attr == ALGO_RSA2K)
+  if (attr == ALGO_RSA2K || attr == ALGO_RSA3K)
     {
       /* It should starts with 00 01 00 01 (E), skiping E (4-byte) */
       r = modulus_calc (&data[26], len - 26, pubkey);
@@ -1822,6 +2195,11 @@ gpg_do_table[] = {
 #endif
   { GPG_DO_KDF, DO_PROC_READWRITE, AC_ALWAYS, AC_ADMIN_AUTHORIZED,
     rw_kdf },
+#ifdef PROFILE_SUPPORT
+  /* Timing of private key operations is only for admin.  */
+  { GPG_DO_PROFILE, DO_PROC_READWRITE, AC_ADMIN_AUTHORIZED,
+    AC_ADMIN_AUTHORIZED, rw_profile },
+#endif
   /* Fixed data */
   { GPG_DO_HIST_BYTES, DO_FIXED, AC_ALWAYS, AC_NEVER, historical_bytes },
   { GPG_DO_EXTCAP, DO_FIXED, AC_ALWAYS, AC_NEVER, extended_capabilities },
@@ -1848,23 +2226,189 @@ gpg_do_table[] = {
 #define NUM_DO_ENTRIES (int)(sizeof (gpg_do_table) \
 			     / sizeof (struct do_table_entry))
 
+/*
+ * Index of the table of records in data pool, for scanning and for
+ * checkpoint.  Index from 0 to NR_DO__LAST__ - 1 is for DO.
+ */
+enum {
+  REC_COUNTER_DS = NR_DO__LAST__,
+  REC_COUNTER_DS_LSB,
+  REC_BOOL_PW1_LIFETIME,
+  REC_KEY_ALGO_ATTR_SIG,
+  REC_KEY_ALGO_ATTR_DEC,
+  REC_KEY_ALGO_ATTR_AUT,
+  REC_DO_UIF_SIG,
+  REC_DO_UIF_DEC,
+  REC_DO_UIF_AUT,
+  REC_KEY_PAGE_DIRTY,
+  REC_COUNTER_123,		/* PW1, RC, and PW3 */
+  REC__LAST__ = REC_COUNTER_123 + 3
+};
+
+struct data_scan {
+  const uint8_t *rec[REC__LAST__];
+  int dsc_l10_older;
+  int in_torn_batch;
+};
+
+/*
+ * Parse a record at P, updating S, and return the next record.
+ * Records in a batch which is not committed are parsed, but ignored.
+ */
+static const uint8_t *
+gpg_data_scan_record (struct data_scan *s, const uint8_t *p)
+{
+  uint8_t nr = p[0];
+  uint8_t second_byte = p[1];
+  int index = -1;
+  const uint8_t *next = p + 2;
+
+  if (nr == 0x00 && second_byte == 0x00)
+    return next;		/* Skip released word */
+
+  if (nr < 0x80)
+    {
+      /* It's Data Object */
+      if (nr < NR_DO__LAST__)
+	index = nr;
+
+      next += second_byte;	/* second_byte has length */
+      if (((uintptr_t)next & 1))
+	next++;
+    }
+  else if (nr >= 0x80 && nr <= 0xbf)
+    /* Encoded data of Digital Signature Counter: upper 14-bit */
+    index = REC_COUNTER_DS;
+  else if (nr >= 0xc0 && nr <= 0xc3)
+    /* Encoded data of Digital Signature Counter: lower 10-bit */
+    index = REC_COUNTER_DS_LSB;
+  else
+    switch (nr)
+      {
+      case NR_BOOL_PW1_LIFETIME:
+	index = REC_BOOL_PW1_LIFETIME;
+	break;
+      case NR_KEY_ALGO_ATTR_SIG:
+      case NR_KEY_ALGO_ATTR_DEC:
+      case NR_KEY_ALGO_ATTR_AUT:
+	index = REC_KEY_ALGO_ATTR_SIG + nr - NR_KEY_ALGO_ATTR_SIG;
+	break;
+      case NR_DO_UIF_SIG:
+      case NR_DO_UIF_DEC:
+      case NR_DO_UIF_AUT:
+	index = REC_DO_UIF_SIG + nr - NR_DO_UIF_SIG;
+	break;
+      case NR_KEY_PAGE_DIRTY:
+	index = REC_KEY_PAGE_DIRTY;
+	break;
+      case NR_CHECKPOINT:
+	/* Only valid at the beginning of a page.  Skip.  */
+	next += second_byte * 2;
+	break;
+      case NR_BATCH:
+	/* Start of batch not committed, or its end.  */
+	s->in_torn_batch = (second_byte == 0xff);
+	break;
+      case NR_COUNTER_123:
+	if (second_byte <= PW_ERR_PW3)
+	  index = REC_COUNTER_123 + second_byte;
+	next += 2;
+	break;
+      default:
+	/* Something going wrong.  ignore this word. */
+	break;
+      }
+
+  if (index >= 0 && !s->in_torn_batch)
+    {
+      s->rec[index] = p;
+      if (index == REC_COUNTER_DS)
+	s->dsc_l10_older = 1;
+      else if (index == REC_COUNTER_DS_LSB)
+	s->dsc_l10_older = 0;
+    }
+
+  return next;
+}
+
+/*
+ * When P is a valid checkpoint record, apply it to S and return 1.
+ * A checkpoint may be incomplete by power loss, check all entries.
+ */
+static int
+gpg_data_scan_checkpoint (struct data_scan *s, const uint8_t *p)
+{
+  const uint16_t *entry = (const uint16_t *)(p + 2);
+  int num = p[1];
+  int i;
+
+  if (p[0] != NR_CHECKPOINT || num > REC__LAST__)
+    return 0;
+
+  for (i = 0; i < num; i++)
+    if (flash_do_at (entry[i]) == NULL)
+      return 0;
+
+  if (s)
+    for (i = 0; i < num; i++)
+      gpg_data_scan_record (s, flash_do_at (entry[i]));
+
+  return 1;
+}
+
+/*
+ * Scan the first N pages of the log into S, and return the end of
+ * the records.  It starts from the last page which has checkpoint,
+ * so, usually, only a single page is scanned.
+ */
+static const uint8_t *
+gpg_data_scan_log (struct data_scan *s, int n)
+{
+  const uint8_t *p = NULL, *do_end;
+  int i;
+
+  memset (s, 0, sizeof (struct data_scan));
+
+  for (i = n - 1; i > 0; i--)
+    if (gpg_data_scan_checkpoint (NULL, flash_do_page (i, &do_end)))
+      break;
+
+  for (; i < n; i++)
+    {
+      p = flash_do_page (i, &do_end);
+      if (gpg_data_scan_checkpoint (s, p))
+	p += 2 + p[1] * 2;
+
+      while (p < do_end && *p != NR_EMPTY)
+	p = gpg_data_scan_record (s, p);
+    }
+
+  return p;
+}
+
 /*
  * Reading data from Flash ROM, initialize DO_PTR, PW_ERR_COUNTERS, etc.
  */
 void
 gpg_data_scan (const uint8_t *do_start, const uint8_t *do_end)
 {
+  struct data_scan s;
   const uint8_t *p;
   int i;
-  const uint8_t *dsc_h14_p, *dsc_l10_p;
   int dsc_h14, dsc_l10;
 
-  dsc_h14_p = dsc_l10_p = NULL;
+  (void)do_end;
   pw1_lifetime_p = NULL;
   pw_err_counter_p[PW_ERR_PW1] = NULL;
   pw_err_counter_p[PW_ERR_RC] = NULL;
   pw_err_counter_p[PW_ERR_PW3] = NULL;
+  pw_err_clear_pending[PW_ERR_PW1] = NULL;
+  pw_err_clear_pending[PW_ERR_RC] = NULL;
+  pw_err_clear_pending[PW_ERR_PW3] = NULL;
+  dsc_base = 0;
+  dsc_unary = 0;
   algo_attr_sig_p = algo_attr_dec_p = algo_attr_aut_p = NULL;
+  key_page_dirty_p = NULL;
   digital_signature_counter = 0;
   uif_flags = 0;
 
@@ -1877,81 +2421,30 @@ gpg_data_scan (const uint8_t *do_start, const uint8_t *do_end)
     return;
 
   /* Traverse DO, counters, etc. in DATA pool */
-  p = do_start;
-  while (p < do_end && *p != NR_EMPTY)
-    {
-      uint8_t nr = *p++;
-      uint8_t second_byte = *p;
+  p = gpg_data_scan_log (&s, flash_do_pages ());
+  flash_set_data_pool_last (p);
+  if (s.in_torn_batch)
+    /* Mark the end of the batch, so that new records will be valid.  */
+    flash_put_data (NR_BATCH);
 
-      if (nr == 0x00 && second_byte == 0x00)
-	p++;			/* Skip released word */
-      else
-	{
-	  if (nr < 0x80)
-	    {
-	      /* It's Data Object */
-	      if (nr < NR_DO__LAST__)
-		do_ptr[nr] = p;
+  for (i = 0; i < NR_DO__LAST__; i++)
+    if (s.rec[i])
+      do_ptr[i] = s.rec[i] + 1;
 
-	      p += second_byte + 1; /* second_byte has length */
+  pw1_lifetime_p = s.rec[REC_BOOL_PW1_LIFETIME];
+  algo_attr_sig_p = s.rec[REC_KEY_ALGO_ATTR_SIG];
+  algo_attr_dec_p = s.rec[REC_KEY_ALGO_ATTR_DEC];
+  algo_attr_aut_p = s.rec[REC_KEY_ALGO_ATTR_AUT];
+  key_page_dirty_p = s.rec[REC_KEY_PAGE_DIRTY];
 
-	      if (((uintptr_t)p & 1))
-		p++;
-	    }
-	  else if (nr >= 0x80 && nr <= 0xbf)
-	    /* Encoded data of Digital Signature Counter: upper 14-bit */
-	    {
-	      dsc_h14_p = p - 1;
-	      p++;
-	    }
-	  else if (nr >= 0xc0 && nr <= 0xc3)
-	    /* Encoded data of Digital Signature Counter: lower 10-bit */
-	    {
-	      dsc_l10_p = p - 1;
-	      p++;
-	    }
-	  else
-	    switch (nr)
-	      {
-	      case NR_BOOL_PW1_LIFETIME:
-		pw1_lifetime_p = p - 1;
-		p++;
-		break;
-	      case NR_KEY_ALGO_ATTR_SIG:
-		algo_attr_sig_p = p - 1;
-		p++;
-		break;
-	      case NR_KEY_ALGO_ATTR_DEC:
-		algo_attr_dec_p = p - 1;
-		p++;
-		break;
-	      case NR_KEY_ALGO_ATTR_AUT:
-		algo_attr_aut_p = p - 1;
-		p++;
-		break;
-	      case NR_DO_UIF_SIG:
-	      case NR_DO_UIF_DEC:
-	      case NR_DO_UIF_AUT:
-		uif_flags &= ~(3 << ((nr - NR_DO_UIF_SIG) * 2));
-		uif_flags |= (second_byte & 3) << ((nr - NR_DO_UIF_SIG) * 2);
-		p++;
-		break;
-	      case NR_COUNTER_123:
-		p++;
-		if (second_byte <= PW_ERR_PW3)
-		  pw_err_counter_p[second_byte] = p;
-		p += 2;
-		break;
-	      default:
-		/* Something going wrong.  ignore this word. */
-		p++;
-		break;
-	      }
-	}
+  for (i = 0; i < 3; i++)
+    {
+      if (s.rec[REC_COUNTER_123 + i])
+	pw_err_counter_p[i] = s.rec[REC_COUNTER_123 + i] + 2;
+      if (s.rec[REC_DO_UIF_SIG + i])
+	uif_flags |= (s.rec[REC_DO_UIF_SIG + i][1] & 3) << (i * 2);
     }
 
-  flash_set_data_pool_last (p);
-
   num_prv_keys = 0;
   if (do_ptr[NR_DO_PRVKEY_SIG] != NULL)
     num_prv_keys++;
@@ -1965,24 +2458,177 @@ gpg_data_scan (const uint8_t *do_start, const uint8_t *do_end)
     if (do_ptr[i] != NULL)
       data_objects_number_of_bytes += *do_ptr[i];
 
-  if (dsc_l10_p == NULL)
+  p = s.rec[REC_COUNTER_DS_LSB];
+  if (p == NULL)
     dsc_l10 = 0;
   else
-    dsc_l10 = ((*dsc_l10_p - 0xc0) << 8) | *(dsc_l10_p + 1);
+    dsc_l10 = ((*p - 0xc0) << 8) | *(p + 1);
 
-  if (dsc_h14_p == NULL)
+  p = s.rec[REC_COUNTER_DS];
+  if (p == NULL)
     dsc_h14 = 0;
   else
     {
-      dsc_h14 = ((*dsc_h14_p - 0x80) << 8) | *(dsc_h14_p + 1);
-      if (dsc_l10_p == NULL)
+      dsc_h14 = ((*p - 0x80) << 8) | *(p + 1);
+      if (s.rec[REC_COUNTER_DS_LSB] == NULL)
 	DEBUG_INFO ("something wrong in DSC\r\n"); /* weird??? */
-      else if (dsc_l10_p < dsc_h14_p)
+      else if (s.dsc_l10_older)
 	/* Possibly, power off during writing dsc_l10 */
 	dsc_l10 = 0;
     }
 
-  digital_signature_counter = (dsc_h14 << 10) | dsc_l10;
+  dsc_base = (dsc_h14 << 10) | dsc_l10;
+  dsc_unary = flash_counter_init (dsc_base);
+  digital_signature_counter = (dsc_base + dsc_unary) & 0x00ffffff;
+}
+
+/*
+ * Rebuild DO_PTR, etc. from flash memory, after a batch is aborted.
+ * Deferred updates of the write-behind journal are kept.
+ */
+void
+gpg_data_rescan (void)
+{
+  const uint8_t *pending[3];
+  uint32_t dsc = digital_signature_counter;
+  const uint8_t *do_start, *do_end;
+  int i;
+
+  memcpy (pending, pw_err_clear_pending, sizeof pending);
+  do_start = flash_do_page (0, &do_end);
+  gpg_data_scan (do_start, do_end);
+
+  for (i = 0; i < 3; i++)
+    if (pending[i])
+      {
+	pw_err_clear_pending[i] = pending[i];
+	pw_err_counter_p[i] = NULL;
+      }
+  digital_signature_counter = dsc;
+}
+
+/*
+ * Save the state of data objects of current identity to CTX, so that
+ * switching back to the identity doesn't need to scan data pool again.
+ */
+void
+gpg_do_save (struct do_context *ctx)
+{
+  int i;
+
+  memcpy (ctx->do_ptr, do_ptr, sizeof do_ptr);
+  ctx->pw1_lifetime_p = pw1_lifetime_p;
+  memcpy (ctx->pw_err_counter_p, pw_err_counter_p, sizeof pw_err_counter_p);
+  memcpy (ctx->pw_err_clear_pending, pw_err_clear_pending,
+	  sizeof pw_err_clear_pending);
+  ctx->algo_attr_p[0] = algo_attr_sig_p;
+  ctx->algo_attr_p[1] = algo_attr_dec_p;
+  ctx->algo_attr_p[2] = algo_attr_aut_p;
+  for (i = 0; i < NUM_ALL_PRV_KEYS; i++)
+    ctx->pubkey[i] = kd[i].pubkey;
+  ctx->key_page_dirty_p = key_page_dirty_p;
+  ctx->digital_signature_counter = digital_signature_counter;
+  ctx->dsc_base = dsc_base;
+  ctx->dsc_unary = dsc_unary;
+  ctx->data_objects_number_of_bytes = data_objects_number_of_bytes;
+  ctx->uif_flags = uif_flags;
+  ctx->num_prv_keys = num_prv_keys;
+}
+
+/*
+ * Restore the state of data objects from CTX, saved by gpg_do_save
+ * for the identity selected now.
+ */
+void
+gpg_do_restore (const struct do_context *ctx)
+{
+  int i;
+
+  memcpy (do_ptr, ctx->do_ptr, sizeof do_ptr);
+  pw1_lifetime_p = ctx->pw1_lifetime_p;
+  memcpy (pw_err_counter_p, ctx->pw_err_counter_p, sizeof pw_err_counter_p);
+  memcpy (pw_err_clear_pending, ctx->pw_err_clear_pending,
+	  sizeof pw_err_clear_pending);
+  algo_attr_sig_p = ctx->algo_attr_p[0];
+  algo_attr_dec_p = ctx->algo_attr_p[1];
+  algo_attr_aut_p = ctx->algo_attr_p[2];
+  for (i = 0; i < NUM_ALL_PRV_KEYS; i++)
+    kd[i].pubkey = ctx->pubkey[i];
+  key_page_dirty_p = ctx->key_page_dirty_p;
+  digital_signature_counter = ctx->digital_signature_counter;
+  dsc_base = ctx->dsc_base;
+  dsc_unary = ctx->dsc_unary;
+  data_objects_number_of_bytes = ctx->data_objects_number_of_bytes;
+  uif_flags = ctx->uif_flags;
+  num_prv_keys = ctx->num_prv_keys;
+}
+
+/*
+ * Write a checkpoint record at the beginning of new page of the log,
+ * so that gpg_data_scan doesn't need to scan the previous pages.
+ * The checkpoint has offsets of live records in the previous pages,
+ * in the order of the log.  Called by flash_data_pool_extend.
+ */
+void
+gpg_data_checkpoint (void)
+{
+  struct data_scan s;
+  uint16_t entry[REC__LAST__];
+  int num = 0;
+  int i, j;
+
+  gpg_data_scan_log (&s, flash_do_pages () - 1);
+
+  for (i = 0; i < REC__LAST__; i++)
+    if (s.rec[i])
+      {
+	uint16_t off = flash_do_offset (s.rec[i]);
+
+	for (j = num; j > 0 && entry[j - 1] > off; j--)
+	  entry[j] = entry[j - 1];
+	entry[j] = off;
+	num++;
+      }
+
+  flash_checkpoint_write (entry, num);
+}
+
+/*
+ * Return the size of data pool (without header) which gpg_data_copy
+ * will use.
+ */
+int
+gpg_data_size (void)
+{
+  int size;
+  int i;
+
+  size = (dsc_base >> 10) == 0 ? 2 : 4;
+
+  if (pw1_lifetime_p != NULL)
+    size += 2;
+  if (algo_attr_sig_p != NULL)
+    size += 2;
+  if (algo_attr_dec_p != NULL)
+    size += 2;
+  if (algo_attr_aut_p != NULL)
+    size += 2;
+  if (key_page_dirty_p != NULL)
+    size += 2;
+
+  for (i = 0; i < 3; i++)
+    if (flash_cnt123_get_value (pw_err_counter_p[i]) != 0)
+      size += 4;
+
+  for (i = 0; i < 3; i++)
+    if (((uif_flags >> (i * 2)) & 3))
+      size += 2;
+
+  for (i = 0; i < NR_DO__LAST__; i++)
+    if (do_ptr[i] != NULL)
+      size += 2 + ((do_ptr[i][0] + 1) & ~1);
+
+  return size;
 }
 
 /*
@@ -1997,7 +2643,11 @@ gpg_data_copy (const uint8_t *p_start)
   int i;
   int v;
 
-  p = gpg_write_digital_signature_counter (p_start, digital_signature_counter);
+  /* Pending clears of PIN error counter are done by this copy.  */
+  for (i = 0; i < 3; i++)
+    pw_err_clear_pending[i] = NULL;
+
+  p = gpg_write_digital_signature_counter (p_start, dsc_base);
 
   if (pw1_lifetime_p != NULL)
     {
@@ -2027,6 +2677,13 @@ gpg_data_copy (const uint8_t *p_start)
       p += 2;
     }
 
+  if (key_page_dirty_p != NULL)
+    {
+      flash_enum_write_internal (p, NR_KEY_PAGE_DIRTY, key_page_dirty_p[1]);
+      key_page_dirty_p = p;
+      p += 2;
+    }
+
   for (i = 0; i < 3; i++)
     if ((v = flash_cnt123_get_value (pw_err_counter_p[i])) != 0)
       {
@@ -2361,13 +3018,14 @@ gpg_do_public_key (uint8_t kk_byte)
     }
   else
     {				/* RSA */
-      /* LEN = 9+256or512 */
-      *res_p++ = 0x82; *res_p++ = pubkey_len > 256? 0x02: 0x01; *res_p++ = 0x09;
+      /* LEN = 9+256, 9+384 or 9+512 */
+      *res_p++ = 0x82;
+      *res_p++ = (9 + pubkey_len) >> 8; *res_p++ = (9 + pubkey_len) & 0xff;
 
       {
-	/*TAG*/          /* LEN = 256or512 */
+	/*TAG*/          /* LEN = 256, 384 or 512 */
 	*res_p++ = 0x81;
-	*res_p++ = 0x82; *res_p++ = pubkey_len > 256? 0x02: 0x01;*res_p++ = 0x00;
+	*res_p++ = 0x82; *res_p++ = pubkey_len >> 8; *res_p++ = pubkey_len & 0xff;
 	/* PUBKEY_LEN-byte binary (big endian) */
 	memcpy (res_p, pubkey, pubkey_len);
 	res_p += pubkey_len;
@@ -2420,6 +3078,42 @@ gpg_do_write_simple (uint8_t nr, const uint8_t *data, int size)
     *do_data_p = NULL;
 }
 
+/* Return the length of simple DO, 0 if none.  */
+int
+gpg_do_simple_len (uint8_t nr)
+{
+  const uint8_t *do_data = do_ptr[nr];
+
+  if (do_data == NULL)
+    return 0;
+
+  return do_data[0];
+}
+
+/*
+ * Write keystring DO of NR with the verifier of KEYSTRING, instead of
+ * KEYSTRING itself.  KS_META is passphrase length and salt.
+ */
+void
+gpg_do_write_keystring (uint8_t nr, const uint8_t *ks_meta,
+			const uint8_t *keystring)
+{
+  uint8_t ks_info[KS_VERIFIER_DO_SIZE];
+
+  ks_info[0] = ks_meta[0] & PW_LEN_MASK;
+  memcpy (KS_GET_SALT (ks_info), KS_GET_SALT (ks_meta), SALT_SIZE);
+#ifdef GNU_LINUX_EMULATION
+  if (getenv ("GNUK_KEYSTRING_WITHOUT_VERIFIER"))
+    {
+      /* For the test of upgrade: write it as older versions did.  */
+      gpg_do_write_simple (nr, ks_info, KS_META_SIZE);
+      return;
+    }
+#endif
+  ks_verifier (keystring, KS_GET_VERIFIER (ks_info));
+  gpg_do_write_simple (nr, ks_info, KS_VERIFIER_DO_SIZE);
+}
+
 void
 gpg_do_keygen (uint8_t *buf)
 {
@@ -2428,9 +3122,10 @@ gpg_do_keygen (uint8_t *buf)
   int attr = gpg_get_algo_attr (kk);;
   int prvkey_len = gpg_get_algo_attr_key_size (kk, GPG_KEY_PRIVATE);
   const uint8_t *prv;
+  const uint8_t *pub;
   const uint8_t *rnd;
   int r = 0;
-#define p_q (&buf[3])
+#define modulus (&buf[3])
 #define d (&buf[3])
 #define d1 (&buf[3+64])
 #define pubkey (&buf[3+256])
@@ -2438,15 +3133,22 @@ gpg_do_keygen (uint8_t *buf)
   DEBUG_INFO ("Keygen\r\n");
   DEBUG_BYTE (kk_byte);
 
-  if (attr == ALGO_RSA2K || attr == ALGO_RSA4K)
+  if (attr == ALGO_RSA2K || attr == ALGO_RSA3K || attr == ALGO_RSA4K)
     {
-      if (rsa_genkey (prvkey_len, pubkey, p_q) < 0)
+      /*
+       * For RSA-3072 and RSA-4096, P, Q and N don't fit together into
+       * the command buffer.  P and Q are put into KD[KK].DATA, which is
+       * for the key to be replaced, and N into the buffer.
+       */
+      if (rsa_genkey (prvkey_len, modulus, kd[kk].data) < 0)
 	{
+	  gpg_do_clear_prvkey (kk);
 	  GPG_MEMORY_FAILURE ();
 	  return;
 	}
 
-      prv = p_q;
+      prv = kd[kk].data;
+      pub = modulus;
     }
   else if (attr == ALGO_NISTP256R1 || attr == ALGO_SECP256K1)
     {
@@ -2478,6 +3180,7 @@ gpg_do_keygen (uint8_t *buf)
       random_bytes_free (rnd);
 
       prv = d;
+      pub = pubkey;
       if (attr == ALGO_SECP256K1)
 	r = ecc_compute_public_p256k1 (prv, pubkey);
       else if (attr == ALGO_NISTP256R1)
@@ -2492,6 +3195,7 @@ gpg_do_keygen (uint8_t *buf)
       d[31] &= 127;
       d[31] |= 64;
       prv = d;
+      pub = pubkey;
       eddsa_compute_public_25519 (d, pubkey);
     }
   else if (attr == ALGO_CURVE25519)
@@ -2503,6 +3207,7 @@ gpg_do_keygen (uint8_t *buf)
       d[31] &= 127;
       d[31] |= 64;
       prv = d;
+      pub = pubkey;
       ecdh_compute_public_25519 (prv, pubkey);
     }
   else
@@ -2520,11 +3225,14 @@ gpg_do_keygen (uint8_t *buf)
       else
 	keystring_admin = NULL;
 
-      r = gpg_do_write_prvkey (kk, prv, prvkey_len, keystring_admin, pubkey);
+      r = gpg_do_write_prvkey (kk, prv, prvkey_len, keystring_admin, pub);
     }
 
   /* Clear private key data in the buffer.  */
-  memset (buf, 0, 256);
+  if (prv == kd[kk].data)
+    gpg_do_clear_prvkey (kk);
+  else
+    memset (buf, 0, 256);
 
   if (r < 0)
     {
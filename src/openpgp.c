@@ -49,6 +49,7 @@ static struct eventflag *openpgp_comm;
 #define INS_VERIFY        			0x20
 #define INS_CHANGE_REFERENCE_DATA		0x24
 #define INS_PSO		  			0x2a
+#define INS_PSO_BATCH				0x2b
 #define INS_RESET_RETRY_COUNTER			0x2c
 #define INS_ACTIVATE_FILE			0x44
 #define INS_PGP_GENERATE_ASYMMETRIC_KEY_PAIR	0x47
@@ -128,6 +129,139 @@ gpg_fini (void)
   ac_fini ();
 }
 
+#define IDENTITY_NONE 0xff
+static volatile uint8_t identity_request = IDENTITY_NONE;
+
+/*
+ * Request to switch identity from the CCID thread (by HID report).  It
+ * is done by the OpenPGP thread between commands, on EV_SET_IDENTITY.
+ */
+void
+gpg_request_identity (uint8_t id)
+{
+  identity_request = id;
+}
+
+/*
+ * Each identity is available as a CCID slot (see flash_slot_identity).
+ * The OpenPGP thread switches to the identity of the slot of a command,
+ * keeping the authentication state, file selection and the state of
+ * storage and data objects of the other identities here.  An identity
+ * is initialized by scanning its storage only on the first switch to
+ * it; its state is kept since then (until gpg_slot_fini).
+ *
+ * Private keys decrypted are not kept (it would need 1.5KiB of RAM for
+ * each identity), but cleared by ac_save.  They are decrypted again by
+ * the keystrings in AC_CONTEXT, when used.
+ */
+static struct ac_context ac_context[3];
+static struct flash_context flash_context[3];
+static struct do_context do_context[3];
+static uint8_t file_selection_saved[3];
+static uint8_t context_saved;	/* bit for each identity */
+static volatile uint8_t slot_reset_request[3];
+
+static void
+gpg_select_slot (uint8_t slot)
+{
+  uint8_t id = flash_slot_identity (slot);
+
+  if (id == _selected_identity)
+    return;
+
+  ac_save (&ac_context[_selected_identity]);
+  file_selection_saved[_selected_identity] = file_selection;
+  flash_save (&flash_context[_selected_identity]);
+  gpg_do_save (&do_context[_selected_identity]);
+  context_saved |= (1 << _selected_identity);
+
+  flash_select_identity (id);
+  if ((context_saved & (1 << id)))
+    {
+      flash_restore (&flash_context[id]);
+      gpg_do_restore (&do_context[id]);
+      file_selection = file_selection_saved[id];
+    }
+  else
+    {
+      gpg_init ();
+      if (file_selection != FILE_CARD_TERMINATED)
+	file_selection = file_selection_saved[id];
+    }
+  ac_restore (&ac_context[id]);
+}
+
+static void
+gpg_slot_fini (void)
+{
+  memset (ac_context, 0, sizeof ac_context);
+  memset (file_selection_saved, 0, sizeof file_selection_saved);
+  context_saved = 0;
+}
+
+/*
+ * Request from the CCID thread, when a slot is powered off, but others
+ * are still in use.
+ */
+void
+gpg_request_slot_reset (uint8_t slot)
+{
+  slot_reset_request[slot] = 1;
+}
+
+/*
+ * Reset the state of identities of slots which have been powered off.
+ * It's called before a command, so that the command never sees the
+ * state before power off.
+ */
+static void
+gpg_slot_reset (void)
+{
+  uint8_t slot;
+
+  for (slot = 0; slot < 3; slot++)
+    if (slot_reset_request[slot])
+      {
+	uint8_t id = flash_slot_identity (slot);
+
+	slot_reset_request[slot] = 0;
+	if (id == _selected_identity)
+	  {
+	    ac_fini ();
+	    if (file_selection != FILE_CARD_TERMINATED)
+	      file_selection = FILE_NONE;
+	  }
+	else
+	  {
+	    memset (&ac_context[id], 0, sizeof (struct ac_context));
+	    if (file_selection_saved[id] != FILE_CARD_TERMINATED)
+	      file_selection_saved[id] = FILE_NONE;
+	  }
+      }
+}
+
+/*
+ * Switch identity in place, instead of system reset: initialize the
+ * card again by the data of the new identity, with no authentication,
+ * and let the host know that the card has been changed.  As the
+ * mapping of slots to identities changes, the state of all identities
+ * is cleared.
+ */
+static void
+gpg_switch_identity (void)
+{
+  uint8_t id = identity_request;
+
+  identity_request = IDENTITY_NONE;
+  if (id == IDENTITY_NONE || flash_set_identity (id) < 0)
+    return;
+
+  gpg_fini ();
+  gpg_slot_fini ();
+  gpg_init ();
+  ccid_card_change_signal (CARD_CHANGE_SWAP);
+}
+
 #if defined(PINPAD_SUPPORT)
 /*
  * Let user input PIN string.
@@ -438,20 +572,35 @@ cmd_change_password (struct eventflag *ccid_comm)
   s2k (new_salt, newsalt_len, newpw, newpw_len, new_ks);
   new_ks0[0] = newpw_len;
 
+  /*
+   * Updates of private key DOs (three, and three more for removal of
+   * keystrings for BY_ADMIN) and a keystring DO are done as a batch.
+   */
+  if (flash_do_batch_begin (6 * FLASH_DO_SIZE (sizeof (struct prvkey_data))
+			    + FLASH_DO_SIZE (KEYSTRING_SIZE)) < 0)
+    {
+      DEBUG_INFO ("memory error.\r\n");
+      GPG_MEMORY_FAILURE ();
+      return;
+    }
+
   r = gpg_change_keystring (who_old, old_ks, who, new_ks);
   if (r <= -2)
     {
       DEBUG_INFO ("memory error.\r\n");
+      flash_do_batch_abort ();
       GPG_MEMORY_FAILURE ();
     }
   else if (r < 0)
     {
       DEBUG_INFO ("security error.\r\n");
+      flash_do_batch_abort ();
       GPG_SECURITY_FAILURE ();
     }
   else if (r == 0 && who == BY_USER)	/* no prvkey */
     {
       DEBUG_INFO ("user pass change not supported with no keys.\r\n");
+      flash_do_batch_abort ();
       GPG_CONDITION_NOT_SATISFIED ();
     }
   else if (r > 0 && who == BY_USER)
@@ -473,7 +622,7 @@ cmd_change_password (struct eventflag *ccid_comm)
 	  ac_reset_admin ();
 	}
 
-      gpg_do_write_simple (NR_DO_KEYSTRING_PW1, new_ks0, KS_META_SIZE);
+      gpg_do_write_keystring (NR_DO_KEYSTRING_PW1, new_ks0, new_ks);
       ac_reset_pso_cds ();
       ac_reset_other ();
       DEBUG_INFO ("Changed length of DO_KEYSTRING_PW1.\r\n");
@@ -484,7 +633,7 @@ cmd_change_password (struct eventflag *ccid_comm)
       if (pw3_null)
 	gpg_do_write_simple (NR_DO_KEYSTRING_PW3, NULL, 0);
       else
-	gpg_do_write_simple (NR_DO_KEYSTRING_PW3, new_ks0, KS_META_SIZE);
+	gpg_do_write_keystring (NR_DO_KEYSTRING_PW3, new_ks0, new_ks);
 
       ac_reset_admin ();
       DEBUG_INFO ("Changed length of DO_KEYSTRING_PW3.\r\n");
@@ -503,6 +652,12 @@ cmd_change_password (struct eventflag *ccid_comm)
       ac_reset_admin ();
       GPG_SUCCESS ();
     }
+
+  if (flash_do_batch_commit () < 0)
+    {
+      DEBUG_INFO ("batch failure.\r\n");
+      GPG_MEMORY_FAILURE ();
+    }
 }
 
 
@@ -549,6 +704,26 @@ s2k (const unsigned char *salt, size_t slen,
   sha256_finish (&ctx, output);
 }
 
+/*
+ * Verifier of keystring to be stored in keystring DO.  It is keyed by
+ * the keystring, and doesn't reveal the key to decrypt DEK.
+ */
+void
+ks_verifier (const unsigned char *keystring,
+	     unsigned char output[KS_VERIFIER_SIZE])
+{
+  static const char label[] = "Gnuk keystring verifier";
+  sha256_context ctx;
+  unsigned char md[SHA256_DIGEST_SIZE];
+
+  sha256_start (&ctx);
+  sha256_update (&ctx, keystring, KEYSTRING_MD_SIZE);
+  sha256_update (&ctx, (const unsigned char *)label, sizeof label - 1);
+  sha256_finish (&ctx, md);
+  memcpy (output, md, KS_VERIFIER_SIZE);
+  memset (md, 0, sizeof md);
+}
+
 
 static void
 cmd_reset_user_password (struct eventflag *ccid_comm)
@@ -637,7 +812,7 @@ cmd_reset_user_password (struct eventflag *ccid_comm)
       else
 	{
 	  DEBUG_INFO ("done.\r\n");
-	  gpg_do_write_simple (NR_DO_KEYSTRING_PW1, new_ks0, KS_META_SIZE);
+	  gpg_do_write_keystring (NR_DO_KEYSTRING_PW1, new_ks0, new_ks);
 	  ac_reset_pso_cds ();
 	  ac_reset_other ();
 	  if (admin_authorized == BY_USER)
@@ -698,7 +873,7 @@ cmd_reset_user_password (struct eventflag *ccid_comm)
       else
 	{
 	  DEBUG_INFO ("done.\r\n");
-	  gpg_do_write_simple (NR_DO_KEYSTRING_PW1, new_ks0, KS_META_SIZE);
+	  gpg_do_write_keystring (NR_DO_KEYSTRING_PW1, new_ks0, new_ks);
 	  ac_reset_pso_cds ();
 	  ac_reset_other ();
 	  if (admin_authorized == BY_USER)
@@ -938,7 +1113,8 @@ cmd_set_identity (struct eventflag *ccid_comm)
       return;
   }else{
       GPG_SUCCESS ();
-      flash_set_identity(tag);
+      /* Switched after the response is sent.  */
+      identity_request=tag;
   }
 }
 
@@ -951,6 +1127,145 @@ cmd_set_identity (struct eventflag *ccid_comm)
 
 #define ECC_CIPHER_DO_HEADER_SIZE 7
 
+/*
+ * Check length of digest for signature.  Return 0 when it's OK.
+ */
+static int
+pso_cds_check_len (int attr, int len)
+{
+  if (attr == ALGO_RSA2K || attr == ALGO_RSA3K || attr == ALGO_RSA4K)
+    {
+      /* Check size of digestInfo */
+      if (len != 34		/* MD5 */
+	  && len != 35		/* SHA1 / RIPEMD-160 */
+	  && len != 47		/* SHA224 */
+	  && len != 51		/* SHA256 */
+	  && len != 67		/* SHA384 */
+	  && len != 83)		/* SHA512 */
+	return -1;
+    }
+  else if (attr == ALGO_NISTP256R1 || attr == ALGO_SECP256K1)
+    {
+      /* ECDSA with p256r1/p256k1 for signature */
+      if (len != ECDSA_HASH_LEN)
+	return -1;
+    }
+
+  return 0;
+}
+
+/*
+ * Return length of signature, or 0 for unknown algorithm.
+ */
+static unsigned int
+pso_cds_sig_len (int attr, int pubkey_len)
+{
+  if (attr == ALGO_RSA2K || attr == ALGO_RSA3K || attr == ALGO_RSA4K)
+    return pubkey_len;
+  else if (attr == ALGO_NISTP256R1 || attr == ALGO_SECP256K1)
+    return ECDSA_SIGNATURE_LENGTH;
+  else if (attr == ALGO_ED25519)
+    return EDDSA_SIGNATURE_LENGTH;
+  else
+    return 0;
+}
+
+/*
+ * Sign DIGEST by the signing key, which is already loaded.
+ */
+static int
+pso_cds_sign (int attr, int pubkey_len, const uint8_t *digest, int len,
+	      uint8_t *output)
+{
+  int r;
+  int cs;
+
+  if (attr == ALGO_RSA2K || attr == ALGO_RSA3K || attr == ALGO_RSA4K)
+    {
+      DEBUG_BINARY (kd[GPG_KEY_FOR_SIGNING].data, pubkey_len);
+
+      r = rsa_sign (digest, output, len, &kd[GPG_KEY_FOR_SIGNING],
+		    pubkey_len);
+    }
+  else if (attr == ALGO_NISTP256R1 || attr == ALGO_SECP256K1)
+    {
+      cs = chopstx_setcancelstate (0);
+      if (attr == ALGO_NISTP256R1)
+	r = ecdsa_sign_p256r1 (digest, output, kd[GPG_KEY_FOR_SIGNING].data);
+      else			/* ALGO_SECP256K1 */
+	r = ecdsa_sign_p256k1 (digest, output, kd[GPG_KEY_FOR_SIGNING].data);
+      chopstx_setcancelstate (cs);
+    }
+  else				/* ALGO_ED25519 */
+    {
+      uint32_t sig[64/4];	/* Require 4-byte alignment. */
+
+      cs = chopstx_setcancelstate (0);
+      r = eddsa_sign_25519 (digest, len, sig,
+			    kd[GPG_KEY_FOR_SIGNING].data,
+			    kd[GPG_KEY_FOR_SIGNING].data+32,
+			    kd[GPG_KEY_FOR_SIGNING].pubkey);
+      chopstx_setcancelstate (cs);
+      memcpy (output, sig, EDDSA_SIGNATURE_LENGTH);
+    }
+
+  return r;
+}
+
+/*
+ * Return length of input for decipher, or 0 for unknown algorithm.
+ */
+static int
+pso_decipher_input_len (int attr, int pubkey_len)
+{
+  if (attr == ALGO_RSA2K || attr == ALGO_RSA3K || attr == ALGO_RSA4K)
+    return pubkey_len;
+  else if (attr == ALGO_NISTP256R1 || attr == ALGO_SECP256K1)
+    return 65;			/* 04 || x || y */
+  else if (attr == ALGO_CURVE25519)
+    return 32;
+  else
+    return 0;
+}
+
+/*
+ * Decipher INPUT by the decryption key, which is already loaded.
+ * OUTPUT may overlap INPUT, when it starts at or before INPUT.
+ */
+static int
+pso_decipher (int attr, const uint8_t *input, int len, uint8_t *output,
+	      unsigned int *result_len_p)
+{
+  int r;
+  int cs;
+
+  if (attr == ALGO_RSA2K || attr == ALGO_RSA3K || attr == ALGO_RSA4K)
+    r = rsa_decrypt (input, output, len, &kd[GPG_KEY_FOR_DECRYPTION],
+		     result_len_p);
+  else if (attr == ALGO_NISTP256R1 || attr == ALGO_SECP256K1)
+    {
+      cs = chopstx_setcancelstate (0);
+      *result_len_p = 65;
+      if (attr == ALGO_NISTP256R1)
+	r = ecdh_decrypt_p256r1 (input, output,
+				 kd[GPG_KEY_FOR_DECRYPTION].data);
+      else
+	r = ecdh_decrypt_p256k1 (input, output,
+				 kd[GPG_KEY_FOR_DECRYPTION].data);
+      chopstx_setcancelstate (cs);
+    }
+  else				/* ALGO_CURVE25519 */
+    {
+      cs = chopstx_setcancelstate (0);
+      *result_len_p = 32;
+      r = ecdh_decrypt_curve25519 (input, output,
+				   kd[GPG_KEY_FOR_DECRYPTION].data);
+      chopstx_setcancelstate (cs);
+    }
+
+  return r;
+}
+
 static void
 cmd_pso (struct eventflag *ccid_comm)
 {
@@ -959,7 +1274,6 @@ cmd_pso (struct eventflag *ccid_comm)
   int attr;
   int pubkey_len;
   unsigned int result_len = 0;
-  int cs;
 
   DEBUG_INFO (" - PSO: ");
   DEBUG_WORD ((uint32_t)&r);
@@ -971,6 +1285,7 @@ cmd_pso (struct eventflag *ccid_comm)
       attr = gpg_get_algo_attr (GPG_KEY_FOR_SIGNING);
       pubkey_len = gpg_get_algo_attr_key_size (GPG_KEY_FOR_SIGNING,
 					       GPG_KEY_PUBLIC);
+      apdu.algo = attr;
 
       if (!ac_check_status (AC_PSO_CDS_AUTHORIZED))
 	{
@@ -979,76 +1294,39 @@ cmd_pso (struct eventflag *ccid_comm)
 	  return;
 	}
 
+      if (gpg_do_load_deferred_prvkey (GPG_KEY_FOR_SIGNING) < 0)
+	{
+	  DEBUG_INFO ("key load error.");
+	  ac_reset_pso_cds ();
+	  GPG_SECURITY_FAILURE ();
+	  return;
+	}
+
 #ifdef ACKBTN_SUPPORT
       if (gpg_do_get_uif (GPG_KEY_FOR_SIGNING))
 	eventflag_signal (ccid_comm, EV_EXEC_ACK_REQUIRED);
 #endif
 
-      if (attr == ALGO_RSA2K || attr == ALGO_RSA4K)
+      if (pso_cds_check_len (attr, len) < 0)
 	{
-	  /* Check size of digestInfo */
-	  if (len != 34		/* MD5 */
-	      && len != 35		/* SHA1 / RIPEMD-160 */
-	      && len != 47		/* SHA224 */
-	      && len != 51		/* SHA256 */
-	      && len != 67		/* SHA384 */
-	      && len != 83)		/* SHA512 */
-	    {
-	      DEBUG_INFO (" wrong length");
-	      GPG_CONDITION_NOT_SATISFIED ();
-	      return;
-	    }
-
-	  DEBUG_BINARY (kd[GPG_KEY_FOR_SIGNING].data, pubkey_len);
-
-	  result_len = pubkey_len;
-	  r = rsa_sign (apdu.cmd_apdu_data, res_APDU, len,
-			&kd[GPG_KEY_FOR_SIGNING], pubkey_len);
+	  DEBUG_INFO (" wrong length");
+	  GPG_CONDITION_NOT_SATISFIED ();
+	  return;
 	}
-      else if (attr == ALGO_NISTP256R1 || attr == ALGO_SECP256K1)
-	{
-	  /* ECDSA with p256r1/p256k1 for signature */
-	  if (len != ECDSA_HASH_LEN)
-	    {
-	      DEBUG_INFO (" wrong length");
-	      GPG_CONDITION_NOT_SATISFIED ();
-	      return;
-	    }
 
-	  cs = chopstx_setcancelstate (0);
-	  result_len = ECDSA_SIGNATURE_LENGTH;
-	  if (attr == ALGO_NISTP256R1)
-	    r = ecdsa_sign_p256r1 (apdu.cmd_apdu_data, res_APDU,
-				   kd[GPG_KEY_FOR_SIGNING].data);
-	  else			/* ALGO_SECP256K1 */
-	    r = ecdsa_sign_p256k1 (apdu.cmd_apdu_data, res_APDU,
-				   kd[GPG_KEY_FOR_SIGNING].data);
-	  chopstx_setcancelstate (cs);
-	}
-      else if (attr == ALGO_ED25519)
-	{
-	  uint32_t output[64/4];	/* Require 4-byte alignment. */
-
-	  cs = chopstx_setcancelstate (0);
-	  result_len = EDDSA_SIGNATURE_LENGTH;
-	  r = eddsa_sign_25519 (apdu.cmd_apdu_data, len, output,
-				kd[GPG_KEY_FOR_SIGNING].data,
-				kd[GPG_KEY_FOR_SIGNING].data+32,
-				kd[GPG_KEY_FOR_SIGNING].pubkey);
-	  chopstx_setcancelstate (cs);
-	  memcpy (res_APDU, output, EDDSA_SIGNATURE_LENGTH);
-	}
-      else
+      result_len = pso_cds_sig_len (attr, pubkey_len);
+      if (result_len == 0)
 	{
 	  DEBUG_INFO ("unknown algo.");
 	  GPG_FUNCTION_NOT_SUPPORTED ();
 	  return;
 	}
 
+      r = pso_cds_sign (attr, pubkey_len, apdu.cmd_apdu_data, len, res_APDU);
       if (r == 0)
 	{
 	  res_APDU_size = result_len;
-	  gpg_increment_digital_signature_counter ();
+	  gpg_increment_digital_signature_counter (1);
 	}
       else   /* Failure */
 	ac_reset_pso_cds ();
@@ -1058,8 +1336,7 @@ cmd_pso (struct eventflag *ccid_comm)
       attr = gpg_get_algo_attr (GPG_KEY_FOR_DECRYPTION);
       pubkey_len = gpg_get_algo_attr_key_size (GPG_KEY_FOR_DECRYPTION,
 					       GPG_KEY_PUBLIC);
-
-      DEBUG_BINARY (kd[GPG_KEY_FOR_DECRYPTION].data, pubkey_len);
+      apdu.algo = attr;
 
       if (!ac_check_status (AC_OTHER_AUTHORIZED))
 	{
@@ -1068,6 +1345,16 @@ cmd_pso (struct eventflag *ccid_comm)
 	  return;
 	}
 
+      if (gpg_do_load_deferred_prvkey (GPG_KEY_FOR_DECRYPTION) < 0)
+	{
+	  DEBUG_INFO ("key load error.");
+	  ac_reset_other ();
+	  GPG_SECURITY_FAILURE ();
+	  return;
+	}
+
+      DEBUG_BINARY (kd[GPG_KEY_FOR_DECRYPTION].data, pubkey_len);
+
 #ifdef ACKBTN_SUPPORT
       if (gpg_do_get_uif (GPG_KEY_FOR_DECRYPTION))
 	eventflag_signal (ccid_comm, EV_EXEC_ACK_REQUIRED);
@@ -1075,7 +1362,7 @@ cmd_pso (struct eventflag *ccid_comm)
       (void)ccid_comm;
 #endif
 
-      if (attr == ALGO_RSA2K || attr == ALGO_RSA4K)
+      if (attr == ALGO_RSA2K || attr == ALGO_RSA3K || attr == ALGO_RSA4K)
 	{
 	  /* Skip padding 0x00 */
 	  len--;
@@ -1084,8 +1371,8 @@ cmd_pso (struct eventflag *ccid_comm)
 	      GPG_CONDITION_NOT_SATISFIED ();
 	      return;
 	    }
-	  r = rsa_decrypt (apdu.cmd_apdu_data+1, res_APDU, len,
-			   &kd[GPG_KEY_FOR_DECRYPTION], &result_len);
+	  r = pso_decipher (attr, apdu.cmd_apdu_data+1, len, res_APDU,
+			    &result_len);
 	}
       else if (attr == ALGO_NISTP256R1 || attr == ALGO_SECP256K1)
 	{
@@ -1099,15 +1386,8 @@ cmd_pso (struct eventflag *ccid_comm)
 	      return;
 	    }
 
-	  cs = chopstx_setcancelstate (0);
-	  result_len = 65;
-	  if (attr == ALGO_NISTP256R1)
-	    r = ecdh_decrypt_p256r1 (apdu.cmd_apdu_data + header, res_APDU,
-				     kd[GPG_KEY_FOR_DECRYPTION].data);
-	  else
-	    r = ecdh_decrypt_p256k1 (apdu.cmd_apdu_data + header, res_APDU,
-				     kd[GPG_KEY_FOR_DECRYPTION].data);
-	  chopstx_setcancelstate (cs);
+	  r = pso_decipher (attr, apdu.cmd_apdu_data + header, 65, res_APDU,
+			    &result_len);
 	}
       else if (attr == ALGO_CURVE25519)
 	{
@@ -1119,11 +1399,8 @@ cmd_pso (struct eventflag *ccid_comm)
 	      return;
 	    }
 
-	  cs = chopstx_setcancelstate (0);
-	  result_len = 32;
-	  r = ecdh_decrypt_curve25519 (apdu.cmd_apdu_data + header, res_APDU,
-				       kd[GPG_KEY_FOR_DECRYPTION].data);
-	  chopstx_setcancelstate (cs);
+	  r = pso_decipher (attr, apdu.cmd_apdu_data + header, 32, res_APDU,
+			    &result_len);
 	}
       else
 	{
@@ -1149,6 +1426,256 @@ cmd_pso (struct eventflag *ccid_comm)
 }
 
 
+/*
+ * PSO in batch (not in OpenPGP card protocol)
+ *
+ * With P1P2 = 9E9A, it computes digital signatures of N digests.
+ * Command data is the length of a digest in a byte, followed by N
+ * digests of that length.  Response is N signatures in the same order.
+ * The digital signature counter is incremented by N.  When PW1 is valid
+ * for a single signature only, N should be 1.
+ *
+ * With P1P2 = 8086, it deciphers N inputs.  Command data is N inputs,
+ * each of which is an RSA ciphertext (without the padding indicator
+ * byte), or an ephemeral public key (04 || x || y for ECDH with NIST
+ * P-256 or secp256k1, 32-byte for X25519).  Response is N results,
+ * each prefixed by its length in two bytes (big endian).
+ *
+ * Authorization and the key are checked and loaded once for all.
+ *
+ * Command data and response share the buffer.  Inputs are moved to the
+ * end of the buffer first, so that a result never overwrites inputs
+ * not yet processed.
+ */
+#define PSO_BATCH_DIGEST_MAX 83	/* DigestInfo with SHA512 */
+
+static void
+pso_batch_cds (struct eventflag *ccid_comm)
+{
+  int attr;
+  int pubkey_len;
+  unsigned int sig_len;
+  int digest_len;
+  int n, i;
+  uint8_t *p;
+  uint8_t digest[PSO_BATCH_DIGEST_MAX];
+  int r = 0;
+
+  DEBUG_INFO (" - PSO batch\r\n");
+
+  attr = gpg_get_algo_attr (GPG_KEY_FOR_SIGNING);
+  pubkey_len = gpg_get_algo_attr_key_size (GPG_KEY_FOR_SIGNING,
+					   GPG_KEY_PUBLIC);
+  apdu.algo = attr;
+
+  sig_len = pso_cds_sig_len (attr, pubkey_len);
+  if (sig_len == 0)
+    {
+      DEBUG_INFO ("unknown algo.");
+      GPG_FUNCTION_NOT_SUPPORTED ();
+      return;
+    }
+
+  if (apdu.cmd_apdu_data_len < 2)
+    {
+      GPG_WRONG_LENGTH ();
+      return;
+    }
+
+  digest_len = apdu.cmd_apdu_data[0];
+  if (digest_len == 0 || digest_len > PSO_BATCH_DIGEST_MAX
+      || (apdu.cmd_apdu_data_len - 1) % digest_len != 0
+      || pso_cds_check_len (attr, digest_len) < 0)
+    {
+      DEBUG_INFO (" wrong length");
+      GPG_CONDITION_NOT_SATISFIED ();
+      return;
+    }
+
+  n = (apdu.cmd_apdu_data_len - 1) / digest_len;
+
+  if (n * sig_len > MAX_RES_APDU_DATA_SIZE)
+    {
+      GPG_WRONG_LENGTH ();
+      return;
+    }
+
+  if (!ac_check_status (AC_PSO_CDS_AUTHORIZED)
+      || (n > 1 && gpg_get_pw1_lifetime () == 0))
+    {
+      DEBUG_INFO ("security error.");
+      GPG_SECURITY_FAILURE ();
+      return;
+    }
+
+#ifdef ACKBTN_SUPPORT
+  /* A button press confirms a single signature.  */
+  if (n > 1 && gpg_do_get_uif (GPG_KEY_FOR_SIGNING))
+    {
+      DEBUG_INFO ("security error.");
+      GPG_SECURITY_FAILURE ();
+      return;
+    }
+#endif
+
+  if (gpg_do_load_deferred_prvkey (GPG_KEY_FOR_SIGNING) < 0)
+    {
+      DEBUG_INFO ("key load error.");
+      ac_reset_pso_cds ();
+      GPG_SECURITY_FAILURE ();
+      return;
+    }
+
+#ifdef ACKBTN_SUPPORT
+  if (gpg_do_get_uif (GPG_KEY_FOR_SIGNING))
+    eventflag_signal (ccid_comm, EV_EXEC_ACK_REQUIRED);
+#else
+  (void)ccid_comm;
+#endif
+
+  p = apdu.cmd_apdu_data + MAX_CMD_APDU_DATA_SIZE - n * digest_len;
+  memmove (p, apdu.cmd_apdu_data + 1, n * digest_len);
+
+  for (i = 0; i < n && r == 0; i++)
+    {
+      memcpy (digest, p + i * digest_len, digest_len);
+      r = pso_cds_sign (attr, pubkey_len, digest, digest_len,
+			res_APDU + i * sig_len);
+    }
+
+  memset (digest, 0, digest_len);
+  if (r == 0)
+    {
+      res_APDU_size = n * sig_len;
+      gpg_increment_digital_signature_counter (n);
+    }
+  else   /* Failure */
+    {
+      ac_reset_pso_cds ();
+      GPG_ERROR ();
+    }
+}
+
+static void
+pso_batch_decipher (struct eventflag *ccid_comm)
+{
+  int attr;
+  int pubkey_len;
+  int input_len;
+  int result_max;
+  int n, i;
+  uint8_t *p;
+  uint8_t *res_p = res_APDU;
+  unsigned int result_len;
+  int r = 0;
+
+  DEBUG_INFO (" - PSO batch decipher\r\n");
+
+  attr = gpg_get_algo_attr (GPG_KEY_FOR_DECRYPTION);
+  pubkey_len = gpg_get_algo_attr_key_size (GPG_KEY_FOR_DECRYPTION,
+					   GPG_KEY_PUBLIC);
+  apdu.algo = attr;
+
+  input_len = pso_decipher_input_len (attr, pubkey_len);
+  if (input_len == 0)
+    {
+      DEBUG_INFO ("unknown algo.");
+      GPG_FUNCTION_NOT_SUPPORTED ();
+      return;
+    }
+
+  if (attr == ALGO_RSA2K || attr == ALGO_RSA3K || attr == ALGO_RSA4K)
+    result_max = pubkey_len - 11; /* PKCS#1 v1.5 padding */
+  else
+    result_max = input_len;
+
+  n = apdu.cmd_apdu_data_len / input_len;
+  if (n == 0 || n * input_len != apdu.cmd_apdu_data_len)
+    {
+      GPG_CONDITION_NOT_SATISFIED ();
+      return;
+    }
+
+  if (attr == ALGO_NISTP256R1 || attr == ALGO_SECP256K1)
+    /* Format is in big endian MPI: 04 || x || y */
+    for (i = 0; i < n; i++)
+      if (apdu.cmd_apdu_data[i * input_len] != 0x04)
+	{
+	  GPG_CONDITION_NOT_SATISFIED ();
+	  return;
+	}
+
+  if (n * (2 + result_max) > MAX_RES_APDU_DATA_SIZE)
+    {
+      GPG_WRONG_LENGTH ();
+      return;
+    }
+
+  if (!ac_check_status (AC_OTHER_AUTHORIZED))
+    {
+      DEBUG_INFO ("security error.");
+      GPG_SECURITY_FAILURE ();
+      return;
+    }
+
+#ifdef ACKBTN_SUPPORT
+  /* A button press confirms a single decryption.  */
+  if (n > 1 && gpg_do_get_uif (GPG_KEY_FOR_DECRYPTION))
+    {
+      DEBUG_INFO ("security error.");
+      GPG_SECURITY_FAILURE ();
+      return;
+    }
+#endif
+
+  if (gpg_do_load_deferred_prvkey (GPG_KEY_FOR_DECRYPTION) < 0)
+    {
+      DEBUG_INFO ("key load error.");
+      ac_reset_other ();
+      GPG_SECURITY_FAILURE ();
+      return;
+    }
+
+#ifdef ACKBTN_SUPPORT
+  if (gpg_do_get_uif (GPG_KEY_FOR_DECRYPTION))
+    eventflag_signal (ccid_comm, EV_EXEC_ACK_REQUIRED);
+#else
+  (void)ccid_comm;
+#endif
+
+  p = apdu.cmd_apdu_data + MAX_CMD_APDU_DATA_SIZE - n * input_len;
+  memmove (p, apdu.cmd_apdu_data, n * input_len);
+
+  for (i = 0; i < n && r == 0; i++)
+    {
+      r = pso_decipher (attr, p + i * input_len, input_len, res_p + 2,
+			&result_len);
+      if (r == 0)
+	{
+	  res_p[0] = result_len >> 8;
+	  res_p[1] = result_len & 0xff;
+	  res_p += 2 + result_len;
+	}
+    }
+
+  if (r == 0)
+    res_APDU_size = res_p - res_APDU;
+  else
+    GPG_ERROR ();
+}
+
+static void
+cmd_pso_batch (struct eventflag *ccid_comm)
+{
+  if (P1 (apdu) == 0x9e && P2 (apdu) == 0x9a)
+    pso_batch_cds (ccid_comm);
+  else if (P1 (apdu) == 0x80 && P2 (apdu) == 0x86)
+    pso_batch_decipher (ccid_comm);
+  else
+    GPG_BAD_P1_P2 ();
+}
+
+
 #define MAX_RSA_DIGEST_INFO_LEN 102 /* 40% */
 static void
 cmd_internal_authenticate (struct eventflag *ccid_comm)
@@ -1162,6 +1689,7 @@ cmd_internal_authenticate (struct eventflag *ccid_comm)
   int cs;
 
   DEBUG_INFO (" - INTERNAL AUTHENTICATE\r\n");
+  apdu.algo = attr;
 
   if (P1 (apdu) != 0x00 || P2 (apdu) != 0x00)
     {
@@ -1181,6 +1709,14 @@ cmd_internal_authenticate (struct eventflag *ccid_comm)
       return;
     }
 
+  if (gpg_do_load_deferred_prvkey (GPG_KEY_FOR_AUTHENTICATION) < 0)
+    {
+      DEBUG_INFO ("key load error.");
+      ac_reset_other ();
+      GPG_SECURITY_FAILURE ();
+      return;
+    }
+
 #ifdef ACKBTN_SUPPORT
   if (gpg_do_get_uif (GPG_KEY_FOR_AUTHENTICATION))
     eventflag_signal (ccid_comm, EV_EXEC_ACK_REQUIRED);
@@ -1188,7 +1724,7 @@ cmd_internal_authenticate (struct eventflag *ccid_comm)
   (void)ccid_comm;
 #endif
 
-  if (attr == ALGO_RSA2K || attr == ALGO_RSA4K)
+  if (attr == ALGO_RSA2K || attr == ALGO_RSA3K || attr == ALGO_RSA4K)
     {
       if (len > MAX_RSA_DIGEST_INFO_LEN)
 	{
@@ -1434,14 +1970,11 @@ cmd_get_challenge (struct eventflag *ccid_comm)
   (void)ccid_comm;
   DEBUG_INFO (" - GET CHALLENGE\r\n");
 
-  if (len > CHALLENGE_LEN)
-    {
-      GPG_CONDITION_NOT_SATISFIED ();
-      return;
-    }
-  else if (len == 0)
+  if (len == 0)
     /* Le is not specified.  Return full-sized challenge by GET_RESPONSE.  */
     len = CHALLENGE_LEN;
+  else if (len > MAX_RES_APDU_DATA_SIZE)
+    len = MAX_RES_APDU_DATA_SIZE;
 
   if (challenge)
     random_bytes_free (challenge);
@@ -1453,8 +1986,15 @@ cmd_get_challenge (struct eventflag *ccid_comm)
     eventflag_signal (ccid_comm, EV_EXEC_ACK_REQUIRED);
 #endif
 
+  /*
+   * Bytes after the challenge are streamed from the ring buffer.  Do
+   * that before the challenge is taken, as it's kept in the buffer.
+   */
+  if (len > CHALLENGE_LEN)
+    random_bytes_stream (res_APDU + CHALLENGE_LEN, len - CHALLENGE_LEN);
+
   challenge = random_bytes_get ();
-  memcpy (res_APDU, challenge, len);
+  memcpy (res_APDU, challenge, len > CHALLENGE_LEN ? CHALLENGE_LEN : len);
   res_APDU_size = len;
   GPG_SUCCESS ();
   DEBUG_INFO ("GET CHALLENGE done.\r\n");
@@ -1535,6 +2075,7 @@ const struct command cmds[] = {
   { INS_VERIFY, cmd_verify },
   { INS_CHANGE_REFERENCE_DATA, cmd_change_password },
   { INS_PSO, cmd_pso },
+  { INS_PSO_BATCH, cmd_pso_batch },	    /* Not in OpenPGP card protocol */
   { INS_RESET_RETRY_COUNTER, cmd_reset_user_password },
 #ifdef LIFE_CYCLE_MANAGEMENT_SUPPORT
   { INS_ACTIVATE_FILE, cmd_activate_file },
@@ -1562,6 +2103,240 @@ const struct command cmds[] = {
 };
 #define NUM_CMDS ((int)(sizeof (cmds) / sizeof (struct command)))
 
+#ifdef PROFILE_SUPPORT
+/*
+ * Profiling of commands
+ *
+ * For each command (in the order of CMDS) and for each key algorithm,
+ * a histogram of execution time is kept.  Bucket K counts the commands
+ * which took less than 2^(K+PROF_BUCKET_SHIFT) usec (the last bucket
+ * counts all longer ones).  For each command, the numbers of copying
+ * GC, page erase and halfword program of flash memory are counted, too,
+ * including the deferred writes by gpg_do_write_behind after the
+ * response (not in its time).  Flash memory events of house keeping in
+ * idle time are counted separately.
+ *
+ * Time is measured by the DWT cycle counter on Cortex-M3, which wraps
+ * around after 2^32 cycles (about a minute).
+ */
+#define PROF_BUCKETS      16
+#define PROF_BUCKET_SHIFT 8
+#define PROF_ALGO_NUM     7	/* ALGO_RSA4K..ALGO_RSA3K, and ALGO_RSA2K */
+
+struct prof_hist {
+  uint16_t count[PROF_BUCKETS];
+};
+
+static struct prof_hist prof_cmd[NUM_CMDS];
+static struct prof_hist prof_algo[PROF_ALGO_NUM];
+static struct flash_prof prof_flash[NUM_CMDS];
+static struct flash_prof prof_flash_idle;
+static int prof_last_cmd = -1;	/* Command for the write-behind */
+
+#ifdef GNU_LINUX_EMULATION
+#include <time.h>
+
+#define PROF_TICKS_PER_USEC 1
+
+static void
+prof_init (void)
+{
+}
+
+static uint32_t
+prof_ticks (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint32_t)(ts.tv_sec * 1000000 + ts.tv_nsec / 1000);
+}
+#else
+#define DEMCR      (*(volatile uint32_t *)0xE000EDFC)
+#define DWT_CTRL   (*(volatile uint32_t *)0xE0001000)
+#define DWT_CYCCNT (*(volatile uint32_t *)0xE0001004)
+
+#define PROF_TICKS_PER_USEC MHZ
+
+static void
+prof_init (void)
+{
+  DEMCR |= (1 << 24);		/* TRCENA */
+  DWT_CYCCNT = 0;
+  DWT_CTRL |= 1;		/* CYCCNTENA */
+}
+
+static uint32_t
+prof_ticks (void)
+{
+  return DWT_CYCCNT;
+}
+#endif
+
+static void
+prof_hist_add (struct prof_hist *h, uint32_t usec)
+{
+  int k = 0;
+
+  usec >>= PROF_BUCKET_SHIFT;
+  while (usec && k < PROF_BUCKETS - 1)
+    {
+      usec >>= 1;
+      k++;
+    }
+
+  if (h->count[k] != 0xffff)
+    h->count[k]++;
+}
+
+static void
+prof_flash_add (struct flash_prof *f, const struct flash_prof *f0)
+{
+  f->gc += flash_prof.gc - f0->gc;
+  f->erase += flash_prof.erase - f0->erase;
+  f->program += flash_prof.program - f0->program;
+}
+
+static void
+prof_record (int i, uint32_t ticks, const struct flash_prof *f0)
+{
+  uint32_t usec = ticks / PROF_TICKS_PER_USEC;
+  int algo = apdu.algo == ALGO_RSA2K ? PROF_ALGO_NUM - 1 : apdu.algo;
+
+  prof_hist_add (&prof_cmd[i], usec);
+  if (algo < PROF_ALGO_NUM)
+    prof_hist_add (&prof_algo[algo], usec);
+
+  prof_flash_add (&prof_flash[i], f0);
+  prof_last_cmd = i;
+}
+
+/*
+ * Count the flash memory events since F0 for the last command (by
+ * gpg_do_write_behind), or for house keeping.
+ */
+static void
+prof_record_flash (const struct flash_prof *f0)
+{
+  if (prof_last_cmd >= 0)
+    prof_flash_add (&prof_flash[prof_last_cmd], f0);
+  else
+    prof_flash_add (&prof_flash_idle, f0);
+  prof_last_cmd = -1;
+}
+
+static uint8_t *
+prof_put_hist (uint8_t *p, uint8_t kind, uint8_t id,
+	       const struct prof_hist *h)
+{
+  uint16_t map = 0;
+  int k;
+
+  for (k = 0; k < PROF_BUCKETS; k++)
+    if (h->count[k])
+      map |= (1 << k);
+
+  *p++ = kind;
+  *p++ = id;
+  *p++ = map >> 8;
+  *p++ = map & 0xff;
+  for (k = 0; k < PROF_BUCKETS; k++)
+    if (h->count[k])
+      {
+	*p++ = h->count[k] >> 8;
+	*p++ = h->count[k] & 0xff;
+      }
+
+  return p;
+}
+
+static uint8_t *
+prof_put_u32 (uint8_t *p, uint32_t v)
+{
+  *p++ = v >> 24;
+  *p++ = v >> 16;
+  *p++ = v >> 8;
+  *p++ = v;
+  return p;
+}
+
+/*
+ * Output the profile to P, up to MAX bytes.  Return the length.
+ *
+ * It's PROF_BUCKETS, PROF_BUCKET_SHIFT, and a list of records of used
+ * commands and algorithms.  A record is: kind (1 for command, 2 for
+ * algorithm), INS or algorithm, two-byte bitmap of non-empty buckets,
+ * two-byte counts of the non-empty buckets.  A record of command is
+ * followed by four-byte numbers of copying GC, page erase and halfword
+ * program.  Records which don't fit are omitted.  At the end, there is
+ * a record of house keeping: kind 3, zero, and the four-byte numbers
+ * of flash memory events.
+ */
+int
+gpg_prof_read (uint8_t *p, int max)
+{
+  uint8_t *p0 = p;
+  int i;
+
+  *p++ = PROF_BUCKETS;
+  *p++ = PROF_BUCKET_SHIFT;
+
+  for (i = 0; i < NUM_CMDS + PROF_ALGO_NUM; i++)
+    {
+      const struct prof_hist *h;
+      int n = 0;
+      int k;
+
+      if (i < NUM_CMDS)
+	h = &prof_cmd[i];
+      else
+	h = &prof_algo[i - NUM_CMDS];
+
+      for (k = 0; k < PROF_BUCKETS; k++)
+	if (h->count[k])
+	  n++;
+
+      if (n == 0 || p + 4 + n * 2 + (i < NUM_CMDS ? 12 : 0) > p0 + max)
+	continue;
+
+      if (i < NUM_CMDS)
+	{
+	  p = prof_put_hist (p, 1, cmds[i].command, h);
+	  p = prof_put_u32 (p, prof_flash[i].gc);
+	  p = prof_put_u32 (p, prof_flash[i].erase);
+	  p = prof_put_u32 (p, prof_flash[i].program);
+	}
+      else
+	{
+	  int algo = i - NUM_CMDS;
+
+	  p = prof_put_hist (p, 2, algo == PROF_ALGO_NUM - 1 ? ALGO_RSA2K : algo,
+			     h);
+	}
+    }
+
+  if (p + 14 <= p0 + max)
+    {
+      *p++ = 3;
+      *p++ = 0;
+      p = prof_put_u32 (p, prof_flash_idle.gc);
+      p = prof_put_u32 (p, prof_flash_idle.erase);
+      p = prof_put_u32 (p, prof_flash_idle.program);
+    }
+
+  return p - p0;
+}
+
+void
+gpg_prof_reset (void)
+{
+  memset (prof_cmd, 0, sizeof prof_cmd);
+  memset (prof_algo, 0, sizeof prof_algo);
+  memset (prof_flash, 0, sizeof prof_flash);
+  memset (&prof_flash_idle, 0, sizeof prof_flash_idle);
+}
+#endif
+
 static void
 process_command_apdu (struct eventflag *ccid_comm)
 {
@@ -1586,8 +2361,18 @@ process_command_apdu (struct eventflag *ccid_comm)
 	GPG_NO_RECORD ();
       else
 	{
+#ifdef PROFILE_SUPPORT
+	  struct flash_prof f0 = flash_prof;
+	  uint32_t t0 = prof_ticks ();
+#endif
+
 	  chopstx_setcancelstate (1);
 	  cmds[i].cmd_handler (ccid_comm);
+	  flash_do_batch_abort ();	/* In case a handler didn't finish.  */
+	  gpg_do_clear_aes_cache ();
+#ifdef PROFILE_SUPPORT
+	  prof_record (i, prof_ticks () - t0, &f0);
+#endif
 	  chopstx_setcancelstate (0);
 	}
     }
@@ -1599,6 +2384,8 @@ process_command_apdu (struct eventflag *ccid_comm)
     }
 }
 
+#define IDLE_INTERVAL 100000	/* 100ms */
+
 void *
 openpgp_card_thread (void *arg)
 {
@@ -1606,17 +2393,54 @@ openpgp_card_thread (void *arg)
 
   openpgp_comm = ccid_comm + 1;
 
+  gpg_slot_fini ();
   gpg_init ();
+#ifdef PROFILE_SUPPORT
+  prof_init ();
+#endif
 
   while (1)
     {
 #if defined(PINPAD_SUPPORT)
       int len, pw_len, newpw_len;
 #endif
-      eventmask_t m = eventflag_wait (openpgp_comm);
+      eventmask_t m;
+
+      /*
+       * When there is no command for a while, do house keeping of
+       * flash memory, one step at a time.
+       */
+      while ((m = eventflag_wait_timeout (openpgp_comm, IDLE_INTERVAL)) == 0)
+	{
+	  int cs = chopstx_setcancelstate (1);
+#ifdef PROFILE_SUPPORT
+	  struct flash_prof f0 = flash_prof;
+#endif
+	  int r = flash_data_pool_idle ();
+
+#ifdef PROFILE_SUPPORT
+	  prof_record_flash (&f0);
+#endif
+	  chopstx_setcancelstate (cs);
+	  if (!r)
+	    {
+	      m = eventflag_wait (openpgp_comm);
+	      break;
+	    }
+	}
 
       DEBUG_INFO ("GPG!: ");
 
+      if (m == EV_VERIFY_CMD_AVAILABLE || m == EV_MODIFY_CMD_AVAILABLE
+	  || m == EV_CMD_AVAILABLE)
+	{
+	  int cs = chopstx_setcancelstate (1);
+
+	  gpg_slot_reset ();
+	  gpg_select_slot (apdu.slot);
+	  chopstx_setcancelstate (cs);
+	}
+
       if (m == EV_VERIFY_CMD_AVAILABLE)
 	{
 #if defined(PINPAD_SUPPORT)
@@ -1699,6 +2523,22 @@ openpgp_card_thread (void *arg)
 	}
       else if (m == EV_EXIT)
 	break;
+      else if (m == EV_SET_IDENTITY)
+	{
+	  int cs = chopstx_setcancelstate (1);
+
+	  gpg_switch_identity ();
+	  chopstx_setcancelstate (cs);
+	  continue;
+	}
+      else if (m == EV_SLOT_POWER_OFF)
+	{
+	  int cs = chopstx_setcancelstate (1);
+
+	  gpg_slot_reset ();
+	  chopstx_setcancelstate (cs);
+	  continue;
+	}
 
       led_blink (LED_START_COMMAND);
       process_command_apdu (ccid_comm);
@@ -1706,8 +2546,25 @@ openpgp_card_thread (void *arg)
       led_blink (LED_ONESHOT); //blink after finishing each command
     done:
       eventflag_signal (ccid_comm, EV_EXEC_FINISHED);
+
+      /* The response is sent, write deferred updates to flash.  */
+      {
+	int cs = chopstx_setcancelstate (1);
+#ifdef PROFILE_SUPPORT
+	struct flash_prof f0 = flash_prof;
+#endif
+
+	gpg_do_write_behind ();
+#ifdef PROFILE_SUPPORT
+	prof_record_flash (&f0);
+#endif
+	if (identity_request != IDENTITY_NONE)
+	  gpg_switch_identity ();
+	chopstx_setcancelstate (cs);
+      }
     }
 
   gpg_fini ();
+  gpg_slot_fini ();
   return NULL;
 }
@@ -83,6 +83,30 @@ random_get_salt (uint8_t *p)
   memcpy (p + sizeof (uint32_t), &rnd, sizeof (uint32_t));
 }
 
+/*
+ * Fill OUT with LEN bytes, taking words from the ring buffer one by
+ * one, without waiting for the whole buffer to be full.
+ */
+void
+random_bytes_stream (uint8_t *out, size_t len)
+{
+  uint32_t rnd;
+
+  while (len >= sizeof (uint32_t))
+    {
+      rnd = neug_get (NEUG_KICK_FILLING);
+      memcpy (out, &rnd, sizeof (uint32_t));
+      out += sizeof (uint32_t);
+      len -= sizeof (uint32_t);
+    }
+
+  if (len)
+    {
+      rnd = neug_get (NEUG_KICK_FILLING);
+      memcpy (out, &rnd, len);
+    }
+}
+
 
 /*
  * Random byte iterator
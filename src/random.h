@@ -5,6 +5,9 @@ void random_fini (void);
 const uint8_t *random_bytes_get (void);
 void random_bytes_free (const uint8_t *p);
 
+/* random bytes of any length, as they are generated */
+void random_bytes_stream (uint8_t *out, size_t len);
+
 /* 8-byte salt */
 void random_get_salt (uint8_t *p);
 
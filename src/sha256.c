@@ -54,14 +54,21 @@
 static void memcpy_output_bswap32 (unsigned char *dst, const uint32_t *p)
 {
   int i;
-  uint32_t q = 0;
+  uint32_t q;
 
-  for (i = 0; i < 32; i++)
-    {
-      if ((i & 3) == 0)
-	q = __builtin_bswap32 (p[i >> 2]); /* bswap32 is GCC extention */
-      dst[i] = q >> ((i & 3) * 8);
-    }
+  if (((uintptr_t)dst & 3) == 0)
+    /* Aligned: word-wise store */
+    for (i = 0; i < 8; i++)
+      ((uint32_t *)dst)[i] = __builtin_bswap32 (p[i]); /* GCC extention */
+  else
+    for (i = 0; i < 8; i++)
+      {
+	q = p[i];
+	dst[i*4]   = q >> 24;
+	dst[i*4+1] = q >> 16;
+	dst[i*4+2] = q >> 8;
+	dst[i*4+3] = q;
+      }
 }
 
 #define rotr32(x,n)   (((x) >> n) | ((x) << (32 - n)))
@@ -76,7 +83,6 @@ static void memcpy_output_bswap32 (unsigned char *dst, const uint32_t *p)
     g_1(p[(i + 14) & 15]) + p[(i + 9) & 15] + g_0(p[(i + 1) & 15]))
 
 #define v_cycle0(i)                                 \
-    p[i] = __builtin_bswap32 (p[i]);                \
     vf(7,i) += p[i] + k_0[i]                        \
     + s_1(vf(4,i)) + ch(vf(4,i),vf(5,i),vf(6,i));   \
     vf(3,i) += vf(7,i);                             \
@@ -113,36 +119,84 @@ static const uint32_t k256[64] = {
   0X90BEFFFA, 0XA4506CEB, 0XBEF9A3F7, 0XC67178F2,
 };
 
-void
-sha256_process (sha256_context *ctx)
+/*
+ * Compress a block.  P is the message block in 16 big endian words
+ * (already converted to host order), which is used for the message
+ * schedule in place.  The rounds are fully unrolled.
+ */
+static void
+sha256_compress (uint32_t *state, uint32_t *p)
 {
-  uint32_t i;
-  uint32_t *p = ctx->wbuf;
   uint32_t v[8];
 
-  memcpy (v, ctx->state, 8 * sizeof (uint32_t));
+  memcpy (v, state, 8 * sizeof (uint32_t));
 
   v_cycle0 ( 0); v_cycle0 ( 1); v_cycle0 ( 2); v_cycle0 ( 3);
   v_cycle0 ( 4); v_cycle0 ( 5); v_cycle0 ( 6); v_cycle0 ( 7);
   v_cycle0 ( 8); v_cycle0 ( 9); v_cycle0 (10); v_cycle0 (11);
   v_cycle0 (12); v_cycle0 (13); v_cycle0 (14); v_cycle0 (15);
 
-  for (i = 16; i < 64; i += 16)
+  v_cycle ( 0, 16); v_cycle ( 1, 16); v_cycle ( 2, 16); v_cycle ( 3, 16);
+  v_cycle ( 4, 16); v_cycle ( 5, 16); v_cycle ( 6, 16); v_cycle ( 7, 16);
+  v_cycle ( 8, 16); v_cycle ( 9, 16); v_cycle (10, 16); v_cycle (11, 16);
+  v_cycle (12, 16); v_cycle (13, 16); v_cycle (14, 16); v_cycle (15, 16);
+
+  v_cycle ( 0, 32); v_cycle ( 1, 32); v_cycle ( 2, 32); v_cycle ( 3, 32);
+  v_cycle ( 4, 32); v_cycle ( 5, 32); v_cycle ( 6, 32); v_cycle ( 7, 32);
+  v_cycle ( 8, 32); v_cycle ( 9, 32); v_cycle (10, 32); v_cycle (11, 32);
+  v_cycle (12, 32); v_cycle (13, 32); v_cycle (14, 32); v_cycle (15, 32);
+
+  v_cycle ( 0, 48); v_cycle ( 1, 48); v_cycle ( 2, 48); v_cycle ( 3, 48);
+  v_cycle ( 4, 48); v_cycle ( 5, 48); v_cycle ( 6, 48); v_cycle ( 7, 48);
+  v_cycle ( 8, 48); v_cycle ( 9, 48); v_cycle (10, 48); v_cycle (11, 48);
+  v_cycle (12, 48); v_cycle (13, 48); v_cycle (14, 48); v_cycle (15, 48);
+
+  state[0] += v[0];
+  state[1] += v[1];
+  state[2] += v[2];
+  state[3] += v[3];
+  state[4] += v[4];
+  state[5] += v[5];
+  state[6] += v[6];
+  state[7] += v[7];
+}
+
+void
+sha256_process (sha256_context *ctx)
+{
+  int i;
+
+  for (i = 0; i < 16; i++)
+    ctx->wbuf[i] = __builtin_bswap32 (ctx->wbuf[i]);
+
+  sha256_compress (ctx->state, ctx->wbuf);
+}
+
+/*
+ * Compress whole blocks directly from INPUT, which is word aligned,
+ * without staging them through ctx->wbuf.  Returns number of bytes
+ * consumed.
+ */
+static unsigned int
+sha256_process_blocks (sha256_context *ctx, const unsigned char *input,
+		       unsigned int ilen)
+{
+  const uint32_t *src = (const uint32_t *)input;
+  uint32_t w[16];
+  unsigned int n = 0;
+  int i;
+
+  while (ilen - n >= SHA256_BLOCK_SIZE)
     {
-      v_cycle ( 0, i); v_cycle ( 1, i); v_cycle ( 2, i); v_cycle ( 3, i);
-      v_cycle ( 4, i); v_cycle ( 5, i); v_cycle ( 6, i); v_cycle ( 7, i);
-      v_cycle ( 8, i); v_cycle ( 9, i); v_cycle (10, i); v_cycle (11, i);
-      v_cycle (12, i); v_cycle (13, i); v_cycle (14, i); v_cycle (15, i);
+      for (i = 0; i < 16; i++)
+	w[i] = __builtin_bswap32 (src[i]);
+      sha256_compress (ctx->state, w);
+      src += 16;
+      n += SHA256_BLOCK_SIZE;
     }
 
-  ctx->state[0] += v[0];
-  ctx->state[1] += v[1];
-  ctx->state[2] += v[2];
-  ctx->state[3] += v[3];
-  ctx->state[4] += v[4];
-  ctx->state[5] += v[5];
-  ctx->state[6] += v[6];
-  ctx->state[7] += v[7];
+  memset (w, 0, sizeof w);
+  return n;
 }
 
 void
@@ -156,16 +210,31 @@ sha256_update (sha256_context *ctx, const unsigned char *input,
   if (ctx->total[0] < ilen)
     ctx->total[1]++;
 
-  while (ilen >= fill)
+  if (left && ilen >= fill)
     {
       memcpy (((unsigned char*)ctx->wbuf) + left, input, fill);
       sha256_process (ctx);
       input += fill;
       ilen -= fill;
       left = 0;
-      fill = SHA256_BLOCK_SIZE;
     }
 
+  if (left == 0 && ((uintptr_t)input & 3) == 0)
+    {
+      unsigned int n = sha256_process_blocks (ctx, input, ilen);
+
+      input += n;
+      ilen -= n;
+    }
+  else
+    while (ilen >= SHA256_BLOCK_SIZE)
+      {
+	memcpy (ctx->wbuf, input, SHA256_BLOCK_SIZE);
+	sha256_process (ctx);
+	input += SHA256_BLOCK_SIZE;
+	ilen -= SHA256_BLOCK_SIZE;
+      }
+
   memcpy (((unsigned char*)ctx->wbuf) + left, input, ilen);
 }
 
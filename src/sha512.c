@@ -49,34 +49,86 @@ static void memcpy_output_bswap64 (unsigned char dst[64], const uint64_t *p)
     }
 }
 
-#define rotr64(x,n)   (((x) >> n) | ((x) << (64 - n)))
+/*
+ * SHA-512 is computed by 32-bit operations, with a 64-bit word split
+ * into high (H) and low (L) halves.  Cortex-M3 has no 64-bit shifter,
+ * so that a 64-bit rotation by C compiler results long sequences.
+ */
+
+/* 64-bit addition of (XH, XL) to (RH, RL) */
+#define add64(rh,rl,xh,xl)  do {                     \
+    uint32_t t_ = (xl);                             \
+    (rl) += t_;                                     \
+    (rh) += (xh) + ((rl) < t_);                     \
+  } while (0)
 
 #define ch(x,y,z)       ((z) ^ ((x) & ((y) ^ (z))))
 #define maj(x,y,z)      (((x) & (y)) | ((z) & ((x) ^ (y))))
 
+/* ROTR 28, 34 (= 32+2) and 39 (= 32+7) */
+#define s_0h(h,l) (((h) >> 28 | (l) <<  4) ^ ((l) >>  2 | (h) << 30) \
+		   ^ ((l) >>  7 | (h) << 25))
+#define s_0l(h,l) (((l) >> 28 | (h) <<  4) ^ ((h) >>  2 | (l) << 30) \
+		   ^ ((h) >>  7 | (l) << 25))
+/* ROTR 14, 18 and 41 (= 32+9) */
+#define s_1h(h,l) (((h) >> 14 | (l) << 18) ^ ((h) >> 18 | (l) << 14) \
+		   ^ ((l) >>  9 | (h) << 23))
+#define s_1l(h,l) (((l) >> 14 | (h) << 18) ^ ((l) >> 18 | (h) << 14) \
+		   ^ ((h) >>  9 | (l) << 23))
+/* ROTR 1, 8 and SHR 7 */
+#define g_0h(h,l) (((h) >>  1 | (l) << 31) ^ ((h) >>  8 | (l) << 24) \
+		   ^ ((h) >>  7))
+#define g_0l(h,l) (((l) >>  1 | (h) << 31) ^ ((l) >>  8 | (h) << 24) \
+		   ^ ((l) >>  7 | (h) << 25))
+/* ROTR 19, 61 (= 32+29) and SHR 6 */
+#define g_1h(h,l) (((h) >> 19 | (l) << 13) ^ ((l) >> 29 | (h) <<  3) \
+		   ^ ((h) >>  6))
+#define g_1l(h,l) (((l) >> 19 | (h) << 13) ^ ((h) >> 29 | (l) <<  3) \
+		   ^ ((l) >>  6 | (h) << 26))
+
 /* round transforms for SHA512 compression functions */
-#define vf(n,i) v[(n - i) & 7]
-
-#define hf(i) (p[i & 15] += \
-    g_1(p[(i + 14) & 15]) + p[(i + 9) & 15] + g_0(p[(i + 1) & 15]))
-
-#define v_cycle0(i)                                 \
-    p[i] = __builtin_bswap64 (p[i]);                \
-    vf(7,i) += p[i] + k_0[i]                        \
-    + s_1(vf(4,i)) + ch(vf(4,i),vf(5,i),vf(6,i));   \
-    vf(3,i) += vf(7,i);                             \
-    vf(7,i) += s_0(vf(0,i))+ maj(vf(0,i),vf(1,i),vf(2,i))
-
-#define v_cycle(i, j)                               \
-    vf(7,i) += hf(i) + k_0[i+j]                     \
-    + s_1(vf(4,i)) + ch(vf(4,i),vf(5,i),vf(6,i));   \
-    vf(3,i) += vf(7,i);                             \
-    vf(7,i) += s_0(vf(0,i))+ maj(vf(0,i),vf(1,i),vf(2,i))
-
-#define s_0(x)  (rotr64((x), 28) ^ rotr64((x), 34) ^ rotr64((x), 39))
-#define s_1(x)  (rotr64((x), 14) ^ rotr64((x), 18) ^ rotr64((x), 41))
-#define g_0(x)  (rotr64((x),  1) ^ rotr64((x),  8) ^ ((x) >>  7))
-#define g_1(x)  (rotr64((x), 19) ^ rotr64((x), 61) ^ ((x) >>  6))
+#define vh(n,i) v_h[(n - i) & 7]
+#define vl(n,i) v_l[(n - i) & 7]
+
+/* Message schedule, computed in place in the 16-word ring */
+#define hf(i) do {                                                    \
+    uint32_t xh_ = p_h[(i + 14) & 15], xl_ = p_l[(i + 14) & 15];      \
+    uint32_t yh_ = p_h[(i +  1) & 15], yl_ = p_l[(i +  1) & 15];      \
+    add64 (p_h[i & 15], p_l[i & 15], g_1h (xh_, xl_), g_1l (xh_, xl_)); \
+    add64 (p_h[i & 15], p_l[i & 15], p_h[(i + 9) & 15], p_l[(i + 9) & 15]); \
+    add64 (p_h[i & 15], p_l[i & 15], g_0h (yh_, yl_), g_0l (yh_, yl_)); \
+  } while (0)
+
+#define v_round(i, j) do {                                            \
+    uint32_t th_ = vh(7,i), tl_ = vl(7,i);                            \
+    add64 (th_, tl_, p_h[i & 15], p_l[i & 15]);                       \
+    add64 (th_, tl_, (uint32_t)(k_0[i+j] >> 32), (uint32_t)k_0[i+j]); \
+    add64 (th_, tl_, s_1h (vh(4,i), vl(4,i)), s_1l (vh(4,i), vl(4,i))); \
+    add64 (th_, tl_, ch (vh(4,i), vh(5,i), vh(6,i)),                  \
+	   ch (vl(4,i), vl(5,i), vl(6,i)));                           \
+    add64 (vh(3,i), vl(3,i), th_, tl_);                               \
+    add64 (th_, tl_, s_0h (vh(0,i), vl(0,i)), s_0l (vh(0,i), vl(0,i))); \
+    add64 (th_, tl_, maj (vh(0,i), vh(1,i), vh(2,i)),                 \
+	   maj (vl(0,i), vl(1,i), vl(2,i)));                          \
+    vh(7,i) = th_;  vl(7,i) = tl_;                                    \
+  } while (0)
+
+/*
+ * The message word is read as 64-bit (not through a pointer to 32-bit,
+ * which would violate strict aliasing with sha512_finish), and split.
+ */
+#define v_cycle0(i) do {                            \
+    uint64_t w_ = __builtin_bswap64 (ctx->wbuf[i]); \
+    p_h[i] = (uint32_t)(w_ >> 32);                  \
+    p_l[i] = (uint32_t)w_;                          \
+    v_round (i, 0);                                 \
+  } while (0)
+
+#define v_cycle(i, j) do {                          \
+    hf (i);                                         \
+    v_round (i, j);                                 \
+  } while (0)
+
 #define k_0     k512
 
 /* Taken from section 4.2.3 of [1].  */
@@ -107,10 +159,14 @@ void
 sha512_process (sha512_context *ctx)
 {
   uint32_t i;
-  uint64_t *p = ctx->wbuf;
-  uint64_t v[8];
+  uint32_t p_h[16], p_l[16];
+  uint32_t v_h[8], v_l[8];
 
-  memcpy (v, ctx->state, 8 * sizeof (uint64_t));
+  for (i = 0; i < 8; i++)
+    {
+      v_h[i] = ctx->state[i] >> 32;
+      v_l[i] = ctx->state[i];
+    }
 
   v_cycle0 ( 0); v_cycle0 ( 1); v_cycle0 ( 2); v_cycle0 ( 3);
   v_cycle0 ( 4); v_cycle0 ( 5); v_cycle0 ( 6); v_cycle0 ( 7);
@@ -125,14 +181,8 @@ sha512_process (sha512_context *ctx)
       v_cycle (12, i); v_cycle (13, i); v_cycle (14, i); v_cycle (15, i);
     }
 
-  ctx->state[0] += v[0];
-  ctx->state[1] += v[1];
-  ctx->state[2] += v[2];
-  ctx->state[3] += v[3];
-  ctx->state[4] += v[4];
-  ctx->state[5] += v[5];
-  ctx->state[6] += v[6];
-  ctx->state[7] += v[7];
+  for (i = 0; i < 8; i++)
+    ctx->state[i] += ((uint64_t)v_h[i] << 32) | v_l[i];
 }
 
 void
@@ -166,6 +166,7 @@ static uint8_t ccid_buffer[USB_BUF_SIZE];
 #define CCID_CMD_STATUS_TIMEEXT	0x80
 
 #define CCID_ERROR_XFR_OVERRUN	0xFC
+#define CCID_ERROR_ICC_MUTE	0xFE
 
 /*
  * Since command-byte is at offset 0,
@@ -173,6 +174,7 @@ static uint8_t ccid_buffer[USB_BUF_SIZE];
  */
 #define CCID_OFFSET_CMD_NOT_SUPPORTED 0
 #define CCID_OFFSET_DATA_LEN 1
+#define CCID_OFFSET_SLOT 5
 #define CCID_OFFSET_PARAM 8
 
 struct ccid_header {
@@ -192,6 +194,8 @@ struct ccid {
   uint32_t err        : 1;
   uint32_t tx_busy    : 1;
   uint32_t timeout_cnt: 3;
+  uint32_t card_swap  : 1;
+  uint32_t slot_powered : 3;	/* Bit for each slot */
 
   uint8_t *p;
   size_t len;
@@ -200,6 +204,7 @@ struct ccid {
 
   uint8_t sw1sw2[2];
   uint8_t chained_cls_ins_p1_p2[4];
+  uint8_t ext_len[2];		/* Extended Lc (or Le, when no Lc) */
 
   /* lower layer */
   struct ep_out *epo;
@@ -256,12 +261,25 @@ static void ccid_reset (struct ccid *c)
   c->a->expected_res_size = 0;
 }
 
+/*
+ * APDU state and CCID_BUFFER are shared by all slots.  They belong to
+ * the slot of last XfrBlock (or Secure) message, C->A->SLOT.  Reset
+ * them only when the message is for that slot.
+ */
+static void ccid_reset_slot (struct ccid *c)
+{
+  if (c->a->slot == c->ccid_header.slot)
+    ccid_reset (c);
+}
+
 static void ccid_init (struct ccid *c, struct ep_in *epi, struct ep_out *epo,
 		       struct apdu *a)
 {
   c->ccid_state = CCID_STATE_START;
   c->err = 0;
   c->tx_busy = 0;
+  c->card_swap = 0;
+  c->slot_powered = 0;
   c->state = APDU_STATE_WAIT_COMMAND;
   c->p = a->cmd_apdu_data;
   c->len = MAX_CMD_APDU_DATA_SIZE;
@@ -300,6 +318,7 @@ static void ccid_init (struct ccid *c, struct ep_in *epi, struct ep_out *epo,
 static void apdu_init (struct apdu *a)
 {
   a->seq = 0;			/* will be set by lower layer */
+  a->algo = ALGO_NONE;		/* will be set by upper layer */
   a->cmd_apdu_head = &ccid_buffer[0];
   a->cmd_apdu_data = &ccid_buffer[5];
   a->cmd_apdu_data_len = 0;	/* will be set by lower layer */
@@ -523,23 +542,48 @@ static int end_nomore_data (struct ep_out *epo, size_t orig_len)
 }
 
 
+/*
+ * Extended length APDU has zero at the place of Lc, then two bytes
+ * of Lc follows.  When it has no command data, the two bytes are Le.
+ */
+static int is_extended_apdu (struct ccid *c)
+{
+  return c->a->cmd_apdu_head[4] == 0;
+}
+
+/* Le of extended length: 0x0000 means 65536, which we can't represent. */
+static uint16_t ext_le (const uint8_t *p)
+{
+  uint16_t le = (p[0] << 8) | p[1];
+
+  return le == 0 ? 0xffff : le;
+}
+
 static int end_cmd_apdu_data (struct ep_out *epo, size_t orig_len)
 {
   struct ccid *c = (struct ccid *)epo->priv;
   size_t len = epo->cnt;
+  size_t head_size = CMD_APDU_HEAD_SIZE;
+  size_t lc = c->a->cmd_apdu_head[4];
+
+  if (is_extended_apdu (c))
+    {
+      head_size += 2;
+      lc = (c->ext_len[0] << 8) | c->ext_len[1];
+    }
 
   if (orig_len == USB_LL_BUF_SIZE
-      && CMD_APDU_HEAD_SIZE + len < c->ccid_header.data_len)
+      && head_size + len < c->ccid_header.data_len)
     /* more packet comes */
     return 1;
 
-  if (CMD_APDU_HEAD_SIZE + len != c->ccid_header.data_len)
+  if (head_size + len != c->ccid_header.data_len)
     goto error;
 
-  if (len == c->a->cmd_apdu_head[4])
+  if (len == lc)
     /* No Le field*/
     c->a->expected_res_size = 0;
-  else if (len == (size_t)c->a->cmd_apdu_head[4] + 1)
+  else if (!is_extended_apdu (c) && len == lc + 1)
     {
       /* it has Le field*/
       c->a->expected_res_size = epo->buf[-1];
@@ -547,6 +591,12 @@ static int end_cmd_apdu_data (struct ep_out *epo, size_t orig_len)
 	c->a->expected_res_size = 256;
       len--;
     }
+  else if (is_extended_apdu (c) && len == lc + 2)
+    {
+      /* it has extended Le field*/
+      c->a->expected_res_size = ext_le (epo->buf - 2);
+      len -= 2;
+    }
   else
     {
     error:
@@ -558,6 +608,23 @@ static int end_cmd_apdu_data (struct ep_out *epo, size_t orig_len)
   return 0;
 }
 
+/* Extended length APDU with no command data: CLA INS P1 P2 00 Le Le */
+static int end_cmd_apdu_ext_le (struct ep_out *epo, size_t orig_len)
+{
+  struct ccid *c = (struct ccid *)epo->priv;
+
+  (void)orig_len;
+  if (epo->cnt != 2 || CMD_APDU_HEAD_SIZE + 2 != c->ccid_header.data_len)
+    {
+      epo->err = 1;
+      return 0;
+    }
+
+  c->a->expected_res_size = ext_le (c->ext_len);
+  c->a->cmd_apdu_data_len = 0;
+  return 0;
+}
+
 
 static void nomore_data (struct ep_out *epo, size_t len)
 {
@@ -572,6 +639,18 @@ static void nomore_data (struct ep_out *epo, size_t len)
 
 #define INS_GET_RESPONSE 0xc0
 
+static void ccid_cmd_apdu_data_ext (struct ep_out *epo, size_t len)
+{
+  struct ccid *c = (struct ccid *)epo->priv;
+
+  (void)len;
+  epo->end_rx = end_cmd_apdu_data;
+  epo->buf = c->p;
+  epo->buf_len = c->len;
+  epo->cnt = 0;
+  epo->next_buf = nomore_data;
+}
+
 static void ccid_cmd_apdu_data (struct ep_out *epo, size_t len)
 {
   struct ccid *c = (struct ccid *)epo->priv;
@@ -613,6 +692,24 @@ static void ccid_cmd_apdu_data (struct ep_out *epo, size_t len)
 	}
     }
 
+  if (is_extended_apdu (c))
+    {
+      if (c->state == APDU_STATE_COMMAND_CHAINING
+	  || (c->a->cmd_apdu_head[0] & 0x10))
+	{
+	  /* Command chaining with extended length is not supported.  */
+	  nomore_data (epo, len);
+	  return;
+	}
+
+      epo->end_rx = end_cmd_apdu_ext_le;
+      epo->buf = c->ext_len;
+      epo->buf_len = 2;
+      epo->cnt = 0;
+      epo->next_buf = ccid_cmd_apdu_data_ext;
+      return;
+    }
+
   epo->end_rx = end_cmd_apdu_data;
   epo->buf = c->p;
   epo->buf_len = c->len;
@@ -624,11 +721,40 @@ static void ccid_abdata (struct ep_out *epo, size_t len)
 {
   struct ccid *c = (struct ccid *)epo->priv;
 
-  (void)len;
-  c->a->seq = c->ccid_header.seq;
-  if (c->ccid_header.msg_type == CCID_XFR_BLOCK)
+  if (c->ccid_state != CCID_STATE_WAIT
+      || c->ccid_header.slot > CCID_MAX_SLOT_INDEX
+      || ((c->ccid_header.msg_type == CCID_XFR_BLOCK
+	   || c->ccid_header.msg_type == CCID_SECURE)
+	  && !(c->slot_powered & (1 << c->ccid_header.slot))))
+    {
+      /*
+       * This message will be rejected.  Don't let its data overwrite
+       * command or response in CCID_BUFFER.
+       */
+      nomore_data (epo, len);
+      return;
+    }
+
+  if (c->ccid_header.msg_type == CCID_XFR_BLOCK
+      || c->ccid_header.msg_type == CCID_SECURE)
     {
+      if (c->a->slot != c->ccid_header.slot)
+	{
+	  /*
+	   * APDU state (command chaining or GET RESPONSE) is for
+	   * another slot.  Discard it, and start handling new one.
+	   */
+	  c->state = APDU_STATE_WAIT_COMMAND;
+	  c->p = c->a->cmd_apdu_data;
+	  c->len = MAX_CMD_APDU_DATA_SIZE;
+	  c->a->cmd_apdu_data_len = 0;
+	}
       c->a->seq = c->ccid_header.seq;
+      c->a->slot = c->ccid_header.slot;
+    }
+
+  if (c->ccid_header.msg_type == CCID_XFR_BLOCK)
+    {
       epo->end_rx = end_cmd_apdu_head;
       epo->buf = c->a->cmd_apdu_head;
       epo->buf_len = 5;
@@ -808,11 +934,12 @@ static void ccid_error (struct ccid *c, int offset)
   ccid_reply[2] = 0x00;
   ccid_reply[3] = 0x00;
   ccid_reply[4] = 0x00;
-  ccid_reply[5] = 0x00;	/* Slot */
+  ccid_reply[5] = c->ccid_header.slot;
   ccid_reply[CCID_MSG_SEQ_OFFSET] = c->ccid_header.seq;
   if (c->ccid_state == CCID_STATE_NOCARD)
     ccid_reply[CCID_MSG_STATUS_OFFSET] = 2; /* 2: No ICC present */
-  else if (c->ccid_state == CCID_STATE_START)
+  else if (c->ccid_state == CCID_STATE_START
+	   || !(c->slot_powered & (1 << c->ccid_header.slot)))
     /* 1: ICC present but not activated */
     ccid_reply[CCID_MSG_STATUS_OFFSET] = 1;
   else
@@ -857,13 +984,14 @@ ccid_power_on (struct ccid *c)
     c->application = chopstx_create (PRIO_GPG, STACK_ADDR_GPG,
 				     STACK_SIZE_GPG, openpgp_card_thread,
 				     (void *)&c->ccid_comm);
+  c->slot_powered |= (1 << c->ccid_header.slot);
 
   p[0] = CCID_DATA_BLOCK_RET;
   p[1] = size_atr;
   p[2] = 0x00;
   p[3] = 0x00;
   p[4] = 0x00;
-  p[5] = 0x00;	/* Slot */
+  p[5] = c->ccid_header.slot;
   p[CCID_MSG_SEQ_OFFSET] = c->ccid_header.seq;
   p[CCID_MSG_STATUS_OFFSET] = 0x00;
   p[CCID_MSG_ERROR_OFFSET] = 0x00;
@@ -918,11 +1046,12 @@ ccid_send_status (struct ccid *c)
   ccid_reply[2] = 0x00;
   ccid_reply[3] = 0x00;
   ccid_reply[4] = 0x00;
-  ccid_reply[5] = 0x00;	/* Slot */
+  ccid_reply[5] = c->ccid_header.slot;
   ccid_reply[CCID_MSG_SEQ_OFFSET] = c->ccid_header.seq;
   if (c->ccid_state == CCID_STATE_NOCARD)
     ccid_reply[CCID_MSG_STATUS_OFFSET] = 2; /* 2: No ICC present */
-  else if (c->ccid_state == CCID_STATE_START)
+  else if (c->ccid_state == CCID_STATE_START
+	   || !(c->slot_powered & (1 << c->ccid_header.slot)))
     /* 1: ICC present but not activated */
     ccid_reply[CCID_MSG_STATUS_OFFSET] = 1;
   else
@@ -951,6 +1080,24 @@ ccid_send_status (struct ccid *c)
 static enum ccid_state
 ccid_power_off (struct ccid *c)
 {
+  c->slot_powered &= ~(1 << c->ccid_header.slot);
+  if (c->slot_powered)
+    {
+      /*
+       * Other slots are still in use, keep the OpenPGP thread, but
+       * reset the state of the identity of this slot.
+       */
+      if (c->application)
+	{
+	  gpg_request_slot_reset (c->ccid_header.slot);
+	  eventflag_signal (&c->openpgp_comm, EV_SLOT_POWER_OFF);
+	}
+      ccid_send_status (c);
+      DEBUG_INFO ("OFF\r\n");
+      c->tx_busy = 1;
+      return c->ccid_state;
+    }
+
   if (c->application)
     {
       eventflag_signal (&c->openpgp_comm, EV_EXIT);
@@ -982,7 +1129,7 @@ ccid_send_data_block_internal (struct ccid *c, uint8_t status, uint8_t error)
   p[2] = (len >> 8)& 0xFF;
   p[3] = (len >> 16)& 0xFF;
   p[4] = (len >> 24)& 0xFF;
-  p[5] = 0x00;	/* Slot */
+  p[5] = c->a->slot;
   p[CCID_MSG_SEQ_OFFSET] = c->a->seq;
   p[CCID_MSG_STATUS_OFFSET] = status;
   p[CCID_MSG_ERROR_OFFSET] = error;
@@ -1109,7 +1256,7 @@ ccid_send_data_block_0x9000 (struct ccid *c)
   p[2] = (len >> 8)& 0xFF;
   p[3] = (len >> 16)& 0xFF;
   p[4] = (len >> 24)& 0xFF;
-  p[5] = 0x00;	/* Slot */
+  p[5] = c->a->slot;
   p[CCID_MSG_SEQ_OFFSET] = c->a->seq;
   p[CCID_MSG_STATUS_OFFSET] = 0;
   p[CCID_MSG_ERROR_OFFSET] = 0;
@@ -1152,7 +1299,7 @@ ccid_send_data_block_gr (struct ccid *c, size_t chunk_len)
   p[2] = (len >> 8)& 0xFF;
   p[3] = (len >> 16)& 0xFF;
   p[4] = (len >> 24)& 0xFF;
-  p[5] = 0x00;	/* Slot */
+  p[5] = c->a->slot;
   p[CCID_MSG_SEQ_OFFSET] = c->a->seq;
   p[CCID_MSG_STATUS_OFFSET] = 0;
   p[CCID_MSG_ERROR_OFFSET] = 0;
@@ -1254,7 +1401,7 @@ ccid_send_params (struct ccid *c)
   p[2] = 0;
   p[3] = 0;
   p[4] = 0;
-  p[5] = 0x00;	/* Slot */
+  p[5] = c->ccid_header.slot;
   p[CCID_MSG_SEQ_OFFSET] = c->ccid_header.seq;
   p[CCID_MSG_STATUS_OFFSET] = 0;
   p[CCID_MSG_ERROR_OFFSET] = 0;
@@ -1289,9 +1436,30 @@ ccid_handle_data (struct ccid *c)
 {
   enum ccid_state next_state = c->ccid_state;
 
-  if (c->err != 0)
+  if (c->ccid_header.slot > CCID_MAX_SLOT_INDEX)
+    {
+      DEBUG_INFO ("ERR0S\r\n");
+      c->ccid_header.slot = 0;
+      ccid_error (c, CCID_OFFSET_SLOT);
+      return next_state;
+    }
+
+  if ((c->ccid_header.msg_type == CCID_XFR_BLOCK
+       || c->ccid_header.msg_type == CCID_SECURE)
+      && !(c->slot_powered & (1 << c->ccid_header.slot)))
     {
-      ccid_reset (c);
+      DEBUG_INFO ("ERR0P\r\n");
+      ccid_error (c, CCID_ERROR_ICC_MUTE);
+      return next_state;
+    }
+
+  /* While executing, a message with data is rejected below.  */
+  if (c->err != 0
+      && c->ccid_state != CCID_STATE_EXECUTE
+      && c->ccid_state != CCID_STATE_ACK_REQUIRED_0
+      && c->ccid_state != CCID_STATE_ACK_REQUIRED_1)
+    {
+      ccid_reset_slot (c);
       ccid_error (c, CCID_OFFSET_DATA_LEN);
       return next_state;
     }
@@ -1330,12 +1498,12 @@ ccid_handle_data (struct ccid *c)
       if (c->ccid_header.msg_type == CCID_POWER_ON)
 	{
 	  /* Not in the spec., but pcscd/libccid */
-	  ccid_reset (c);
+	  ccid_reset_slot (c);
 	  next_state = ccid_power_on (c);
 	}
       else if (c->ccid_header.msg_type == CCID_POWER_OFF)
 	{
-	  ccid_reset (c);
+	  ccid_reset_slot (c);
 	  next_state = ccid_power_off (c);
 	}
       else if (c->ccid_header.msg_type == CCID_SLOT_STATUS)
@@ -1541,12 +1709,36 @@ ccid_card_change_signal (int how)
 {
   struct ccid *c = &ccid;
 
-  if (how == CARD_CHANGE_TOGGLE
+  if (how == CARD_CHANGE_SWAP && c->ccid_state != CCID_STATE_NOCARD)
+    {
+      c->card_swap = 1;
+      eventflag_signal (&c->ccid_comm, EV_CARD_CHANGE);
+    }
+  else if (how == CARD_CHANGE_TOGGLE
       || (c->ccid_state == CCID_STATE_NOCARD && how == CARD_CHANGE_INSERT)
       || (c->ccid_state != CCID_STATE_NOCARD && how == CARD_CHANGE_REMOVE))
     eventflag_signal (&c->ccid_comm, EV_CARD_CHANGE);
 }
 
+/*
+ * Switch identity, called by HID report in the CCID thread.  When the
+ * OpenPGP thread is running, it's done by that thread between
+ * commands.
+ */
+void
+ccid_set_identity (uint8_t id)
+{
+  struct ccid *c = &ccid;
+
+  if (c->application)
+    {
+      gpg_request_identity (id);
+      eventflag_signal (&c->openpgp_comm, EV_SET_IDENTITY);
+    }
+  else if (flash_set_identity (id) == 0)
+    ccid_card_change_signal (CARD_CHANGE_SWAP);
+}
+
 
 #ifdef GNU_LINUX_EMULATION
 static uint8_t endp2_tx_buf[2];
@@ -1559,10 +1751,11 @@ ccid_notify_slot_change (struct ccid *c)
   uint8_t msg;
   uint8_t notification[2];
 
+  /* All slots are changed: bit 2N+1 for change, bit 2N for presence.  */
   if (c->ccid_state == CCID_STATE_NOCARD)
-    msg = 0x02;
+    msg = 0x2a;
   else
-    msg = 0x03;
+    msg = 0x3f;
 
   notification[0] = NOTIFY_SLOT_CHANGE;
   notification[1] = msg;
@@ -1578,6 +1771,100 @@ ccid_notify_slot_change (struct ccid *c)
 
 #define USB_CCID_TIMEOUT (1950*1000)
 
+/*
+ * History of execution time, to schedule time extension.
+ *
+ * An operation class is identified by CCID slot (which selects the
+ * identity), INS and P1 of command.  Key algorithm reported by upper
+ * layer is recorded too; when it changes (by key generation or
+ * import), the history of the class starts again.
+ *
+ * For a class which is known to finish quickly, the first time
+ * extension is deferred until its expected time has passed, so that
+ * the result can be sent as soon as it's ready.  Otherwise, time
+ * extension is sent at once, like before.
+ */
+#define EXEC_HIST_NUM 8
+#define EXEC_MARGIN (5*1000)	/* usec */
+
+struct exec_hist {
+  uint8_t slot;
+  uint8_t ins;
+  uint8_t p1;
+  uint8_t algo;
+  uint32_t usec;		/* Average time, 0 when unused */
+};
+
+static struct exec_hist exec_hist[EXEC_HIST_NUM];
+static uint8_t exec_hist_next;	/* Entry to be replaced next */
+static struct exec_hist exec_cur; /* Class of executing command */
+
+static struct exec_hist *
+exec_hist_lookup (void)
+{
+  int i;
+
+  for (i = 0; i < EXEC_HIST_NUM; i++)
+    if (exec_hist[i].usec && exec_hist[i].slot == exec_cur.slot
+	&& exec_hist[i].ins == exec_cur.ins && exec_hist[i].p1 == exec_cur.p1)
+      return &exec_hist[i];
+
+  return NULL;
+}
+
+/*
+ * Start execution of command.  Return timeout for the first time
+ * extension.
+ */
+static uint32_t
+exec_start (struct apdu *a)
+{
+  struct exec_hist *h;
+  uint32_t usec;
+
+  exec_cur.slot = a->slot;
+  exec_cur.ins = a->cmd_apdu_head[1];
+  exec_cur.p1 = a->cmd_apdu_head[2];
+  a->algo = ALGO_NONE;
+
+  h = exec_hist_lookup ();
+  if (h == NULL)
+    return 0;
+
+  usec = h->usec + h->usec / 4 + EXEC_MARGIN;
+  if (usec >= USB_CCID_TIMEOUT)
+    return 0;
+
+  return usec;
+}
+
+static void
+exec_finish (struct apdu *a, uint32_t usec)
+{
+  struct exec_hist *h = exec_hist_lookup ();
+
+  if (usec == 0)
+    usec = 1;
+
+  if (h == NULL)
+    {
+      h = &exec_hist[exec_hist_next];
+      exec_hist_next = (exec_hist_next + 1) % EXEC_HIST_NUM;
+      h->slot = exec_cur.slot;
+      h->ins = exec_cur.ins;
+      h->p1 = exec_cur.p1;
+      h->algo = a->algo;
+      h->usec = usec;
+    }
+  else if (h->algo != a->algo)
+    {
+      h->algo = a->algo;
+      h->usec = usec;
+    }
+  else
+    h->usec = (h->usec * 3 + usec) / 4;
+}
+
 #define GPG_THREAD_TERMINATED 0xffff
 #define GPG_ACK_TIMEOUT 0x6600
 
@@ -1727,6 +2014,7 @@ void *
 ccid_thread (void *arg)
 {
   uint32_t timeout;
+  uint32_t exec_usec = 0;
   struct usb_dev dev;
   struct ccid *c = &ccid;
   uint32_t *timeout_p;
@@ -1775,6 +2063,7 @@ ccid_thread (void *arg)
   while (1)
     {
       eventmask_t m;
+      uint32_t armed;
 
       if (!c->tx_busy && bDeviceState == USB_DEVICE_STATE_CONFIGURED)
 	timeout_p = &timeout;
@@ -1783,12 +2072,15 @@ ccid_thread (void *arg)
 
       eventflag_set_mask (&c->ccid_comm, c->tx_busy ? EV_TX_FINISHED : ~0);
 
+      armed = timeout;
 #ifdef ACKBTN_SUPPORT
       chopstx_poll (timeout_p, CCID_POLL_NUM - (c->tx_busy || !ackbtn_active),
 		    ccid_poll);
 #else
       chopstx_poll (timeout_p, CCID_POLL_NUM, ccid_poll);
 #endif
+      if (timeout_p)
+	exec_usec += armed - timeout;
 
       if (usb_intr.ready)
 	{
@@ -1834,7 +2126,18 @@ ccid_thread (void *arg)
 
       if (m == EV_CARD_CHANGE)
 	{
-	  if (c->ccid_state == CCID_STATE_NOCARD)
+	  if (c->card_swap)
+	    {
+	      /*
+	       * Swapped!  The card stays, but it needs power on again,
+	       * so that the host knows it's another card.
+	       */
+	      c->card_swap = 0;
+	      c->slot_powered = 0;
+	      if (c->ccid_state != CCID_STATE_NOCARD)
+		c->ccid_state = CCID_STATE_START;
+	    }
+	  else if (c->ccid_state == CCID_STATE_NOCARD)
 	    /* Inserted!  */
 	    c->ccid_state = CCID_STATE_START;
 	  else
@@ -1847,19 +2150,29 @@ ccid_thread (void *arg)
 		}
 
 	      c->ccid_state = CCID_STATE_NOCARD;
+	      c->slot_powered = 0;
 	    }
 
 	  ccid_notify_slot_change (c);
 	}
       else if (m == EV_RX_DATA_READY)
 	{
+	  int was_executing = (c->ccid_state == CCID_STATE_EXECUTE);
+
 	  c->ccid_state = ccid_handle_data (c);
-	  timeout = 0;
+	  if (!was_executing && c->ccid_state == CCID_STATE_EXECUTE)
+	    {
+	      timeout = exec_start (c->a);
+	      exec_usec = 0;
+	    }
+	  else
+	    timeout = 0;
 	  c->timeout_cnt = 0;
 	}
       else if (m == EV_EXEC_FINISHED)
 	if (c->ccid_state == CCID_STATE_EXECUTE)
 	  {
+	    exec_finish (c->a, exec_usec);
 #ifdef ACKBTN_SUPPORT
 	  exec_done:
 #endif
@@ -5,6 +5,7 @@
 
 #define CCID_NUM_INTERFACES 1
 #define CCID_INTERFACE 0
+#define CCID_MAX_SLOT_INDEX 2	/* A slot for each identity */
 #ifdef HID_CARD_CHANGE_SUPPORT
 #define HID_NUM_INTERFACES 1
 #define HID_INTERFACE 1
@@ -362,9 +362,9 @@ usb_setup (struct usb_dev *dev)
           if((arg->value&0xff)>=0x10){
               uint8_t lowbyte=arg->value&0xff;
               if(lowbyte>=0x10 && lowbyte<0x13){
-                  flash_set_identity(lowbyte-0x10);
-                  /* if we end up here, identity change failed because we're setting to the current identity
-                   * if that happens, proceed as below and reply with a report/ack */
+                  ccid_set_identity(lowbyte-0x10);
+                  /* the identity is switched without reset, and the host sees a card change;
+                   * proceed as below and reply with a report/ack */
               }
           }
 	      /* Received LED set request */
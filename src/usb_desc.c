@@ -129,7 +129,7 @@ static const uint8_t config_desc[] = {
   54,			  /* bLength: */
   0x21,			  /* bDescriptorType: USBDESCR_ICC */
   0x10, 0x01,		  /* bcdCCID: revision 1.1 (of CCID) */
-  0,			  /* bMaxSlotIndex: */
+  CCID_MAX_SLOT_INDEX,	  /* bMaxSlotIndex: */
   1,			  /* bVoltageSupport: 5V-only */
   0x02, 0, 0, 0,	  /* dwProtocols: T=1 */
   0xa0, 0x0f, 0, 0,	  /* dwDefaultClock: 4000 */
@@ -141,9 +141,9 @@ static const uint8_t config_desc[] = {
   0xfe, 0, 0, 0,	  /* dwMaxIFSD: 254 */
   0, 0, 0, 0,		  /* dwSynchProtocols: 0 */
   0, 0, 0, 0,		  /* dwMechanical: 0 */
-  0x7a, 0x04, 0x02, 0x00, /* dwFeatures:
-			   *  Short and extended APDU level: 0x40000 ----
-			   *  Short APDU level             : 0x20000  *
+  0x7a, 0x04, 0x04, 0x00, /* dwFeatures:
+			   *  Short and extended APDU level: 0x40000 ---- *
+			   *  Short APDU level             : 0x20000
 			   *  (ICCD?)                      : 0x00800 ----
 			   *  Automatic IFSD               : 0x00400   *
 			   *  NAD value other than 0x00    : 0x00200
@@ -156,7 +156,7 @@ static const uint8_t config_desc[] = {
 			   *  Auto activaction of ICC	   : 0x00004
 			   *  Automatic conf. based on ATR : 0x00002  *
 			   */
-  0x0f, 0x01, 0, 0,	  /* dwMaxCCIDMessageLength: 271 */
+  0x10, 0x08, 0, 0,	  /* dwMaxCCIDMessageLength: 2064 */
   0xff,			  /* bClassGetResponse: 0xff */
   0x00,			  /* bClassEnvelope: 0 */
   0, 0,			  /* wLCDLayout: 0 */
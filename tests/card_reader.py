@@ -214,6 +214,23 @@ class CardReader(object):
         self.increment_seq()
         return self.ccid_get_result()
 
+    def ccid_send_to_slot(self, msg_type, slot, data=b"", rsv=0, param=0):
+        """
+        Send a CCID message to SLOT, and return the reply as
+        (slot, status, error, data), after time extension.
+        """
+        msg = ccid_compose(msg_type, self.__seq, slot=slot, rsv=rsv,
+                           param=param, data=data)
+        self.__dev.write(self.__bulkout, msg, self.__timeout)
+        self.increment_seq()
+        while True:
+            msg = self.__dev.read(self.__bulkin, 1024, self.__timeout)
+            if len(msg) < 10:
+                raise ValueError("ccid_send_to_slot")
+            if msg[7] != 0x80:
+                break
+        return (msg[5], msg[7], msg[8], msg[10:].tobytes())
+
     def ccid_send_cmd(self, data):
         status, chain, data_rcv = self.ccid_send_data_block(data)
         if chain == 0:
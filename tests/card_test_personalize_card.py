@@ -20,6 +20,7 @@ You should have received a copy of the GNU General Public License
 along with this program.  If not, see <http://www.gnu.org/licenses/>.
 """
 
+import pytest
 from struct import pack
 from re import match, DOTALL
 from util import *
@@ -252,6 +253,88 @@ class Test_Card_Personalize_Card(object):
         c = get_data_object(card, 0x7a)
         assert c == b'\x93\x03\x00\x00\x02'
 
+    def test_sign_batch_0(self, card):
+        if not card.is_gnuk:
+            pytest.skip("Gnuk only feature")
+        digestinfo0 = rsa_keys.compute_digestinfo(PLAIN_TEXT0)
+        digestinfo1 = rsa_keys.compute_digestinfo(PLAIN_TEXT1)
+        data = pack('>B', len(digestinfo0)) + digestinfo1 + digestinfo0
+        r = card.cmd_pso_batch(0x9e, 0x9a, data)
+        sig1 = rsa_keys.compute_signature(0, digestinfo1)
+        sig0 = rsa_keys.compute_signature(0, digestinfo0)
+        assert r == sig1.to_bytes(256, byteorder='big') \
+            + sig0.to_bytes(256, byteorder='big')
+
+    def test_ds_counter_2(self, card):
+        if not card.is_gnuk:
+            pytest.skip("Gnuk only feature")
+        c = get_data_object(card, 0x7a)
+        assert c == b'\x93\x03\x00\x00\x04'
+
+    def test_sign_batch_zero_digest_len(self, card):
+        if not card.is_gnuk:
+            pytest.skip("Gnuk only feature")
+        digestinfo = rsa_keys.compute_digestinfo(PLAIN_TEXT0)
+        try:
+            r = card.cmd_pso_batch(0x9e, 0x9a, b'\x00' + digestinfo)
+        except ValueError as e:
+            r = e.args[0]
+        assert r == "6985"
+
+    def test_sign_batch_wrong_length(self, card):
+        if not card.is_gnuk:
+            pytest.skip("Gnuk only feature")
+        digestinfo = rsa_keys.compute_digestinfo(PLAIN_TEXT0)
+        data = pack('>B', len(digestinfo)) + digestinfo + digestinfo[:-1]
+        try:
+            r = card.cmd_pso_batch(0x9e, 0x9a, data)
+        except ValueError as e:
+            r = e.args[0]
+        assert r == "6985"
+
+    def test_sign_batch_too_many(self, card):
+        if not card.is_gnuk:
+            pytest.skip("Gnuk only feature")
+        digestinfo = rsa_keys.compute_digestinfo(PLAIN_TEXT0)
+        # Three RSA-2048 signatures don't fit in the response buffer
+        data = pack('>B', len(digestinfo)) + digestinfo * 3
+        try:
+            r = card.cmd_pso_batch(0x9e, 0x9a, data)
+        except ValueError as e:
+            r = e.args[0]
+        assert r == "6700"
+
+    def test_pw1_status_put_lifetime_0(self, card):
+        if not card.is_gnuk:
+            pytest.skip("Gnuk only feature")
+        r = card.cmd_put_data(0x00, 0xc4, b"\x00")
+        assert r
+
+    def test_sign_batch_lifetime_0(self, card):
+        if not card.is_gnuk:
+            pytest.skip("Gnuk only feature")
+        v = card.verify(1, PW1_TEST4)
+        assert v
+        digestinfo = rsa_keys.compute_digestinfo(PLAIN_TEXT0)
+        data = pack('>B', len(digestinfo)) + digestinfo * 2
+        try:
+            r = card.cmd_pso_batch(0x9e, 0x9a, data)
+        except ValueError as e:
+            r = e.args[0]
+        assert r == "6982"
+
+    def test_pw1_status_put_lifetime_1(self, card):
+        if not card.is_gnuk:
+            pytest.skip("Gnuk only feature")
+        r = card.cmd_put_data(0x00, 0xc4, b"\x01")
+        assert r
+
+    def test_ds_counter_3(self, card):
+        if not card.is_gnuk:
+            pytest.skip("Gnuk only feature")
+        c = get_data_object(card, 0x7a)
+        assert c == b'\x93\x03\x00\x00\x04'
+
     def test_sign_auth_0(self, card):
         digestinfo = rsa_keys.compute_digestinfo(PLAIN_TEXT0)
         r = card.cmd_internal_authenticate(digestinfo)
@@ -275,3 +358,53 @@ class Test_Card_Personalize_Card(object):
         ciphertext = rsa_keys.encrypt(1, PLAIN_TEXT1)
         r = card.cmd_pso(0x80, 0x86, ciphertext)
         assert r == PLAIN_TEXT1
+
+    def test_decrypt_batch_0(self, card):
+        if not card.is_gnuk:
+            pytest.skip("Gnuk only feature")
+        # Without the padding indicator byte
+        ciphertext0 = rsa_keys.encrypt(1, PLAIN_TEXT0)[1:]
+        ciphertext1 = rsa_keys.encrypt(1, PLAIN_TEXT1)[1:]
+        r = card.cmd_pso_batch(0x80, 0x86, ciphertext1 + ciphertext0)
+        assert r == pack('>H', len(PLAIN_TEXT1)) + PLAIN_TEXT1 \
+            + pack('>H', len(PLAIN_TEXT0)) + PLAIN_TEXT0
+
+    def test_decrypt_batch_wrong_length(self, card):
+        if not card.is_gnuk:
+            pytest.skip("Gnuk only feature")
+        ciphertext = rsa_keys.encrypt(1, PLAIN_TEXT0)
+        try:
+            r = card.cmd_pso_batch(0x80, 0x86, ciphertext)
+        except ValueError as e:
+            r = e.args[0]
+        assert r == "6985"
+
+    def test_verify_pw1_wrong_keeps_key(self, card):
+        if not card.is_gnuk:
+            pytest.skip("Gnuk only feature")
+        try:
+            r = card.verify(2, PW1_TEST1)
+        except ValueError as e:
+            r = e.args[0]
+        assert r == "6982"
+        # Wrong passphrase doesn't touch the key loaded already
+        ciphertext = rsa_keys.encrypt(1, PLAIN_TEXT0)
+        r = card.cmd_pso(0x80, 0x86, ciphertext)
+        assert r == PLAIN_TEXT0
+
+    def test_verify_pw1_deferred(self, card):
+        if not card.is_gnuk:
+            pytest.skip("Gnuk only feature")
+        v = card.verify(2, PW1_TEST4)
+        assert v
+        c = get_data_object(card, 0xc4)
+        assert c[4] == 3
+        # Keys are decrypted on their first use after VERIFY
+        digestinfo = rsa_keys.compute_digestinfo(PLAIN_TEXT1)
+        r = card.cmd_internal_authenticate(digestinfo)
+        sig = rsa_keys.compute_signature(2, digestinfo)
+        sig_bytes = sig.to_bytes(int((sig.bit_length()+7)/8), byteorder='big')
+        assert r == sig_bytes
+        ciphertext = rsa_keys.encrypt(1, PLAIN_TEXT1)
+        r = card.cmd_pso(0x80, 0x86, ciphertext)
+        assert r == PLAIN_TEXT1
@@ -43,3 +43,11 @@ class Test_Remove_Keys(object):
         if r:
             r = card.cmd_put_data(0x00, 0xc3, KEY_ATTRIBUTES_RSA2K)
         assert r
+
+    def test_rsa3k_keyattr_change(self, card):
+        r = card.cmd_put_data(0x00, 0xc1, KEY_ATTRIBUTES_RSA3K)
+        if r:
+            a = card.cmd_get_data(0x00, 0xc1)
+            assert a == KEY_ATTRIBUTES_RSA3K
+            r = card.cmd_put_data(0x00, 0xc1, KEY_ATTRIBUTES_RSA2K)
+        assert r
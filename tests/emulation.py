@@ -0,0 +1,101 @@
+"""
+emulation.py - run GNU/Linux emulation of Gnuk for a test
+
+Copyright (C) 2026 agent <agent@local>
+
+This file is a part of Gnuk, a GnuPG USB Token implementation.
+
+Gnuk is free software: you can redistribute it and/or modify it
+under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Gnuk is distributed in the hope that it will be useful, but WITHOUT
+ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public
+License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+Some tests run the emulation by themselves, with their own flash
+image, and restart it.  Specify the command to run the emulation by
+GNUK_EMULATOR, and the command to attach it by GNUK_USBIP_ATTACH,
+like:
+
+    $ GNUK_EMULATOR="../src/build/gnuk --vidpid=234b:0000" \\
+      GNUK_USBIP_ATTACH="sudo usbip attach -r 127.0.0.1 -b 1-1" \\
+      py.test-3 -x test_write_behind_crash.py
+
+Without GNUK_EMULATOR, those tests are skipped.
+"""
+
+import os
+import shlex
+import subprocess
+import time
+
+import pytest
+from card_reader import get_ccid_device
+from openpgp_card import OpenPGP_Card
+
+GNUK_EMULATOR = os.environ.get("GNUK_EMULATOR")
+GNUK_USBIP_ATTACH = os.environ.get("GNUK_USBIP_ATTACH",
+                                   "sudo usbip attach -r 127.0.0.1 -b 1-1")
+
+# Environment variables which change behavior of the emulation for test
+EMULATION_TEST_VARS = [ "GNUK_EXIT_BEFORE_WRITE_BEHIND",
+                        "GNUK_KEYSTRING_WITHOUT_VERIFIER" ]
+
+skip_unless_emulator = pytest.mark.skipif(not GNUK_EMULATOR,
+                                          reason="GNUK_EMULATOR is not specified")
+
+class Emulation(object):
+    def __init__(self, flash_image):
+        self.flash_image = flash_image
+        self.proc = None
+
+    def start(self, *test_vars):
+        env = dict(os.environ)
+        for var in EMULATION_TEST_VARS:
+            env.pop(var, None)
+        for var in test_vars:
+            env[var] = "1"
+        self.proc = subprocess.Popen(shlex.split(GNUK_EMULATOR)
+                                     + [self.flash_image], env=env)
+        time.sleep(1)
+        subprocess.run(shlex.split(GNUK_USBIP_ATTACH), check=True)
+        for i in range(10):
+            try:
+                reader = get_ccid_device()
+                break
+            except ValueError:
+                time.sleep(1)
+        else:
+            raise ValueError("No CCID device present")
+        card = OpenPGP_Card(reader)
+        card.cmd_select_openpgp()
+        card.configure_with_kdf()
+        return card
+
+    def stop(self):
+        if self.proc.poll() is None:
+            self.proc.terminate()
+        self.proc.wait()
+        # Wait until the device is detached
+        time.sleep(2)
+
+    def wait_exit(self):
+        assert self.proc.wait(10) != 0
+        time.sleep(2)
+
+    def read_flash_image(self):
+        with open(self.flash_image, "rb") as f:
+            return f.read()
+
+@pytest.fixture
+def emulation(tmp_path):
+    emu = Emulation(str(tmp_path / "flash-image"))
+    yield emu
+    if emu.proc:
+        emu.stop()
@@ -62,6 +62,9 @@ class OpenPGP_Card(object):
         self.is_gnuk = (reader.get_string(2) in ["Gnuk Token", "Nitrokey Start"])
         self.is_emulated_gnuk = (reader.get_string(3)[-8:] == "EMULATED")
 
+    def get_reader(self):
+        return self.__reader
+
     def configure_with_kdf(self):
         kdf_data = self.cmd_get_data(0x00, 0xf9)
         if kdf_data != b"":
@@ -316,6 +319,18 @@ class OpenPGP_Card(object):
                     raise ValueError("%02x%02x" % (sw[0], sw[1]))
                 return self.cmd_get_response(sw[1])
 
+    def cmd_pso_batch(self, p1, p2, data):
+        # Gnuk specific: PSO in batch, by an extended APDU
+        cmd_data = pack('>BBBBBH', 0x00, 0x2b, p1, p2, 0, len(data)) \
+            + data + pack('>H', 0)
+        r = self.__reader.send_cmd(cmd_data)
+        if len(r) < 2:
+            raise ValueError(r)
+        sw = r[-2:]
+        if not (sw[0] == 0x90 and sw[1] == 0x00):
+            raise ValueError("%02x%02x" % (sw[0], sw[1]))
+        return r[0:-2]
+
     def cmd_internal_authenticate(self, data):
         if self.__reader.is_tpdu_reader():
             cmd_data = iso7816_compose(0x88, 0, 0, data, le=256)
@@ -150,11 +150,13 @@ def test_historical_bytes(card):
     assert h == b'\x001\xc5s\xc0\x01@\x05\x90\x00' or \
            h == b'\x00\x31\x84\x73\x80\x01\x80\x00\x90\x00' or \
            h == b'\x00\x31\x84\x73\x80\x01\x80\x05\x90\x00' or \
+           h == b'\x00\x31\x84\x73\x80\x01\xc0\x00\x90\x00' or \
+           h == b'\x00\x31\x84\x73\x80\x01\xc0\x05\x90\x00' or \
            h == b'\x00\x31\xf5\x73\xc0\x01\x60\x05\x90\x00'
 
 def test_extended_capabilities(card):
     a = get_data_object(card, 0xc0)
-    assert a == None or match(b'[\x70\x74\x75]\x00\x00\x20[\x00\x08]\x00\x00\xff\x01\x00', a)
+    assert a == None or match(b'[\x70\x74\x75]\x00\x00\x20[\x00\x08]\x00(\x00\xff\x01\x00|\x02\x1c(\x08\x04|\x02\x0e))', a)
 
 def test_algorithm_attributes_1(card):
     a = get_data_object(card, 0xc1)
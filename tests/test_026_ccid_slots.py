@@ -0,0 +1,119 @@
+"""
+test_026_ccid_slots.py - test CCID slots for identities
+
+Copyright (C) 2026 agent <agent@local>
+
+This file is a part of Gnuk, a GnuPG USB Token implementation.
+
+Gnuk is free software: you can redistribute it and/or modify it
+under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Gnuk is distributed in the hope that it will be useful, but WITHOUT
+ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public
+License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+"""
+
+from skip_gnuk_only_tests import *
+
+from card_const import *
+from constants_for_test import *
+
+CCID_POWER_ON=0x62
+CCID_POWER_OFF=0x63
+CCID_XFR_BLOCK=0x6f
+
+CCID_CMD_STATUS_ERROR=0x40
+CCID_ERROR_ICC_MUTE=0xfe
+
+SELECT_OPENPGP=b"\x00\xa4\x04\x00\x06\xd2\x76\x00\x01\x24\x01"
+VERIFY_STATUS_PW3=b"\x00\x20\x00\x83"
+VERIFY_RESET_PW3=b"\x00\x20\xff\x83"
+
+def xfr(card, slot, apdu):
+    reader = card.get_reader()
+    r_slot, status, error, data = reader.ccid_send_to_slot(CCID_XFR_BLOCK,
+                                                           slot, apdu)
+    assert r_slot == slot
+    assert status == 0
+    return data
+
+def power_on(card, slot):
+    reader = card.get_reader()
+    r_slot, status, error, atr = reader.ccid_send_to_slot(CCID_POWER_ON,
+                                                          slot, rsv=2)
+    assert r_slot == slot
+    assert status == 0
+    assert atr[0] == 0x3b
+
+def test_power_on_other_slots(card):
+    power_on(card, 1)
+    power_on(card, 2)
+
+def test_select_in_each_slot(card):
+    for slot in range(3):
+        assert xfr(card, slot, SELECT_OPENPGP) == b"\x90\x00"
+
+def test_verify_is_per_identity(card):
+    if card.is_emulated_gnuk:
+        pytest.skip("Emulation has identity 0 only, for all slots")
+    assert card.verify(3, FACTORY_PASSPHRASE_PW3)
+    assert xfr(card, 0, VERIFY_STATUS_PW3) == b"\x90\x00"
+    assert xfr(card, 1, VERIFY_STATUS_PW3)[0] == 0x63
+    # Reset of the status by another slot doesn't affect slot 0
+    assert xfr(card, 1, VERIFY_RESET_PW3) == b"\x90\x00"
+    assert xfr(card, 0, VERIFY_STATUS_PW3) == b"\x90\x00"
+
+def power_off(card, slot):
+    reader = card.get_reader()
+    r_slot, status, error, data = reader.ccid_send_to_slot(CCID_POWER_OFF,
+                                                           slot)
+    assert r_slot == slot
+    assert status == 0x01 # ICC present, inactive
+
+def test_power_off_keeps_other_slot(card):
+    if card.is_emulated_gnuk:
+        pytest.skip("Emulation has identity 0 only, for all slots")
+    power_off(card, 2)
+    assert xfr(card, 0, VERIFY_STATUS_PW3) == b"\x90\x00"
+    power_on(card, 2)
+
+def test_xfr_to_unpowered_slot(card):
+    reader = card.get_reader()
+    power_off(card, 2)
+    r_slot, status, error, data = reader.ccid_send_to_slot(CCID_XFR_BLOCK, 2,
+                                                           SELECT_OPENPGP)
+    assert r_slot == 2
+    assert status == CCID_CMD_STATUS_ERROR | 0x01 # ICC present, inactive
+    assert error == CCID_ERROR_ICC_MUTE
+    power_on(card, 2)
+    assert xfr(card, 2, SELECT_OPENPGP) == b"\x90\x00"
+
+def test_get_response_on_other_slot(card):
+    # Application related data with Le=16, the rest by GET RESPONSE
+    r = xfr(card, 0, b"\x00\xca\x00\x6e\x10")
+    assert r[-2] == 0x61
+    assert len(r) == 16 + 2
+    # GET RESPONSE on slot 1 must not get data of slot 0
+    r = xfr(card, 1, b"\x00\xc0\x00\x00" + bytes([r[-1]]))
+    assert len(r) == 2
+    assert r != b"\x90\x00" and r[0] != 0x61
+    assert xfr(card, 0, SELECT_OPENPGP) == b"\x90\x00"
+
+def test_chaining_interrupted_by_other_slot(card):
+    # SELECT by name, sending AID in two parts by command chaining
+    assert xfr(card, 0, b"\x10\xa4\x04\x00\x03\xd2\x76\x00") == b"\x90\x00"
+    # A command on slot 1 is not appended to the chain of slot 0
+    assert xfr(card, 1, SELECT_OPENPGP) == b"\x90\x00"
+    # The chain of slot 0 has been discarded, only last part is there
+    assert xfr(card, 0, b"\x00\xa4\x04\x00\x03\x01\x24\x01") == b"\x6a\x82"
+    assert xfr(card, 0, SELECT_OPENPGP) == b"\x90\x00"
+
+def test_reset_pw3_status(card):
+    assert xfr(card, 0, VERIFY_RESET_PW3) == b"\x90\x00"
+    assert xfr(card, 0, VERIFY_STATUS_PW3)[0] == 0x63
@@ -0,0 +1,104 @@
+"""
+test_keystring_upgrade.py - test upgrade of keystring DO by VERIFY
+
+Copyright (C) 2026 agent <agent@local>
+
+This file is a part of Gnuk, a GnuPG USB Token implementation.
+
+Gnuk is free software: you can redistribute it and/or modify it
+under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Gnuk is distributed in the hope that it will be useful, but WITHOUT
+ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public
+License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+This test runs the GNU/Linux emulation by itself (see emulation.py).
+When GNUK_KEYSTRING_WITHOUT_VERIFIER is set in its environment, the
+emulation writes keystring DOs of PW1 and PW3 without the verifier, as
+older versions did.  Then, it's restarted without it, so that VERIFY
+adds the verifier.
+"""
+
+import pytest
+import rsa_keys
+from card_const import *
+from constants_for_test import *
+from emulation import *
+from util import *
+
+pytestmark = skip_unless_emulator
+
+def setup_card_by_older_version(emulation):
+    card = emulation.start("GNUK_KEYSTRING_WITHOUT_VERIFIER")
+    assert card.verify(3, FACTORY_PASSPHRASE_PW3)
+    assert card.cmd_put_data(0x00, 0xf9, KDF_FULL)
+    card.configure_with_kdf()
+    assert card.verify(3, FACTORY_PASSPHRASE_PW3)
+    assert card.change_passwd(3, FACTORY_PASSPHRASE_PW3, PW3_TEST0)
+    assert card.verify(3, PW3_TEST0)
+    t = rsa_keys.build_privkey_template(1, 0)
+    assert card.cmd_put_data_odd(0x3f, 0xff, t)
+    t = rsa_keys.build_privkey_template(2, 1)
+    assert card.cmd_put_data_odd(0x3f, 0xff, t)
+    assert card.change_passwd(1, FACTORY_PASSPHRASE_PW1, PW1_TEST0)
+    emulation.stop()
+
+def verify_and_stop(emulation, who, passwd):
+    card = emulation.start()
+    assert card.verify(who, passwd)
+    emulation.stop()
+    return emulation.read_flash_image()
+
+def sign(card):
+    digestinfo = rsa_keys.compute_digestinfo(PLAIN_TEXT0)
+    r = card.cmd_pso(0x9e, 0x9a, digestinfo)
+    sig = rsa_keys.compute_signature(0, digestinfo)
+    assert r == sig.to_bytes(256, byteorder='big')
+
+def decrypt(card):
+    ciphertext = rsa_keys.encrypt(1, PLAIN_TEXT0)
+    assert card.cmd_pso(0x80, 0x86, ciphertext) == PLAIN_TEXT0
+
+def test_upgrade_by_verify_pw1(emulation):
+    setup_card_by_older_version(emulation)
+    image0 = emulation.read_flash_image()
+    # First VERIFY writes keystring DO with verifier, only once
+    image1 = verify_and_stop(emulation, 2, PW1_TEST0)
+    assert image1 != image0
+    image2 = verify_and_stop(emulation, 1, PW1_TEST0)
+    assert image2 == image1
+
+    card = emulation.start()
+    with pytest.raises(ValueError) as e:
+        card.verify(2, PW1_TEST1)
+    assert "6982" in str(e.value)
+    assert card.verify(2, PW1_TEST0)
+    decrypt(card)
+    assert card.verify(1, PW1_TEST0)
+    sign(card)
+
+def test_upgrade_by_verify_pw3(emulation):
+    setup_card_by_older_version(emulation)
+    image0 = emulation.read_flash_image()
+    # First admin VERIFY writes keystring DO with verifier, only once
+    image1 = verify_and_stop(emulation, 3, PW3_TEST0)
+    assert image1 != image0
+    image2 = verify_and_stop(emulation, 3, PW3_TEST0)
+    assert image2 == image1
+
+    card = emulation.start()
+    with pytest.raises(ValueError) as e:
+        card.verify(3, PW3_TEST1)
+    assert "6982" in str(e.value)
+    assert card.verify(3, PW3_TEST0)
+    # Admin keystring is still good for key import
+    t = rsa_keys.build_privkey_template(3, 2)
+    assert card.cmd_put_data_odd(0x3f, 0xff, t)
+    assert card.verify(1, PW1_TEST0)
+    sign(card)
@@ -0,0 +1,98 @@
+"""
+test_write_behind_crash.py - test crash semantics of write-behind journal
+
+Copyright (C) 2026 agent <agent@local>
+
+This file is a part of Gnuk, a GnuPG USB Token implementation.
+
+Gnuk is free software: you can redistribute it and/or modify it
+under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Gnuk is distributed in the hope that it will be useful, but WITHOUT
+ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public
+License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+This test runs the GNU/Linux emulation by itself (see emulation.py).
+When GNUK_EXIT_BEFORE_WRITE_BEHIND is set in its environment, the
+emulation exits just before writing the pending updates of the
+write-behind journal to flash memory, as if power were lost after the
+response.
+"""
+
+import pytest
+import rsa_keys
+from card_const import *
+from constants_for_test import *
+from emulation import *
+from util import *
+
+pytestmark = skip_unless_emulator
+
+def ds_counter(card):
+    return get_data_object(card, 0x7a)
+
+def pw1_retry_counter(card):
+    return get_data_object(card, 0xc4)[4]
+
+def setup_card(card):
+    assert card.verify(3, FACTORY_PASSPHRASE_PW3)
+    assert card.cmd_put_data(0x00, 0xf9, KDF_FULL)
+    card.configure_with_kdf()
+    assert card.verify(3, FACTORY_PASSPHRASE_PW3)
+    t = rsa_keys.build_privkey_template(1, 0)
+    assert card.cmd_put_data_odd(0x3f, 0xff, t)
+
+def sign(card):
+    digestinfo = rsa_keys.compute_digestinfo(PLAIN_TEXT0)
+    r = card.cmd_pso(0x9e, 0x9a, digestinfo)
+    sig = rsa_keys.compute_signature(0, digestinfo)
+    assert r == sig.to_bytes(256, byteorder='big')
+
+def test_exit_before_write_behind_of_ds_counter(emulation):
+    card = emulation.start()
+    setup_card(card)
+    assert card.verify(1, FACTORY_PASSPHRASE_PW1)
+    sign(card)
+    assert ds_counter(card) == b'\x93\x03\x00\x00\x01'
+    emulation.stop()
+
+    card = emulation.start("GNUK_EXIT_BEFORE_WRITE_BEHIND")
+    assert card.verify(1, FACTORY_PASSPHRASE_PW1)
+    # The response comes before the process exits
+    sign(card)
+    emulation.wait_exit()
+
+    # The counter misses the last signature, PIN error counter is intact
+    card = emulation.start()
+    assert ds_counter(card) == b'\x93\x03\x00\x00\x01'
+    assert pw1_retry_counter(card) == 3
+    assert card.verify(1, FACTORY_PASSPHRASE_PW1)
+    sign(card)
+    assert ds_counter(card) == b'\x93\x03\x00\x00\x02'
+
+def test_exit_before_write_behind_of_pin_error_reset(emulation):
+    card = emulation.start()
+    setup_card(card)
+    with pytest.raises(ValueError) as e:
+        card.verify(1, PW1_TEST0)
+    assert "6982" in str(e.value)
+    assert pw1_retry_counter(card) == 2
+    emulation.stop()
+
+    card = emulation.start("GNUK_EXIT_BEFORE_WRITE_BEHIND")
+    assert pw1_retry_counter(card) == 2
+    # Reset of PIN error counter is written behind
+    assert card.verify(1, FACTORY_PASSPHRASE_PW1)
+    emulation.wait_exit()
+
+    # The reset is lost, but PIN error counter never increases
+    card = emulation.start()
+    assert pw1_retry_counter(card) == 2
+    assert card.verify(1, FACTORY_PASSPHRASE_PW1)
+    assert pw1_retry_counter(card) == 3
@@ -9,9 +9,10 @@ if __name__ == '__main__':
     gnuk = get_gnuk_device()
     gnuk.cmd_select_openpgp()
     looping = (len(sys.argv) > 1)
+    length = int(sys.argv[2]) if len(sys.argv) > 2 else None
     while True:
         try:
-            challenge = gnuk.cmd_get_challenge().tobytes()
+            challenge = gnuk.cmd_get_challenge(length).tobytes()
         except Exception as e:
             print(count)
             raise e
@@ -414,6 +414,35 @@ class gnuk_token(object):
             raise ValueError("%02x%02x" % (sw[0], sw[1]))
         return self.cmd_get_response(sw[1])
 
+    def cmd_pso_batch_raw(self, p1, p2, data):
+        # Gnuk specific: PSO in batch, by an extended APDU
+        cmd_data = pack('>BBBBBH', 0x00, 0x2b, p1, p2, 0, len(data)) \
+            + data + pack('>H', 0)
+        response = self.icc_send_cmd(cmd_data)
+        if len(response) < 2:
+            raise ValueError(response)
+        sw = response[-2:]
+        if not (sw[0] == 0x90 and sw[1] == 0x00):
+            raise ValueError("%02x%02x" % (sw[0], sw[1]))
+        return response[:-2]
+
+    def cmd_pso_batch(self, p1, p2, digests):
+        # N digests of same length
+        data = pack('>B', len(digests[0])) + b"".join(digests)
+        result = self.cmd_pso_batch_raw(p1, p2, data)
+        result_len = len(result) // len(digests)
+        return [result[i*result_len:(i+1)*result_len]
+                for i in range(len(digests))]
+
+    def cmd_pso_batch_decipher(self, inputs):
+        result = self.cmd_pso_batch_raw(0x80, 0x86, b"".join(inputs))
+        r = []
+        while result:
+            result_len = (result[0] << 8) | result[1]
+            r.append(result[2:2+result_len])
+            result = result[2+result_len:]
+        return r
+
     def cmd_pso_longdata(self, p1, p2, data):
         cmd_data0 = iso7816_compose(0x2a, p1, p2, data[:128], 0x10)
         cmd_data1 = iso7816_compose(0x2a, p1, p2, data[128:])
@@ -492,7 +521,17 @@ class gnuk_token(object):
         if sw[0] != 0x90 and sw[1] != 0x00:
             raise ValueError("%02x%02x" % (sw[0], sw[1]))
 
-    def cmd_get_challenge(self):
+    def cmd_get_challenge(self, length=None):
+        if length:
+            # Extended Le, the response comes at once
+            cmd_data = pack('>BBBBBH', 0x00, 0x84, 0x00, 0x00, 0, length)
+            response = self.icc_send_cmd(cmd_data)
+            if len(response) < 2:
+                raise ValueError(response)
+            sw = response[-2:]
+            if not (sw[0] == 0x90 and sw[1] == 0x00):
+                raise ValueError("%02x%02x" % (sw[0], sw[1]))
+            return response[:-2]
         cmd_data = iso7816_compose(0x84, 0x00, 0x00, '')
         sw = self.icc_send_cmd(cmd_data)
         if len(sw) != 2: